@@ -71,6 +71,8 @@
 #include <sys/resource.h>
 
 #include "llvm_mode/config.h"
+#include "llvm_mode/BufferShm.h"
+#include "llvm_mode/BufferSites.h"
 
 /* Constant score value used to calculate score for a seed. */
 #define HAVOC_START_SCORE 5000
@@ -91,8 +93,21 @@ u64 iterations = 0;
 
 #ifdef __linux__
 #  define HAVE_AFFINITY 1
+#  include <sys/prctl.h>
 #endif /* __linux__ */
 
+#ifndef __APPLE__
+#  include <elf.h>
+#endif /* !__APPLE__ */
+
+/* AVX2 versions of the bitmap scans, picked at runtime by check_simd(). The
+   compiler only has to know the instructions, the build doesn't target them. */
+
+#if defined(__x86_64__) && defined(__GNUC__) && MAP_SIZE_POW2 >= 5
+#  define HAVE_AVX2_KERNELS 1
+#  include <immintrin.h>
+#endif /* __x86_64__ && __GNUC__ */
+
 /* A toggle to export some variables when building as a library. Not very
    useful for the general public. */
 
@@ -151,6 +166,7 @@ EXP_ST u8  skip_deterministic,        /* Skip deterministic stages?       */
            run_over10m,               /* Run time over 10 minutes?        */
            persistent_mode,           /* Running in persistent mode?      */
            deferred_mode,             /* Deferred forkserver mode?        */
+           use_avx2,                  /* AVX2 bitmap kernels usable?      */
            fast_cal;                  /* Try to calibrate faster?         */
 
 static s32 out_fd,                    /* Persistent fd for out_file       */
@@ -165,14 +181,45 @@ static s32 forksrv_pid,               /* PID of the fork server           */
 
 EXP_ST u8* trace_bits;                /* SHM with instrumentation bitmap  */
 
-EXP_ST u8  virgin_bits[MAP_SIZE],     /* Regions yet untouched by fuzzing */
-           virgin_tmout[MAP_SIZE],    /* Bits we haven't seen in tmouts   */
-           virgin_crash[MAP_SIZE];    /* Bits we haven't seen in crashes  */
+/* Sparse trace mode: targets built with AFL_SPARSE_TRACE list the entries
+   they touch after trace_bits (see TOUCHED_LIST_SIZE in config.h), so that
+   run_target() and has_new_bits() only have to look at those. */
+
+static u32* touched;                  /* Count, then touched map indices  */
+
+static u8  touched_raw[TOUCHED_LIST_MAX + 1]; /* Raw counts, classifying */
+
+static u8  sparse_trace,              /* Target lists touched entries?    */
+           trace_listed;              /* touched[] covers all trace_bits? */
+
+/* The maps below are map_size bytes, allocated by setup_shm(). Binaries
+   built with AFL_DENSE_MAP tell how large that is (see DENSE_MAP_SECTION in
+   config.h), all others get MAP_SIZE. With -j, the virgin maps move to
+   shared memory (see start_jobs()). */
 
-static u8  var_bytes[MAP_SIZE];       /* Bytes that appear to be variable */
+EXP_ST u32 map_size = MAP_SIZE;       /* Size of the coverage map         */
+
+static u8  virgin_dist_[BUFFER_DIST_MAP_SIZE];
+
+EXP_ST u8* virgin_bits;               /* Regions yet untouched by fuzzing */
+EXP_ST u8* virgin_tmout;              /* Bits we haven't seen in tmouts   */
+EXP_ST u8* virgin_crash;              /* Bits we haven't seen in crashes  */
+
+static u8* var_bytes;                 /* Bytes that appear to be variable */
+
+static u8* virgin_dist = virgin_dist_; /* Closeness not reached yet       */
+
+static u8  dist_map_mode;             /* AFL_BUFFER_DIST_MAP              */
 
 static s32 shm_id;                    /* ID of the SHM region             */
 
+static buffer_shm_t* buffer_shm;      /* SHM with buffer distance records */
+static s32 buffer_shm_id = -1;        /* ID of the buffer distance SHM    */
+
+static u8  shm_fuzz_mode;             /* Harness takes testcases from SHM */
+static u8* shm_fuzz;                  /* Testcase SHM: u32 length, data   */
+static s32 shm_fuzz_id = -1;          /* ID of the testcase SHM           */
+
 static volatile u8 stop_soon,         /* Ctrl-C pressed?                  */
                    clear_screen = 1,  /* Window resized?                  */
                    child_timed_out;   /* Traced process timed out?        */
@@ -217,7 +264,7 @@ EXP_ST u64 total_crashes,             /* Total number of crashes          */
 static u32 subseq_tmouts;             /* Number of timeouts in a row      */
 
 static u8 *stage_name = "init",       /* Name of the current fuzz stage   */
-          *stage_short,               /* Short stage name                 */
+          *stage_short = "init",      /* Short stage name                 */
           *syncing_party;             /* Currently syncing with...        */
 
 static s32 stage_cur, stage_max;      /* Stage progression                */
@@ -267,7 +314,8 @@ struct queue_entry {
       favored,                        /* Currently favored?               */
       fs_redundant;                   /* Marked as redundant in the fs?   */
 
-  u32 score;                          /* Score of this entry              */
+  u32 id;                             /* Number in the file name, index   */
+                                      /* into queue_by_id and seed_favor  */
 
   u32 bitmap_size,                    /* Number of bits set in bitmap     */
       exec_cksum;                     /* Checksum of the execution trace  */
@@ -289,8 +337,61 @@ static struct queue_entry *queue,     /* Fuzzing queue (linked list)      */
                           *queue_top, /* Top of the list                  */
                           *q_prev100; /* Previous 100 marker              */
 
-static struct queue_entry*
-  top_rated[MAP_SIZE];                /* Top entries for bitmap bytes     */
+static struct queue_entry**
+  top_rated;                          /* Top entries for bitmap bytes     */
+
+static struct queue_entry**
+  queue_by_id;                        /* Queue entries by ID, or NULL     */
+static u32 queue_by_id_slots;         /* Allocated slots in queue_by_id   */
+
+static u32* seed_favor;               /* Favorability of the geps held by */
+                                      /* each seed, by queue ID           */
+static u32 seed_favor_slots;          /* Allocated slots in seed_favor    */
+
+/*
+  Multi-worker mode (-j). The first worker forks the others after the dry run, so the initial
+  queue is calibrated once. Every worker has its own forkserver, trace_bits and buffer SHM, and
+  shares the rest through a MAP_SHARED mapping: the virgin maps, the buffer distance table with the
+  favorability of every seed, and a log of queue entries. Workers publish their finds to the log
+  and import the finds of the others from it without running them again.
+*/
+
+struct job_entry {
+  u32 state;                          /* JOB_ENTRY_*, set last            */
+  u32 owner;                          /* Worker that found it             */
+  u32 len;                            /* Input length                     */
+  u32 bitmap_size,                    /* As in struct queue_entry         */
+      exec_cksum;
+  u8  has_new_cov,
+      var_behavior;
+  u64 exec_us,
+      depth;
+  u8  fname[JOBS_FNAME_MAX];          /* File name within queue/          */
+};
+
+#define JOB_ENTRY_PENDING 0           /* ID reserved, not written yet     */
+#define JOB_ENTRY_READY   1
+#define JOB_ENTRY_LOCAL   2           /* Can't be shared, skip it         */
+
+struct job_state {
+  u32 queue_ids;                      /* Next queue ID to hand out        */
+  u32 dist_lock;                      /* Guards the distance table, holds */
+                                      /* the owner's worker ID + 1        */
+  u32 dist_important_cnt;             /* See dist_important               */
+  u64 crash_ids,                      /* Next crashes/ and hangs/ IDs     */
+      hang_ids;
+  u8  dead[JOBS_MAX];                 /* Workers that died, by worker ID  */
+};
+
+static u32 jobs = 1,                  /* Number of workers (-j)           */
+           job_id,                    /* This worker, 0 for the first one */
+           job_imported;              /* Log entries looked at so far     */
+
+static struct job_state* job_state;   /* Shared state, NULL without -j    */
+static struct job_entry* job_queue;   /* Shared queue log, by queue ID    */
+static s32 job_pids[JOBS_MAX];        /* PIDs of the other workers        */
+static char** job_args;               /* Target arguments before @@ was   */
+                                      /* replaced                         */
 
 struct extra_data {
   u8* data;                           /* Dictionary token data            */
@@ -306,6 +407,11 @@ static u32 a_extras_cnt;              /* Total number of tokens available */
 
 static int buffer_distance = 0;          
 
+static u64 buffer_records_dropped;    /* Records that did not fit the SHM */
+
+static buffer_shm_record_t buffer_crash; /* AFL_BUFFER_FAIL_FAST record of
+                                            the last run, gep_id 0 if none */
+
 static u8* (*post_handler)(u8* buf, u32* len);
 
 /* Interesting values, as per config.h */
@@ -798,6 +904,10 @@ static void mark_as_redundant(struct queue_entry* q, u8 state) {
 
   q->fs_redundant = state;
 
+  /* With -j, every worker decides on its own; only the first one records it. */
+
+  if (job_id) return;
+
   fn = strrchr(q->fname, '/');
   fn = alloc_printf("%s/queue/.state/redundant_edges/%s", out_dir, fn + 1);
 
@@ -820,7 +930,7 @@ static void mark_as_redundant(struct queue_entry* q, u8 state) {
 
 /* Append new test case to the queue. */
 
-static struct queue_entry* add_to_queue(u8* fname, u32 len, u8 passed_det, u32 buffer_score) {
+static struct queue_entry* add_to_queue(u8* fname, u32 len, u8 passed_det, u32 id) {
 
   struct queue_entry* q = ck_alloc(sizeof(struct queue_entry));
 
@@ -828,7 +938,33 @@ static struct queue_entry* add_to_queue(u8* fname, u32 len, u8 passed_det, u32 b
   q->len          = len;
   q->depth        = cur_depth + 1;
   q->passed_det   = passed_det;
-  q->score        = buffer_score;  
+  q->id           = id;
+
+  /* With -j, other workers may be reading the file at any time, so it is
+     never rewritten. */
+
+  if (job_state) q->trim_done = 1;
+
+  if (id >= queue_by_id_slots) {
+
+    u32 slots = queue_by_id_slots ? queue_by_id_slots : 1024;
+
+    while (slots <= id) slots *= 2;
+
+    /* ck_realloc() zeroes the new tail. The shared seed_favor of -j does not grow. */
+
+    queue_by_id = ck_realloc(queue_by_id, slots * sizeof(struct queue_entry*));
+
+    if (!job_state) {
+      seed_favor = ck_realloc(seed_favor, slots * sizeof(u32));
+      seed_favor_slots = slots;
+    }
+
+    queue_by_id_slots = slots;
+
+  }
+
+  queue_by_id[id] = q;
 
   if (q->depth > max_depth) max_depth = q->depth;
 
@@ -874,6 +1010,126 @@ EXP_ST void destroy_queue(void) {
 
   }
 
+  ck_free(queue_by_id);
+  if (!job_state) ck_free(seed_favor);
+
+}
+
+
+/* ID for the next queue entry, used in its file name. With -j, IDs are
+   handed out to all workers from one counter. */
+
+static u32 next_queue_id(void) {
+
+  if (job_state) {
+
+    u32 id = __atomic_fetch_add(&job_state->queue_ids, 1, __ATOMIC_RELAXED);
+
+    /* Claim the slot, so that the others can tell if it is never going to
+       be published (see import_job_entries()). */
+
+    if (id < JOBS_QUEUE_MAX) __atomic_store_n(&job_queue[id].owner, job_id, __ATOMIC_RELAXED);
+
+    return id;
+
+  }
+
+  return queued_paths;
+
+}
+
+
+/* Same for crashes/ or hangs/. */
+
+static u64 next_fault_id(u8 crash) {
+
+  if (job_state)
+    return __atomic_fetch_add(crash ? &job_state->crash_ids : &job_state->hang_ids, 1,
+                              __ATOMIC_RELAXED);
+
+  return crash ? unique_crashes : unique_hangs;
+
+}
+
+
+/* Hand a new queue entry to the other workers. Its file has to be written
+   already. */
+
+static void publish_queue_entry(struct queue_entry* q) {
+
+  struct job_entry* e;
+  u8* fn = strrchr(q->fname, '/') + 1;
+
+  if (!job_state || q->id >= JOBS_QUEUE_MAX) return;
+
+  e = &job_queue[q->id];
+
+  if (strlen(fn) >= JOBS_FNAME_MAX) {
+    __atomic_store_n(&e->state, JOB_ENTRY_LOCAL, __ATOMIC_RELEASE);
+    return;
+  }
+
+  e->owner        = job_id;
+  e->len          = q->len;
+  e->bitmap_size  = q->bitmap_size;
+  e->exec_cksum   = q->exec_cksum;
+  e->has_new_cov  = q->has_new_cov;
+  e->var_behavior = q->var_behavior;
+  e->exec_us      = q->exec_us;
+  e->depth        = q->depth;
+  strcpy((char*)e->fname, (char*)fn);
+
+  /* Pairs with the acquire load in import_job_entries(). */
+
+  __atomic_store_n(&e->state, JOB_ENTRY_READY, __ATOMIC_RELEASE);
+
+}
+
+
+/* Add the entries other workers published since the last call to the queue.
+   They were calibrated by the worker that found them, so there is no need to
+   run them again. Entries are taken in ID order; one that is still being
+   written holds back the ones after it until the next call, unless the
+   worker that claimed it has died. */
+
+static void import_job_entries(void) {
+
+  u32 end = MIN(__atomic_load_n(&job_state->queue_ids, __ATOMIC_RELAXED), JOBS_QUEUE_MAX);
+
+  while (job_imported < end) {
+
+    struct job_entry* e = &job_queue[job_imported];
+    u32 state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+
+    if (state == JOB_ENTRY_PENDING) {
+
+      u32 owner = __atomic_load_n(&e->owner, __ATOMIC_RELAXED);
+
+      if (owner >= JOBS_MAX || !__atomic_load_n(&job_state->dead[owner], __ATOMIC_ACQUIRE))
+        break;
+
+    } else if (state == JOB_ENTRY_READY && e->owner != job_id) {
+
+      struct queue_entry* q = add_to_queue(alloc_printf("%s/queue/%s", out_dir, e->fname),
+                                           e->len, 0, job_imported);
+
+      q->bitmap_size  = e->bitmap_size;
+      q->exec_cksum   = e->exec_cksum;
+      q->has_new_cov  = e->has_new_cov;
+      q->var_behavior = e->var_behavior;
+      q->exec_us      = e->exec_us;
+      q->depth        = e->depth;
+
+      if (q->depth > max_depth) max_depth = q->depth;
+
+      queued_imported++;
+
+    }
+
+    job_imported++;
+
+  }
+
 }
 
 
@@ -886,7 +1142,9 @@ EXP_ST void write_bitmap(void) {
   u8* fname;
   s32 fd;
 
-  if (!bitmap_changed) return;
+  /* With -j, the map is shared and the first worker writes it for all, whoever changed it. */
+
+  if (job_id || (!bitmap_changed && !job_state)) return;
   bitmap_changed = 0;
 
   fname = alloc_printf("%s/fuzz_bitmap", out_dir);
@@ -894,7 +1152,7 @@ EXP_ST void write_bitmap(void) {
 
   if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-  ck_write(fd, virgin_bits, MAP_SIZE, fname);
+  ck_write(fd, virgin_bits, map_size, fname);
 
   close(fd);
   ck_free(fname);
@@ -910,13 +1168,215 @@ EXP_ST void read_bitmap(u8* fname) {
 
   if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-  ck_read(fd, virgin_bits, MAP_SIZE, fname);
+  ck_read(fd, virgin_bits, map_size, fname);
 
   close(fd);
 
 }
 
 
+#ifdef HAVE_AVX2_KERNELS
+
+/* AVX2 versions of has_new_bits(), classify_counts(), simplify_trace() and
+   the count_*() functions. They take 32 bytes per step, skip vectors with
+   nothing to do with a single test and give exactly the same results as the
+   scalar code, which benchmarks/fuzz_bench cross-checks. */
+
+#define AVX2_FN __attribute__((target("avx2,popcnt")))
+
+static const u8 count_class_lo[16] = {
+  0, 1, 2, 4, 8, 8, 8, 8, 16, 16, 16, 16, 16, 16, 16, 16
+};
+
+static const u8 count_class_hi[16] = {
+  0, 32, 64, 64, 64, 64, 64, 64, 128, 128, 128, 128, 128, 128, 128, 128
+};
+
+static AVX2_FN u8 has_new_bits_avx2(u8* virgin_map) {
+
+  u8* cur = trace_bits;
+  u8* vir = virgin_map;
+  u8* end = trace_bits + map_size;
+  u8  ret = 0;
+
+  for (; cur < end; cur += 32, vir += 32) {
+
+    __m256i c = _mm256_loadu_si256((__m256i*)cur);
+    u32 i, j;
+
+    if (likely(_mm256_testz_si256(c, c)) ||
+        likely(_mm256_testz_si256(c, _mm256_loadu_si256((__m256i*)vir))))
+      continue;
+
+    /* Something is new, update the words the way has_new_bits() does. */
+
+    for (i = 0; i < 32; i += 8) {
+
+      u64 c64 = *(u64*)(cur + i);
+      u64 prev;
+
+      if (!(c64 & *(u64*)(vir + i))) continue;
+
+      prev = __atomic_fetch_and((u64*)(vir + i), ~c64, __ATOMIC_RELAXED);
+
+      if (ret == 2 || !(c64 & prev)) continue;
+
+      ret = 1;
+
+      for (j = 0; j < 8; j++)
+        if (cur[i + j] && ((u8*)&prev)[j] == 0xff) ret = 2;
+
+    }
+
+  }
+
+  return ret;
+
+}
+
+
+/* Counts below 16 are classified by their low nibble, all others by their
+   high nibble. */
+
+static AVX2_FN void classify_counts_avx2(u8* mem) {
+
+  __m256i lo_class = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)count_class_lo));
+  __m256i hi_class = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*)count_class_hi));
+  __m256i nibble   = _mm256_set1_epi8(0x0f);
+  __m256i zero     = _mm256_setzero_si256();
+  u8*     end      = mem + map_size;
+
+  for (; mem < end; mem += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)mem);
+    __m256i lo, hi;
+
+    if (likely(_mm256_testz_si256(v, v))) continue;
+
+    hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    lo = _mm256_and_si256(_mm256_shuffle_epi8(lo_class, _mm256_and_si256(v, nibble)),
+                          _mm256_cmpeq_epi8(hi, zero));
+
+    _mm256_storeu_si256((__m256i*)mem,
+                        _mm256_or_si256(lo, _mm256_shuffle_epi8(hi_class, hi)));
+
+  }
+
+}
+
+
+static AVX2_FN void simplify_trace_avx2(u8* mem) {
+
+  __m256i hit  = _mm256_set1_epi8(0x80);
+  __m256i none = _mm256_set1_epi8(1);
+  __m256i zero = _mm256_setzero_si256();
+  u8*     end  = mem + map_size;
+
+  for (; mem < end; mem += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)mem);
+
+    _mm256_storeu_si256((__m256i*)mem,
+                        _mm256_blendv_epi8(hit, none, _mm256_cmpeq_epi8(v, zero)));
+
+  }
+
+}
+
+
+static AVX2_FN u32 count_bits_avx2(u8* mem) {
+
+  __m256i ones = _mm256_set1_epi8(0xff);
+  u32     ret  = 0, i;
+
+  for (i = 0; i < map_size; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i));
+    u64*    w = (u64*)(mem + i);
+
+    if (likely(_mm256_testc_si256(v, ones))) {
+      ret += 256;
+      continue;
+    }
+
+    ret += __builtin_popcountll(w[0]) + __builtin_popcountll(w[1]) +
+           __builtin_popcountll(w[2]) + __builtin_popcountll(w[3]);
+
+  }
+
+  return ret;
+
+}
+
+
+static AVX2_FN u32 count_bytes_avx2(u8* mem) {
+
+  __m256i zero = _mm256_setzero_si256();
+  u32     ret  = 0, i;
+
+  for (i = 0; i < map_size; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i));
+
+    if (likely(_mm256_testz_si256(v, v))) continue;
+
+    ret += 32 - __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)));
+
+  }
+
+  return ret;
+
+}
+
+
+static AVX2_FN u32 count_non_255_bytes_avx2(u8* mem) {
+
+  __m256i ones = _mm256_set1_epi8(0xff);
+  u32     ret  = 0, i;
+
+  for (i = 0; i < map_size; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i));
+
+    if (likely(_mm256_testc_si256(v, ones))) continue;
+
+    ret += 32 - __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones)));
+
+  }
+
+  return ret;
+
+}
+
+#endif /* HAVE_AVX2_KERNELS */
+
+
+/* has_new_bits() for a trace whose non-zero bytes are all in touched[]. */
+
+static inline u8 has_new_bits_touched(u8* virgin_map) {
+
+  u32 cnt = touched[0], i;
+  u8  ret = 0;
+
+  for (i = 1; i <= cnt; i++) {
+
+    u8* vir = virgin_map + touched[i];
+    u8  cur = trace_bits[touched[i]];
+    u8  prev;
+
+    if (likely(!(cur & *vir))) continue;
+
+    prev = __atomic_fetch_and(vir, ~cur, __ATOMIC_RELAXED);
+
+    if (ret < 2 && (cur & prev)) ret = (prev == 0xff) ? 2 : 1;
+
+  }
+
+  return ret;
+
+}
+
+
 /* Check if the current execution path brings anything new to the table.
    Update virgin bits to reflect the finds. Returns 1 if the only change is
    the hit-count for a particular tuple; 2 if there are new tuples seen. 
@@ -932,19 +1392,43 @@ static inline u8 has_new_bits(u8* virgin_map) {
   u64* current = (u64*)trace_bits;
   u64* virgin  = (u64*)virgin_map;
 
-  u32  i = (MAP_SIZE >> 3);
+  u32  i = (map_size >> 3);
 
 #else
 
   u32* current = (u32*)trace_bits;
   u32* virgin  = (u32*)virgin_map;
 
-  u32  i = (MAP_SIZE >> 2);
+  u32  i = (map_size >> 2);
 
 #endif /* ^WORD_SIZE_64 */
 
   u8   ret = 0;
 
+  if (trace_listed) {
+
+    ret = has_new_bits_touched(virgin_map);
+
+    if (ret && virgin_map == virgin_bits) bitmap_changed = 1;
+
+    return ret;
+
+  }
+
+#ifdef HAVE_AVX2_KERNELS
+
+  if (use_avx2) {
+
+    ret = has_new_bits_avx2(virgin_map);
+
+    if (ret && virgin_map == virgin_bits) bitmap_changed = 1;
+
+    return ret;
+
+  }
+
+#endif /* HAVE_AVX2_KERNELS */
+
   while (i--) {
 
     /* Optimize for (*current & *virgin) == 0 - i.e., no bits in current bitmap
@@ -953,10 +1437,19 @@ static inline u8 has_new_bits(u8* virgin_map) {
 
     if (unlikely(*current) && unlikely(*current & *virgin)) {
 
-      if (likely(ret < 2)) {
+      /* With -j, the virgin maps are shared and other workers clear bits at
+         the same time. Only the worker that clears a bit reports it. */
+
+#ifdef WORD_SIZE_64
+      u64  prev = __atomic_fetch_and(virgin, ~*current, __ATOMIC_RELAXED);
+#else
+      u32  prev = __atomic_fetch_and(virgin, ~*current, __ATOMIC_RELAXED);
+#endif /* ^WORD_SIZE_64 */
+
+      if (likely(ret < 2) && (*current & prev)) {
 
         u8* cur = (u8*)current;
-        u8* vir = (u8*)virgin;
+        u8* vir = (u8*)&prev;
 
         /* Looks like we have not found any new bytes yet; see if any non-zero
            bytes in current[] are pristine in virgin[]. */
@@ -979,8 +1472,6 @@ static inline u8 has_new_bits(u8* virgin_map) {
 
       }
 
-      *virgin &= ~*current;
-
     }
 
     current++;
@@ -995,15 +1486,46 @@ static inline u8 has_new_bits(u8* virgin_map) {
 }
 
 
+/* Check if the target got closer to the end of a buffer than ever before, using the
+   closeness map in the buffer SHM (see llvm_mode/BufferShm.h). Works like has_new_bits(),
+   every new bit in virgin_dist is a gep that reached a closer bucket. */
+
+static inline u8 has_new_dist_bits(void) {
+
+  u64* current = (u64*)buffer_shm->dist_map;
+  u64* virgin  = (u64*)virgin_dist;
+
+  u32  i = (BUFFER_DIST_MAP_SIZE >> 3);
+  u8   ret = 0;
+
+  while (i--) {
+
+    if (unlikely(*current) && unlikely(*current & *virgin) &&
+        (__atomic_fetch_and(virgin, ~*current, __ATOMIC_RELAXED) & *current)) ret = 1;
+
+    current++;
+    virgin++;
+
+  }
+
+  return ret;
+
+}
+
+
 /* Count the number of bits set in the provided bitmap. Used for the status
    screen several times every second, does not have to be fast. */
 
 static u32 count_bits(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
+#ifdef HAVE_AVX2_KERNELS
+  if (use_avx2) return count_bits_avx2(mem);
+#endif /* HAVE_AVX2_KERNELS */
+
   while (i--) {
 
     u32 v = *(ptr++);
@@ -1036,9 +1558,13 @@ static u32 count_bits(u8* mem) {
 static u32 count_bytes(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
+#ifdef HAVE_AVX2_KERNELS
+  if (use_avx2) return count_bytes_avx2(mem);
+#endif /* HAVE_AVX2_KERNELS */
+
   while (i--) {
 
     u32 v = *(ptr++);
@@ -1055,7 +1581,7 @@ static u32 count_bytes(u8* mem) {
 
 }
 
-void log_shared_memory(char* shared_memory)
+void log_shared_memory(buffer_shm_t* shared_memory)
 {
   FILE* log_file = fopen("shared_memory.log", "w");
 
@@ -1065,363 +1591,621 @@ void log_shared_memory(char* shared_memory)
     exit(1);
   }
   
-  uint32_t shared_mem_offset = 0;
-  while(1)
+  u32 count = MIN(shared_memory->header.count, BUFFER_DATA_CHUNK_COUNT);
+
+  for (u32 i = 0; i < count; i++)
   {
-    uint32_t buffer_id = 0;
-    uint64_t gep_id = 0;
-    int64_t distance = 0;
+    buffer_shm_record_t* record = &shared_memory->records[i];
 
-    if (shared_mem_offset + sizeof(buffer_id) + sizeof(gep_id) + sizeof(distance) > SHARED_MEM_SIZE)
+    if (record->distance == -10 && record->buffer_id != 377) 
     {
-      break;
+      fprintf(log_file, "Buffer Overflow triggered.\n");
     }
 
-    /* Get buffer ID from shared memory. */
-    memcpy(&buffer_id, shared_memory + shared_mem_offset, sizeof(buffer_id));
-    shared_mem_offset += sizeof(buffer_id);
+    fprintf(log_file, "Buffer ID: %d, GEP ID: %ld, Distance: %ld\n", record->buffer_id, record->gep_id, record->distance);
 
-    /* Get getelementptr id from shared memory. */
-    memcpy(&gep_id, shared_memory + shared_mem_offset, sizeof(gep_id));
-    shared_mem_offset += sizeof(gep_id);
-
-    /* Get distance from shared memory. */
-    memcpy(&distance, shared_memory + shared_mem_offset, sizeof(distance));
-    shared_mem_offset += sizeof(distance);
-
-    if (distance == -10 && buffer_id != 377) 
-    {
-      fprintf(log_file, "Buffer Overflow triggered.\n");
-    }
-
-    if (buffer_id == 0 && gep_id == 0 && distance == 0)
-    {
-      break;
-    }
-
-    fprintf(log_file, "Buffer ID: %d, GEP ID: %ld, Distance: %ld\n", buffer_id, gep_id, distance);
+  }
 
+  if (shared_memory->header.overflow)
+  {
+    fprintf(log_file, "%u records did not fit into shared memory.\n", shared_memory->header.overflow);
   }
 
   fclose(log_file);
 }
 
 /*  
-This array holds the information about each found buffer in the SUT and for each buffer at location
-i it stores every gep instruction made on that buffer as a linked list. It also stores the inforamtion
-of which seed has caused the access and the favorability of this buffer.
+The buffer distance table holds, for every getelementptr instruction (gep) of the SUT, the smallest
+distance to the end of a buffer seen so far, the buffer it was seen on, which seed has caused it and
+how favorable this access is. gep IDs are dense, so the table is indexed by gep ID directly. It is
+laid out as a structure of arrays and grows on demand, up to BUFFER_DIST_MAX_GEPS slots.
 */
 
-struct buffer_entry 
-{
-  /* Data about access of this buffer */
-  uint64_t gep_id; 
-  int64_t distance;
-
-  /* Which Seed has caused this particular access? */
-  struct queue_entry* seed;
-
-  /* How favorable is this Buffer access */
-  enum favorability_t {
-        UNFAVORABLE = 0,
-        NEUTRAL = 1,
-        FAVORABLE = 2,
-        VERY_FAVORABLE = 4
-    } favorability;
-
-  /* Pointer to the next buffer entry */
-  struct buffer_entry* next;
+enum favorability_t {
+  UNFAVORABLE = 0,
+  NEUTRAL = 1,
+  FAVORABLE = 2,
+  VERY_FAVORABLE = 4
 };
 
-struct buffer_entry* buffer_distance_map[BUFFER_DATA_CHUNK_COUNT] = { NULL };
+/* Distance of a gep that has not been seen yet. */
 
-/* 
-Update the buffer distances of the buffer_distance_map array based on the data in the shared memory.
-This function returns true if any of the buffer distances have been updated.
+#define DIST_UNSEEN ((s64)0x7fffffffffffffffLL)
 
-If any of the buffers in the shared memory have a distance smallere then or euql zero, the variable 
-'has_buffer_overflow' is set to true.
+/* Initial number of slots in the table. */
+
+#define DIST_TABLE_INIT 4096
+
+static u32 dist_slots;                /* Allocated slots in the table     */
+static s64* dist_min;                 /* Smallest distance per gep        */
+static u8*  dist_favor;               /* Favorability per gep             */
+static u32* dist_buffer;              /* Buffer of the smallest distance  */
+static u32* dist_seed;                /* Queue ID + 1 of the seed causing */
+                                      /* the distance, 0 if none          */
+
+/* geps whose distance went down in the last execution and the distance, their seed is set once it
+   has been saved. */
+
+static u32 dist_updated[BUFFER_DATA_CHUNK_COUNT];
+static s64 dist_updated_min[BUFFER_DATA_CHUNK_COUNT];
+static u32 dist_updated_cnt;
+
+/* geps that are classified as NEUTRAL, FAVORABLE or VERY FAVORABLE, every gep is in here at most once.
+   The count lives in the shared state with -j. */
+
+static u32* dist_important;
+static u32  dist_important_local;
+static u32* dist_important_cnt = &dist_important_local;
+
+/* Resize the buffer distance table to exactly 'new_slots' entries, never shrinks it. */
+
+static void resize_distance_table(u32 new_slots) {
+
+  u32 i;
+
+  if (new_slots <= dist_slots) return;
+
+  /* ck_realloc() zeroes the new tail, so only the distances need to be set. */
+
+  dist_min       = ck_realloc(dist_min, new_slots * sizeof(s64));
+  dist_favor     = ck_realloc(dist_favor, new_slots);
+  dist_buffer    = ck_realloc(dist_buffer, new_slots * sizeof(u32));
+  dist_seed      = ck_realloc(dist_seed, new_slots * sizeof(u32));
+  dist_important = ck_realloc(dist_important, new_slots * sizeof(u32));
+
+  for (i = dist_slots; i < new_slots; i++) dist_min[i] = DIST_UNSEEN;
+
+  dist_slots = new_slots;
+
+}
+
+/* Make room for 'gep_id' in the buffer distance table. Returns 0 if it is out of range. */
+
+static u8 grow_distance_table(u64 gep_id) {
+
+  u32 new_slots = dist_slots ? dist_slots : DIST_TABLE_INIT;
+
+  /* The shared table of -j is sized once, before the workers start. */
+
+  if (gep_id >= BUFFER_DIST_MAX_GEPS || job_state) return 0;
+
+  while (new_slots <= gep_id) new_slots *= 2;
+
+  resize_distance_table(new_slots);
+
+  return 1;
+
+}
+
+/*
+  The favorability of all geps held by a seed is summed up in its 'seed_favor' slot, so that
+  calculate_score_buffer_map() does not have to look at the table. The two helpers below are the only
+  places that change the seed or the favorability of a gep and keep the sums up to date. With -j,
+  they must be called with the table locked.
 */
 
-struct updated_buffer_entry 
-{
-  struct buffer_entry* updated_buffer_entry;
+static void set_dist_favor(u32 gep_id, u8 favor) {
 
-  struct updated_buffer_entry* next;
-};
+  u32 seed = dist_seed[gep_id];
 
-/* A queue that contains all entries, that are classified as NEUTRAL, FAVORABLE or VERY FAVORABLE. */
+  if (seed) seed_favor[seed - 1] += favor - dist_favor[gep_id];
 
-struct important_buffer_queue
-{
-  struct buffer_entry* buffer_entry;
+  dist_favor[gep_id] = favor;
 
-  struct important_buffer_queue* next;
-};
+}
 
-struct important_buffer_queue* important_buffer_queue_head = NULL;
+static void set_dist_seed(u32 gep_id, struct queue_entry* q) {
 
-/* Log distance for the passed buffer_entry and write it to file */
+  u32 seed = dist_seed[gep_id];
 
-void log_data_buffer_entry(u32 buffer_id, struct buffer_entry* buffer_entry)
-{
-  FILE* log_file = fopen("buffer_distance.log", "a");
+  /* Seeds past the shared seed_favor of -j can't hold geps. */
 
-  if (log_file == NULL)
-  {
-    printf("Error opening file!\n");
-    exit(1);
-  }
+  if (q && q->id >= seed_favor_slots) return;
 
-  fprintf(log_file, "Buffer ID: %d, GEP ID: %ld, Distance: %ld\n", buffer_id, buffer_entry->gep_id, buffer_entry->distance);
+  if (seed == (q ? q->id + 1 : 0)) return;
+
+  if (seed) seed_favor[seed - 1] -= dist_favor[gep_id];
+  if (q) seed_favor[q->id] += dist_favor[gep_id];
+
+  dist_seed[gep_id] = q ? q->id + 1 : 0;
 
-  fclose(log_file);
 }
 
-u8 update_buffer_distances(struct updated_buffer_entry** updated_buffer_entry, u8* has_buffer_overflow)
-{
-  u8 updated_seed_map = 0;
-  u32 buffer_distance_map_size = BUFFER_DATA_CHUNK_COUNT;
-  u32 chunk_size = CHUNK_SIZE;
-  u32 shared_mem_size = SHARED_MEM_SIZE;
+/* With -j, the table is shared by all workers. Lookups are not locked, changes are. The lock
+   knows its owner, so that check_jobs() can release it if the owner dies. */
 
-  key_t key = ftok("/bin/clang", 1);
+static void dist_lock(void) {
 
-  int shmid = shmget(key, SHARED_MEM_SIZE, 0666);
-  if (shmid < 0) {
-      perror("shmget-afl");
-      return 1;
+  u32 free_lock = 0;
+
+  if (!job_state) return;
+
+  while (!__atomic_compare_exchange_n(&job_state->dist_lock, &free_lock, job_id + 1, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    free_lock = 0;
+    sched_yield();
   }
 
-  char* __shared_memory_ = shmat(shmid, NULL, 0);
+}
 
-  if (__shared_memory_ == (char*) -1) {
-    perror("shmat");
-    return 1;
+static void dist_unlock(void) {
+
+  if (job_state) __atomic_store_n(&job_state->dist_lock, 0, __ATOMIC_RELEASE);
+
+}
+
+#ifndef __APPLE__
+
+/* Find a section of the ELF binary at f_data by name. Scripts, 32 bit and
+   foreign binaries have none. */
+
+static Elf64_Shdr* find_elf_section(u8* f_data, u64 f_len, u8* name) {
+
+  Elf64_Ehdr* ehdr = (Elf64_Ehdr*)f_data;
+  Elf64_Shdr* shdr;
+  Elf64_Shdr* strtab;
+  u8* names;
+  u32 i;
+
+  if (f_len < sizeof(Elf64_Ehdr) ||
+      memcmp(ehdr->e_ident, ELFMAG, SELFMAG) || ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+      ehdr->e_shentsize != sizeof(Elf64_Shdr) || ehdr->e_shstrndx >= ehdr->e_shnum ||
+      ehdr->e_shoff > f_len ||
+      (u64)ehdr->e_shnum * sizeof(Elf64_Shdr) > f_len - ehdr->e_shoff) return NULL;
+
+  shdr   = (Elf64_Shdr*)(f_data + ehdr->e_shoff);
+  strtab = shdr + ehdr->e_shstrndx;
+
+  /* The section names have to be in the file, too. */
+
+  if (strtab->sh_offset > f_len || strtab->sh_size > f_len - strtab->sh_offset)
+    return NULL;
+
+  names = f_data + strtab->sh_offset;
+
+  for (i = 0; i < ehdr->e_shnum; i++)
+    if ((u64)shdr[i].sh_name + strlen(name) + 1 <= strtab->sh_size &&
+        !strcmp((char*)names + shdr[i].sh_name, name)) return shdr + i;
+
+  return NULL;
+
+}
+
+#endif /* !__APPLE__ */
+
+/* Get the map size of binaries built with AFL_DENSE_MAP from the size of
+   DENSE_MAP_SECTION, see config.h. Called before setup_shm(). */
+
+static void load_map_size(void) {
+
+#ifndef __APPLE__
+
+  struct stat st;
+  Elf64_Shdr* shdr;
+  u8* f_data;
+  u64 size;
+  s32 fd;
+
+  fd = open(target_path, O_RDONLY);
+  if (fd < 0) return;
+
+  if (fstat(fd, &st)) {
+    close(fd);
+    return;
   }
 
-  // log_shared_memory(__shared_memory_);
-  
-  uint32_t shared_mem_offset = 0;
-  while(1)
-  {
-    uint32_t buffer_id = 0;
-    uint64_t gep_id = 0;
-    int64_t distance = 0;
+  f_data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
 
-    if (shared_mem_offset + sizeof(buffer_id) + sizeof(gep_id) + sizeof(distance) > SHARED_MEM_SIZE)
-    {
-      break;
-    }
+  if (f_data == MAP_FAILED) return;
 
-    /* Get buffer ID from shared memory. */
-    memcpy(&buffer_id, __shared_memory_ + shared_mem_offset, sizeof(buffer_id));
-    shared_mem_offset += sizeof(buffer_id);
+  shdr = find_elf_section(f_data, st.st_size, DENSE_MAP_SECTION);
 
-    /* Get getelementptr id from shared memory. */
-    memcpy(&gep_id, __shared_memory_ + shared_mem_offset, sizeof(gep_id));
-    shared_mem_offset += sizeof(gep_id);
+  if (shdr) {
 
-    /* Get distance from shared memory. */
-    memcpy(&distance, __shared_memory_ + shared_mem_offset, sizeof(distance));
-    shared_mem_offset += sizeof(distance);
+    if (find_elf_section(f_data, st.st_size, CLASSIC_MAP_SECTION))
+      FATAL("The target mixes modules built with and without AFL_DENSE_MAP");
+
+    size = shdr->sh_size + 1;
+
+    if (size > DENSE_MAP_MAX)
+      FATAL("The coverage map of the target is too large (%llu entries, max %u)",
+            size, DENSE_MAP_MAX);
+
+    /* The scans go through the map 32 or 64 bytes at a time. */
+
+    map_size = (size + 63) & ~63;
+
+    OKF("Target has a dense coverage map with %llu entries.", size);
+
+    if (sparse_trace) {
+
+      WARNF("Sparse trace mode doesn't work with dense maps, disabling it.");
+
+      unsetenv(SPARSE_ENV_VAR);
+      sparse_trace = 0;
 
-    if (buffer_id == 0 && gep_id == 0 && distance == 0)
-    {
-      break;
     }
 
-    buffer_id = buffer_id % buffer_distance_map_size;
+  }
 
-    struct buffer_entry* current_buffer_entry = buffer_distance_map[buffer_id];
+  munmap(f_data, st.st_size);
 
-    /* Iterate through each access mad on this buffer */
-    while (current_buffer_entry)
-    {
-      if (current_buffer_entry->gep_id == gep_id)
-      {
-        if (current_buffer_entry->distance > distance)
-        {
+#endif /* !__APPLE__ */
 
-          if (distance < 0) 
-          {
-            buffer_distance = distance;
-            *has_buffer_overflow = 1;
-          }
+}
 
-          #ifdef LOG_BUFFER_DATA 
-            if (buffer_id == 405)
-            {
-              log_data_buffer_entry(buffer_id, current_buffer_entry);
-            }
-          #endif
-
-          /* Add this buffer to the queue containing other important buffers. */
-          if (important_buffer_queue_head == NULL)
-          {
-            important_buffer_queue_head = malloc(sizeof(struct important_buffer_queue));
-            important_buffer_queue_head->buffer_entry = current_buffer_entry;
-            important_buffer_queue_head->next = NULL;
-          } else 
-          {
-            struct important_buffer_queue* new_important_buffer_queue = malloc(sizeof(struct important_buffer_queue));
-            new_important_buffer_queue->buffer_entry = current_buffer_entry;
-            new_important_buffer_queue->next = important_buffer_queue_head;
-            important_buffer_queue_head = new_important_buffer_queue;
-          }
 
-          updated_seed_map = 1;
+/*
+  Compile time sites of the target, see llvm_mode/BufferSites.h. load_buffer_sites() reads them from
+  the binary before the first run, write_buffer_sites() checks them against what the target reports
+  in the shared memory header and writes them to the 'buffer_sites' file for triage.
+*/
 
-          current_buffer_entry->distance = distance;
+static u8* buffer_sites;              /* Contents of the section, or NULL */
+static u32 buffer_sites_len;          /* Size of the section              */
+static u32 buffer_sites_modules;      /* Number of blobs in the section   */
+static u32 buffer_sites_chain_;       /* Expected module chain            */
 
-          /* We found a new minmal distance, so we increase the favorability. */
-          if (current_buffer_entry->favorability < VERY_FAVORABLE)
-          {
-            current_buffer_entry->favorability++;
-          }
+static void load_buffer_sites(void) {
 
-          /* We need to remember which seed to set later when the seed was created. */
-          if (*updated_buffer_entry == NULL)
-          {
-            *updated_buffer_entry = malloc(sizeof(struct updated_buffer_entry));
-            (*updated_buffer_entry)->updated_buffer_entry = current_buffer_entry;
-            (*updated_buffer_entry)->next = NULL;
-          } else 
-          {
-            struct updated_buffer_entry* new_updated_buffer_entry = malloc(sizeof(struct updated_buffer_entry));
-            new_updated_buffer_entry->updated_buffer_entry = current_buffer_entry;
-            new_updated_buffer_entry->next = *updated_buffer_entry;
-            *updated_buffer_entry = new_updated_buffer_entry;
-          }
-        }
+#ifndef __APPLE__
 
-        break;
-      }
+  struct stat st;
+  Elf64_Shdr* shdr;
+  u8* f_data;
+  u64 total_geps = 1;
+  u32 chain = BUFFER_SITES_CHAIN_INIT, modules = 0, off = 0;
+  s32 fd;
 
-      current_buffer_entry = current_buffer_entry->next;
-    }
+  fd = open(target_path, O_RDONLY);
+  if (fd < 0) return;
 
-    /* This buffer was accessed for the first time or we found a new getelementptr instruction. */
-    if (current_buffer_entry == NULL)
-    {
-      if (distance < 0) 
-      {
-        buffer_distance = distance;
-        *has_buffer_overflow = 1;
-      }
+  if (fstat(fd, &st) || st.st_size < sizeof(Elf64_Ehdr)) {
+    close(fd);
+    return;
+  }
+
+  f_data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
 
-      updated_seed_map = 1;
+  if (f_data == MAP_FAILED) return;
 
-      current_buffer_entry = malloc(sizeof(struct buffer_entry));
+  /* Scripts, 32 bit and foreign binaries just go without sites. */
 
-      current_buffer_entry->gep_id = gep_id;
-      current_buffer_entry->distance = distance;
-      /* When we have entcountered a new buffer access for the first time we set it's favorability to 'UNFAVORABLE'. */
-      current_buffer_entry->favorability = UNFAVORABLE;
-      current_buffer_entry->seed = NULL;
-      current_buffer_entry->next = NULL;
+  shdr = find_elf_section(f_data, st.st_size, BUFFER_SITES_SECTION);
 
-      /* Add the newly created buffer_entry to the 'buffer_distance_map'. */
-      if (buffer_distance_map[buffer_id] == NULL)
-      {
-        /*
-        This is the first entry for the buffer with the id 'buffer_id'.
-        */
+  if (!shdr || shdr->sh_type != SHT_PROGBITS ||
+      shdr->sh_offset + shdr->sh_size > st.st_size) goto unmap;
 
-        buffer_distance_map[buffer_id] = current_buffer_entry;
-      } else 
-      {
-        /*
-        If there alread is a buffer entry at 'buffer_distance_map[buffer_id]' we insert a new entry at the beginning of  
-        'buffer_distance_map[buffer_id]'.
-        */
+  buffer_sites_len = shdr->sh_size;
+  buffer_sites     = ck_alloc_nozero(buffer_sites_len);
+  memcpy(buffer_sites, f_data + shdr->sh_offset, buffer_sites_len);
 
-        current_buffer_entry->next = buffer_distance_map[buffer_id];
-        buffer_distance_map[buffer_id] = current_buffer_entry;
-      }
+  /* The linker may pad between blobs with zeroes, anything else means the section is broken. */
 
-      /* We need to remember which seed to set later when the seed was created. */
-      if (*updated_buffer_entry == NULL)
-      {
-        *updated_buffer_entry = malloc(sizeof(struct updated_buffer_entry));
-        (*updated_buffer_entry)->updated_buffer_entry = current_buffer_entry;
-        (*updated_buffer_entry)->next = NULL;
-      } else 
-      {
-        struct updated_buffer_entry* new_updated_buffer_entry = malloc(sizeof(struct updated_buffer_entry));
-        new_updated_buffer_entry->updated_buffer_entry = current_buffer_entry;
-        new_updated_buffer_entry->next = *updated_buffer_entry;
-        *updated_buffer_entry = new_updated_buffer_entry;
-      }
+  while (off + sizeof(buffer_sites_header_t) <= buffer_sites_len) {
+
+    buffer_sites_header_t* header = (buffer_sites_header_t*)(buffer_sites + off);
+
+    if (!header->magic) {
+      off += 8;
+      continue;
     }
+
+    if (header->magic != BUFFER_SITES_MAGIC || header->size > buffer_sites_len - off ||
+        header->size % 8 || header->strings < sizeof(buffer_sites_header_t) ||
+        header->strings > header->size ||
+        (header->gep_count + (u64)header->buffer_count) * sizeof(buffer_site_t) >
+          header->strings - sizeof(buffer_sites_header_t)) {
+
+      WARNF("Malformed '" BUFFER_SITES_SECTION "' section in the target binary, ignoring it.");
+      ck_free(buffer_sites);
+      buffer_sites = NULL;
+      goto unmap;
+
+    }
+
+    chain = buffer_sites_chain(chain, header->module_hash);
+    total_geps += header->gep_count;
+    modules++;
+
+    off += header->size;
+
   }
 
-  /* Clean shared memory after reading data. */
-  memset(__shared_memory_, 0, SHARED_MEM_SIZE);
+  buffer_sites_modules = modules;
+  buffer_sites_chain_  = chain;
+
+  /* Every gep ID the target can report is known now, so the table never has to grow. */
+
+  resize_distance_table(MIN(total_geps, BUFFER_DIST_MAX_GEPS));
+
+  OKF("Found %u instrumented module%s with %llu gep%s in the target binary.", modules,
+      modules == 1 ? "" : "s", total_geps - 1, total_geps == 2 ? "" : "s");
+
+unmap:
+
+  munmap(f_data, st.st_size);
+
+#endif /* !__APPLE__ */
+
+}
+
+static const char* buffer_site_kind(u32 kind) {
+
+  switch (kind) {
+
+    case BUFFER_SITE_GEP:        return "gep";
+    case BUFFER_SITE_GEP_LOOP:   return "gep_loop";
+    case BUFFER_SITE_MEMCPY_DST: return "memcpy_dst";
+    case BUFFER_SITE_MEMCPY_SRC: return "memcpy_src";
+    case BUFFER_SITE_MEMSET:     return "memset";
+    case BUFFER_SITE_STRCPY:     return "strcpy";
+    case BUFFER_SITE_GLOBAL:     return "global";
+    case BUFFER_SITE_STACK:      return "stack";
+    case BUFFER_SITE_VLA:        return "vla";
+    case BUFFER_SITE_HEAP:       return "heap";
+    case BUFFER_SITE_REALLOC:    return "realloc";
+    default:                     return "unknown";
 
-  // Detach from shared memory
-  if (shmdt(__shared_memory_) == -1) 
-  {
-      perror("shmdt");
-      return 1;
   }
 
-  return updated_seed_map;
 }
 
-/* Clear shared memory */
-static void clear_shared_memory()
-{
-  key_t key = ftok("/bin/clang", 1);
+/* Writes one line per site, numbered with the global IDs the runtime handed out. */
+
+static void write_buffer_site_lines(FILE* f, const char* what, u8* blob, buffer_site_t* sites,
+                                    u32 count, u64 first_id) {
+
+  buffer_sites_header_t* header = (buffer_sites_header_t*)blob;
+  u32 i;
+
+  for (i = 0; i < count; i++) {
+
+    buffer_site_t* site = &sites[i];
+
+    /* The pass terminates all strings, but the binary may have been tampered with. */
+
+    if (site->file >= header->size - header->strings ||
+        site->function >= header->size - header->strings ||
+        !memchr(blob + header->strings + site->file, 0, header->size - header->strings - site->file) ||
+        !memchr(blob + header->strings + site->function, 0, header->size - header->strings - site->function))
+      continue;
+
+    fprintf(f, "%s %llu %s %s %s:%u %llu\n", what, first_id + i, buffer_site_kind(site->kind),
+            blob + header->strings + site->function, blob + header->strings + site->file,
+            site->line, (u64)site->static_size);
 
-  int shmid = shmget(key, SHARED_MEM_SIZE, 0666);
-  if (shmid < 0) {
-      perror("shmget-afl");
-      return;
   }
 
-  char* __shared_memory_ = shmat(shmid, NULL, 0);
+}
+
+static void write_buffer_sites(void) {
+
+  buffer_shm_header_t* shm_header = &buffer_shm->header;
+  u64 gep_base = 1, buffer_base = 1;
+  u32 off = 0;
+  u8* fn;
+  s32 fd;
+  FILE* f;
+
+  if (!buffer_sites) return;
+
+  /* The IDs depend on the order the module constructors ran in, which the chain covers. */
+
+  if (shm_header->module_count != buffer_sites_modules ||
+      shm_header->module_chain != buffer_sites_chain_) {
+
+    WARNF("Target registered %u buffer monitor modules, the binary has %u. Not writing 'buffer_sites'.",
+          shm_header->module_count, buffer_sites_modules);
+    goto out;
+
+  }
+
+  fn = alloc_printf("%s/buffer_sites", out_dir);
+  fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+
+  ck_free(fn);
+
+  f = fdopen(fd, "w");
+
+  if (!f) PFATAL("fdopen() failed");
+
+  fprintf(f, "# <gep|buffer> <id> <kind> <function> <file>:<line> <static size>\n");
+
+  while (off + sizeof(buffer_sites_header_t) <= buffer_sites_len) {
+
+    buffer_sites_header_t* header = (buffer_sites_header_t*)(buffer_sites + off);
+    buffer_site_t* sites = (buffer_site_t*)(header + 1);
+
+    if (!header->magic) {
+      off += 8;
+      continue;
+    }
+
+    write_buffer_site_lines(f, "gep", (u8*)header, sites, header->gep_count, gep_base);
+    write_buffer_site_lines(f, "buffer", (u8*)header, sites + header->gep_count,
+                            header->buffer_count, buffer_base);
+
+    gep_base    += header->gep_count;
+    buffer_base += header->buffer_count;
+    off         += header->size;
 
-  if (__shared_memory_ == (char*) -1) {
-    perror("shmat");
-    return;
   }
 
-  /* Clean shared memory after reading data. */
-  memset(__shared_memory_, 0, SHARED_MEM_SIZE);
+  fclose(f);
+
+out:
+
+  ck_free(buffer_sites);
+  buffer_sites = NULL;
 
-  // Detach from shared memory
-  if (shmdt(__shared_memory_) == -1) 
+}
+
+/* Log distance for the passed gep and write it to file */
+
+void log_data_buffer_entry(u32 buffer_id, u64 gep_id, s64 distance)
+{
+  FILE* log_file = fopen("buffer_distance.log", "a");
+
+  if (log_file == NULL)
   {
-      perror("shmdt");
-      return;
+    printf("Error opening file!\n");
+    exit(1);
   }
 
+  fprintf(log_file, "Buffer ID: %u, GEP ID: %llu, Distance: %lld\n", buffer_id, gep_id, (long long)distance);
+
+  fclose(log_file);
 }
 
-/*
-  Scoring function for calculating the score for a seed
-  The score is calculated based on the buffer_distance_map and the buffer_distance_seed_map
+/* 
+Update the buffer distance table based on the data in the shared memory. This function returns true
+if any of the buffer distances have been updated, the updated geps are left in 'dist_updated'.
+
+If any of the buffers in the shared memory have a distance smallere then or euql zero, the variable 
+'has_buffer_overflow' is set to true.
 */
 
-static u32 calculate_score_buffer_map(struct queue_entry* q) {
-  int perf_score = 0;
+u8 update_buffer_distances(u8* has_buffer_overflow)
+{
+  u8 updated_seed_map = 0;
 
-  /* Seeds that hold more minimal distances get a higher score. */
+  /* The segment is created and attached once in setup_shm(). */
+  buffer_shm_header_t* header = &buffer_shm->header;
 
-  struct important_buffer_queue* current_buffer = important_buffer_queue_head;
-  while (current_buffer)
+  // log_shared_memory(buffer_shm);
+
+  /* Pairs with the release store of the target, see BufferShm.h. */
+  u32 record_count = MIN(__atomic_load_n(&header->count, __ATOMIC_ACQUIRE), BUFFER_DATA_CHUNK_COUNT);
+
+  buffer_records_dropped += header->overflow;
+
+  /* Left by a target that aborted on an out of bounds access, see BufferShm.h. */
+  buffer_crash.gep_id = __atomic_load_n(&header->crash.gep_id, __ATOMIC_ACQUIRE);
+
+  if (buffer_crash.gep_id) {
+    buffer_crash.buffer_id = header->crash.buffer_id;
+    buffer_crash.distance = header->crash.distance;
+  }
+
+  dist_updated_cnt = 0;
+
+  /* Only walk the records if some gep reached a closer bucket. Like hit counts, progress
+     within a bucket is not worth a seed. */
+
+  if (dist_map_mode && !has_new_dist_bits()) record_count = 0;
+
+  u8 locked = 0;
+
+  for (u32 i = 0; i < record_count; i++)
   {
-    struct buffer_entry* current_buffer_entry = current_buffer->buffer_entry;
+    buffer_shm_record_t* record = &buffer_shm->records[i];
+
+    u64 gep_id = record->gep_id;
+    s64 distance = record->distance;
 
-    if (current_buffer_entry->seed == q)
+    if (gep_id >= dist_slots && !grow_distance_table(gep_id))
     {
-      perf_score += havoc_score * current_buffer_entry->favorability;
+      buffer_records_dropped++;
+      continue;
+    }
+
+    if (distance >= dist_min[gep_id]) continue;
+
+    /* With -j, look again under the lock, another worker may have got there first. */
+    if (job_state && !locked)
+    {
+      dist_lock();
+      locked = 1;
+
+      if (distance >= dist_min[gep_id]) continue;
     }
 
-    current_buffer = current_buffer->next;
+    if (distance < 0) 
+    {
+      buffer_distance = distance;
+      *has_buffer_overflow = 1;
+    }
+
+    /* 
+    When we have entcountered a buffer access for the first time, its favorability stays 'UNFAVORABLE'.
+    Otherwise we found a new minmal distance, so we increase the favorability.
+    */
+    if (dist_min[gep_id] != DIST_UNSEEN)
+    {
+      /* Add this gep to the list containing other important geps. */
+      if (dist_favor[gep_id] == UNFAVORABLE)
+      {
+        u32 cnt = *dist_important_cnt;
+
+        /* Pairs with the acquire load in calculate_favored_entries(). */
+        dist_important[cnt] = gep_id;
+        __atomic_store_n(dist_important_cnt, cnt + 1, __ATOMIC_RELEASE);
+      }
+
+      if (dist_favor[gep_id] < VERY_FAVORABLE)
+      {
+        set_dist_favor(gep_id, dist_favor[gep_id] + 1);
+      }
+    }
+
+    dist_min[gep_id] = distance;
+    dist_buffer[gep_id] = record->buffer_id;
+
+    #ifdef LOG_BUFFER_DATA 
+      if (record->buffer_id == 405)
+      {
+        log_data_buffer_entry(record->buffer_id, gep_id, distance);
+      }
+    #endif
+
+    /* We need to remember which seed to set later when the seed was created. */
+    dist_updated[dist_updated_cnt] = gep_id;
+    dist_updated_min[dist_updated_cnt++] = distance;
+
+    updated_seed_map = 1;
   }
 
+  if (locked) dist_unlock();
+
+  return updated_seed_map;
+}
+
+/*
+  Scoring function for calculating the score for a seed
+  The score is calculated based on the favorability the seed holds in the buffer distance table
+*/
+
+static u32 calculate_score_buffer_map(struct queue_entry* q) {
+
+  /* Seeds that hold more minimal distances get a higher score. */
+
+  u64 perf_score = q->id < seed_favor_slots ? (u64)havoc_score * seed_favor[q->id] : 0;
+
   /* Make sure not to overfit. */
 
   if (perf_score > HAVOC_MAX_TIME)
@@ -1437,6 +2221,8 @@ static u32 calculate_score_buffer_map(struct queue_entry* q) {
 static void remove_shm(void) {
 
   shmctl(shm_id, IPC_RMID, NULL);
+  if (buffer_shm_id >= 0) shmctl(buffer_shm_id, IPC_RMID, NULL);
+  if (shm_fuzz_id >= 0) shmctl(shm_fuzz_id, IPC_RMID, NULL);
 
 }
 
@@ -1448,9 +2234,13 @@ static void remove_shm(void) {
 static u32 count_non_255_bytes(u8* mem) {
 
   u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
   u32  ret = 0;
 
+#ifdef HAVE_AVX2_KERNELS
+  if (use_avx2) return count_non_255_bytes_avx2(mem);
+#endif /* HAVE_AVX2_KERNELS */
+
   while (i--) {
 
     u32 v = *(ptr++);
@@ -1487,7 +2277,18 @@ static const u8 simplify_lookup[256] = {
 
 static void simplify_trace(u64* mem) {
 
-  u32 i = MAP_SIZE >> 3;
+  u32 i = map_size >> 3;
+
+  trace_listed = 0;
+
+#ifdef HAVE_AVX2_KERNELS
+
+  if (use_avx2) {
+    simplify_trace_avx2((u8*)mem);
+    return;
+  }
+
+#endif /* HAVE_AVX2_KERNELS */
 
   while (i--) {
 
@@ -1518,7 +2319,9 @@ static void simplify_trace(u64* mem) {
 
 static void simplify_trace(u32* mem) {
 
-  u32 i = MAP_SIZE >> 2;
+  u32 i = map_size >> 2;
+
+  trace_listed = 0;
 
   while (i--) {
 
@@ -1581,7 +2384,16 @@ EXP_ST void init_count_class16(void) {
 
 static inline void classify_counts(u64* mem) {
 
-  u32 i = MAP_SIZE >> 3;
+  u32 i = map_size >> 3;
+
+#ifdef HAVE_AVX2_KERNELS
+
+  if (use_avx2) {
+    classify_counts_avx2((u8*)mem);
+    return;
+  }
+
+#endif /* HAVE_AVX2_KERNELS */
 
   while (i--) {
 
@@ -1608,7 +2420,7 @@ static inline void classify_counts(u64* mem) {
 
 static inline void classify_counts(u32* mem) {
 
-  u32 i = MAP_SIZE >> 2;
+  u32 i = map_size >> 2;
 
   while (i--) {
 
@@ -1631,6 +2443,81 @@ static inline void classify_counts(u32* mem) {
 
 #endif /* ^WORD_SIZE_64 */ 
 
+
+/* Zero trace_bits[] before a run. In sparse trace mode, that's just the
+   entries of the last run. */
+
+static inline void clear_trace(void) {
+
+  u32 i;
+
+  if (trace_listed) {
+
+    for (i = 1; i <= touched[0]; i++) trace_bits[touched[i]] = 0;
+
+  } else memset(trace_bits, 0, map_size);
+
+  if (sparse_trace) touched[0] = 0;
+
+}
+
+
+/* Classify trace_bits[] after a run. In sparse trace mode, only the listed
+   entries are classified, unless there are so many that a full scan is
+   faster. The list is compacted first: duplicates and entries that are still
+   zero are dropped, and the indices are masked, since the target wrote
+   them. During the dry run, we make sure that nothing else is
+   set, i.e. that the whole target lists its entries. */
+
+static void classify_trace(void) {
+
+  u32 cnt = sparse_trace ? touched[0] : 0, kept = 0, i;
+
+  trace_listed = 0;
+
+  if (sparse_trace && cnt <= TOUCHED_LIST_MAX) {
+
+    for (i = 1; i <= cnt; i++) {
+
+      u32 idx = touched[i] & (MAP_SIZE - 1);
+
+      if (!trace_bits[idx]) continue;
+
+      touched[++kept] = idx;
+      touched_raw[kept] = trace_bits[idx];
+      trace_bits[idx] = 0;
+
+    }
+
+    /* Whatever is still set now isn't listed. queue_cycle is 0 until the
+       dry run is over. */
+
+    if (queue_cycle || !count_bytes(trace_bits)) {
+
+      for (i = 1; i <= kept; i++)
+        trace_bits[touched[i]] = count_class_lookup8[touched_raw[i]];
+
+      touched[0] = kept;
+      trace_listed = 1;
+      return;
+
+    }
+
+    for (i = 1; i <= kept; i++) trace_bits[touched[i]] = touched_raw[i];
+
+    WARNF("Some map entries are not listed by the target, disabling sparse trace mode.");
+    sparse_trace = 0;
+
+  }
+
+#ifdef WORD_SIZE_64
+  classify_counts((u64*)trace_bits);
+#else
+  classify_counts((u32*)trace_bits);
+#endif /* ^WORD_SIZE_64 */
+
+}
+
 /* Compact trace bytes into a smaller bitmap. We effectively just drop the
    count information here. This is called only sporadically, for some
    new paths. */
@@ -1639,7 +2526,7 @@ static void minimize_bits(u8* dst, u8* src) {
 
   u32 i = 0;
 
-  while (i < MAP_SIZE) {
+  while (i < map_size) {
 
     if (*(src++)) dst[i >> 3] |= 1 << (i & 7);
     i++;
@@ -1666,7 +2553,7 @@ static void update_bitmap_score(struct queue_entry* q) {
   /* For every byte set in trace_bits[], see if there is a previous winner,
      and how it compares to us. */
 
-  for (i = 0; i < MAP_SIZE; i++)
+  for (i = 0; i < map_size; i++)
 
     if (trace_bits[i]) {
 
@@ -1692,7 +2579,7 @@ static void update_bitmap_score(struct queue_entry* q) {
        q->tc_ref++;
 
        if (!q->trace_mini) {
-         q->trace_mini = ck_alloc(MAP_SIZE >> 3);
+         q->trace_mini = ck_alloc(map_size >> 3);
          minimize_bits(q->trace_mini, trace_bits);
        }
 
@@ -1712,14 +2599,16 @@ static void update_bitmap_score(struct queue_entry* q) {
 static void cull_queue(void) {
 
   struct queue_entry* q;
-  static u8 temp_v[MAP_SIZE >> 3];
+  static u8* temp_v;
   u32 i;
 
   if (dumb_mode || !score_changed) return;
 
   score_changed = 0;
 
-  memset(temp_v, 255, MAP_SIZE >> 3);
+  if (!temp_v) temp_v = ck_alloc_nozero(map_size >> 3);
+
+  memset(temp_v, 255, map_size >> 3);
 
   queued_favored  = 0;
   pending_favored = 0;
@@ -1734,10 +2623,10 @@ static void cull_queue(void) {
   /* Let's see if anything in the bitmap isn't captured in temp_v.
      If yes, and if it has a top_rated[] contender, let's use it. */
 
-  for (i = 0; i < MAP_SIZE; i++)
+  for (i = 0; i < map_size; i++)
     if (top_rated[i] && (temp_v[i >> 3] & (1 << (i & 7)))) {
 
-      u32 j = MAP_SIZE >> 3;
+      u32 j = map_size >> 3;
 
       /* Remove all bits belonging to the current entry from temp_v. */
 
@@ -1780,28 +2669,24 @@ static void calculate_favored_entries(void)
     q = q->next;
   }
 
-  for (int i = 0; i < BUFFER_DATA_CHUNK_COUNT; i++)
-  {
-    struct buffer_entry* current_buffer_entry = buffer_distance_map[i];
+  /* Only important geps can be more than NEUTRAL. */
 
-    while (current_buffer_entry)
-    {
-      if (!current_buffer_entry->seed)
-      {
-        current_buffer_entry = current_buffer_entry->next;
-        continue;
-      }
+  u32 important_cnt = __atomic_load_n(dist_important_cnt, __ATOMIC_ACQUIRE);
 
-      if (current_buffer_entry->favorability > NEUTRAL && !current_buffer_entry->seed->was_fuzzed)
-      {
-        current_buffer_entry->seed->favored = 1;
-        queued_favored++;
-        pending_favored++;
-      }
+  for (u32 i = 0; i < important_cnt; i++)
+  {
+    u32 gep_id = dist_important[i];
+    u32 seed_id = dist_seed[gep_id];
 
-      current_buffer_entry = current_buffer_entry->next;
-    }
+    /* With -j, the seed may be one that this worker has not imported yet. */
+    struct queue_entry* seed = seed_id && seed_id <= queue_by_id_slots ? queue_by_id[seed_id - 1] : NULL;
 
+    if (seed && dist_favor[gep_id] > NEUTRAL && !seed->was_fuzzed && !seed->favored)
+    {
+      seed->favored = 1;
+      queued_favored++;
+      pending_favored++;
+    }
   }
 
   q = queue;
@@ -1819,22 +2704,29 @@ static void calculate_favored_entries(void)
 
 }
 
-/* Configure shared memory and virgin_bits. This is called at startup. */
+/* Create and attach the segments shared with the target: trace_bits and the
+   buffer distance records. Called once at startup, and by every -j worker
+   for its own. */
 
-EXP_ST void setup_shm(void) {
+static void attach_target_shm(void) {
 
+  static u8 remove_registered;
   u8* shm_str;
 
-  if (!in_bitmap) memset(virgin_bits, 255, MAP_SIZE);
+  /* Never less than MAP_SIZE, see check_map_coverage(). */
 
-  memset(virgin_tmout, 255, MAP_SIZE);
-  memset(virgin_crash, 255, MAP_SIZE);
-
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+  shm_id = shmget(IPC_PRIVATE, MAX(map_size, MAP_SIZE) + TOUCHED_LIST_SIZE,
+                  IPC_CREAT | IPC_EXCL | 0600);
 
   if (shm_id < 0) PFATAL("shmget() failed");
 
-  atexit(remove_shm);
+  /* -j workers inherit the handler, which removes whatever segments they
+     have by then. */
+
+  if (!remove_registered) {
+    atexit(remove_shm);
+    remove_registered = 1;
+  }
 
   shm_str = alloc_printf("%d", shm_id);
 
@@ -1851,6 +2743,70 @@ EXP_ST void setup_shm(void) {
   
   if (trace_bits == (void *)-1) PFATAL("shmat() failed");
 
+  touched = (u32*)(trace_bits + MAP_SIZE);
+  trace_listed = 0;
+
+  /* The buffer distance records written by BufferMonitorLib live in a second
+     segment. We attach to it once and keep it around for the whole session,
+     so that update_buffer_distances() doesn't have to do the shmget() / shmat()
+     / shmdt() dance after every single exec. Each instance gets a private
+     segment, so -M / -S fuzzers running side by side can't see each other's
+     distances. */
+
+  buffer_shm_id = shmget(IPC_PRIVATE, sizeof(buffer_shm_t), IPC_CREAT | IPC_EXCL | 0600);
+
+  if (buffer_shm_id < 0) PFATAL("shmget() failed for buffer distance data");
+
+  shm_str = alloc_printf("%d", buffer_shm_id);
+
+  if (!dumb_mode) setenv(BUFFER_SHM_ENV_VAR, shm_str, 1);
+
+  ck_free(shm_str);
+
+  buffer_shm = shmat(buffer_shm_id, NULL, 0);
+
+  if (buffer_shm == (void *)-1) PFATAL("shmat() failed for buffer distance data");
+
+  /* Harnesses built with __AFL_FUZZ_TESTCASE_BUF get the testcase in a third
+     one, see write_to_testcase(). */
+
+  if (!shm_fuzz_mode) return;
+
+  shm_fuzz_id = shmget(IPC_PRIVATE, SHM_FUZZ_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_fuzz_id < 0) PFATAL("shmget() failed for testcases");
+
+  shm_str = alloc_printf("%d", shm_fuzz_id);
+  setenv(SHM_FUZZ_ENV_VAR, shm_str, 1);
+  ck_free(shm_str);
+
+  shm_fuzz = shmat(shm_fuzz_id, NULL, 0);
+
+  if (shm_fuzz == (void *)-1) PFATAL("shmat() failed for testcases");
+
+}
+
+
+/* Configure shared memory and virgin_bits. This is called at startup, once
+   map_size is known. */
+
+EXP_ST void setup_shm(void) {
+
+  virgin_bits  = ck_alloc_nozero(map_size);
+  virgin_tmout = ck_alloc_nozero(map_size);
+  virgin_crash = ck_alloc_nozero(map_size);
+  var_bytes    = ck_alloc(map_size);
+  top_rated    = ck_alloc(map_size * sizeof(struct queue_entry*));
+
+  if (in_bitmap) read_bitmap(in_bitmap);
+  else memset(virgin_bits, 255, map_size);
+
+  memset(virgin_tmout, 255, map_size);
+  memset(virgin_crash, 255, map_size);
+  memset(virgin_dist, 255, BUFFER_DIST_MAP_SIZE);
+
+  attach_target_shm();
+
 }
 
 
@@ -1961,7 +2917,7 @@ static void read_testcases(void) {
     if (!access(dfn, F_OK)) passed_det = 1;
     ck_free(dfn);
 
-    add_to_queue(fn, st.st_size, passed_det, 0);
+    add_to_queue(fn, st.st_size, passed_det, queued_paths);
 
   }
 
@@ -2363,7 +3319,9 @@ static void save_auto(void) {
 
   u32 i;
 
-  if (!auto_changed) return;
+  /* Auto extras are per worker with -j, only the first one keeps them. */
+
+  if (!auto_changed || job_id) return;
   auto_changed = 0;
 
   for (i = 0; i < MIN(USE_AUTO_EXTRAS, a_extras_cnt); i++) {
@@ -2544,7 +3502,7 @@ EXP_ST void init_forkserver(char** argv) {
     close(out_dir_fd);
     close(dev_null_fd);
     close(dev_urandom_fd);
-    close(fileno(plot_file));
+    if (plot_file) close(fileno(plot_file));
 
     /* This should improve performance a bit, since it stops the linker from
        doing extra work post-fork(). */
@@ -2754,7 +3712,19 @@ static u8 run_target(char** argv, u32 timeout) {
      must prevent any earlier operations from venturing into that
      territory. */
 
-  memset(trace_bits, 0, MAP_SIZE);
+  clear_trace();
+  if (dist_map_mode) memset(buffer_shm->dist_map, 0, BUFFER_DIST_MAP_SIZE);
+
+  /* Hand the buffer segment back empty. Not every run is followed by
+     update_buffer_distances(); calibration, trimming and the dry run must not
+     leave their records or a fail-fast crash to the next one. The target
+     only appends. */
+
+  buffer_shm->header.count = 0;
+  buffer_shm->header.overflow = 0;
+  buffer_shm->header.crash.gep_id = 0;
+  buffer_shm->header.generation++;
+
   MEM_BARRIER();
 
   /* If we're running in "dumb" mode, we can't rely on the fork server
@@ -2816,7 +3786,7 @@ static u8 run_target(char** argv, u32 timeout) {
       close(dev_null_fd);
       close(out_dir_fd);
       close(dev_urandom_fd);
-      close(fileno(plot_file));
+      if (plot_file) close(fileno(plot_file));
 
       /* Set sane defaults for ASAN if nothing else specified. */
 
@@ -2913,11 +3883,11 @@ static u8 run_target(char** argv, u32 timeout) {
 
   tb4 = *(u32*)trace_bits;
 
-#ifdef WORD_SIZE_64
-  classify_counts((u64*)trace_bits);
-#else
-  classify_counts((u32*)trace_bits);
-#endif /* ^WORD_SIZE_64 */
+  classify_trace();
+
+  /* The child that failed to exec doesn't list what it wrote. */
+
+  if (tb4 == EXEC_FAIL_SIG) trace_listed = 0;
 
   prev_timed_out = child_timed_out;
 
@@ -2957,12 +3927,21 @@ static u8 run_target(char** argv, u32 timeout) {
 
 /* Write modified data to file for testing. If out_file is set, the old file
    is unlinked and a new one is created. Otherwise, out_fd is rewound and
-   truncated. */
+   truncated. Harnesses that read the testcase from shared memory get it
+   there instead, without touching the file. */
 
 static void write_to_testcase(void* mem, u32 len) {
 
   s32 fd = out_fd;
 
+  if (shm_fuzz) {
+
+    *(u32*)shm_fuzz = len;
+    memcpy(shm_fuzz + 4, mem, len);
+    return;
+
+  }
+
   if (out_file) {
 
     unlink(out_file); /* Ignore errors. */
@@ -2992,6 +3971,15 @@ static void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len) {
   s32 fd = out_fd;
   u32 tail_len = len - skip_at - skip_len;
 
+  if (shm_fuzz) {
+
+    *(u32*)shm_fuzz = len - skip_len;
+    memcpy(shm_fuzz + 4, mem, skip_at);
+    memcpy(shm_fuzz + 4 + skip_at, mem + skip_at + skip_len, tail_len);
+    return;
+
+  }
+
   if (out_file) {
 
     unlink(out_file); /* Ignore errors. */
@@ -3025,7 +4013,7 @@ static void show_stats(void);
 static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
                          u32 handicap, u8 from_queue) {
 
-  static u8 first_trace[MAP_SIZE];
+  static u8* first_trace;
 
   u8  fault = 0, new_bits = 0, var_detected = 0, hnb = 0,
       first_run = (q->exec_cksum == 0);
@@ -3036,6 +4024,8 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
   u32 use_tmout = exec_tmout;
   u8* old_sn = stage_name;
 
+  if (!first_trace) first_trace = ck_alloc_nozero(map_size);
+
   /* Be a bit more generous about timeouts when resuming sessions, or when
      trying to calibrate already-added finds. This helps avoid trouble due
      to intermittent latency. */
@@ -3057,7 +4047,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
 
   if (q->exec_cksum) {
 
-    memcpy(first_trace, trace_bits, MAP_SIZE);
+    memcpy(first_trace, trace_bits, map_size);
     hnb = has_new_bits(virgin_bits);
     if (hnb > new_bits) new_bits = hnb;
 
@@ -3085,7 +4075,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
       goto abort_calibration;
     }
 
-    cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    cksum = hash32(trace_bits, map_size, HASH_CONST);
 
     if (q->exec_cksum != cksum) {
 
@@ -3096,7 +4086,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
 
         u32 i;
 
-        for (i = 0; i < MAP_SIZE; i++) {
+        for (i = 0; i < map_size; i++) {
 
           if (!var_bytes[i] && first_trace[i] != trace_bits[i]) {
 
@@ -3112,7 +4102,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
       } else {
 
         q->exec_cksum = cksum;
-        memcpy(first_trace, trace_bits, MAP_SIZE);
+        memcpy(first_trace, trace_bits, map_size);
 
       }
 
@@ -3181,6 +4171,21 @@ static void check_map_coverage(void) {
 
   u32 i;
 
+  /* load_map_size() refuses dense binaries with modules that were built
+     without AFL_DENSE_MAP. Modules from older compilers have no marker,
+     though; the SHM is at least MAP_SIZE, so that they are caught here
+     instead of crashing if the map is smaller. */
+
+  if (map_size != MAP_SIZE) {
+
+    for (i = map_size; i < MAP_SIZE; i++)
+      if (trace_bits[i])
+        FATAL("Some modules of the target were built without AFL_DENSE_MAP");
+
+    return;
+
+  }
+
   if (count_bytes(trace_bits) < 100) return;
 
   for (i = (1 << (MAP_SIZE_POW2 - 1)); i < MAP_SIZE; i++)
@@ -3617,9 +4622,11 @@ static void write_crash_readme(void) {
 static u8 save_if_interesting_custom(char** argv, void* mem, u32 len, u8 fault, u8 has_higher_accessed_byte, u8 has_buffer_overflow, struct queue_entry** new_entry)
 {
   u8  *fn = "";
-  u8  hnb;
+  u8  hnb = 0;
   s32 fd;
   u8  keeping = 0, res;
+  u32 id;
+  u64 fault_id;
 
   if (fault == crash_mode) 
   {
@@ -3633,32 +4640,34 @@ static u8 save_if_interesting_custom(char** argv, void* mem, u32 len, u8 fault,
         goto keep_as_crash;
     }
 
+    id = next_queue_id();
+
 #ifndef SIMPLE_FILES
 
   if (has_buffer_overflow)
-    fn = alloc_printf("%s/queue/id:%06u,%s,overflow:%d", out_dir, queued_paths,
+    fn = alloc_printf("%s/queue/id:%06u,%s,overflow:%d", out_dir, id,
                       describe_op(hnb), buffer_distance);
   else if (has_higher_accessed_byte)
-    fn = alloc_printf("%s/queue/id:%06u,%s,distance", out_dir, queued_paths,
+    fn = alloc_printf("%s/queue/id:%06u,%s,distance", out_dir, id,
                       describe_op(hnb));
   else
-    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
+    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, id,
                       describe_op(hnb));
 
 #else
 
-    fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
+    fn = alloc_printf("%s/queue/id_%06u", out_dir, id);
 
 #endif /* ^!SIMPLE_FILES */
 
-    *new_entry = add_to_queue(fn, len, 0, 0);
+    *new_entry = add_to_queue(fn, len, 0, id);
     
     if (hnb == 2) {
       queue_top->has_new_cov = 1;
       queued_with_cov++;
     }
 
-    queue_top->exec_cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    queue_top->exec_cksum = hash32(trace_bits, map_size, HASH_CONST);
 
     /* Try to calibrate inline; this also calls update_bitmap_score() when
        successful. */
@@ -3673,6 +4682,8 @@ static u8 save_if_interesting_custom(char** argv, void* mem, u32 len, u8 fault,
     ck_write(fd, mem, len, fn);
     close(fd);
 
+    publish_queue_entry(queue_top);
+
     keeping = 1;
 
   }
@@ -3724,15 +4735,17 @@ static u8 save_if_interesting_custom(char** argv, void* mem, u32 len, u8 fault,
 
       }
 
+      fault_id = next_fault_id(0);
+
 #ifndef SIMPLE_FILES
 
       fn = alloc_printf("%s/hangs/id:%06llu,%s", out_dir,
-                        unique_hangs, describe_op(0));
+                        fault_id, describe_op(0));
 
 #else
 
       fn = alloc_printf("%s/hangs/id_%06llu", out_dir,
-                        unique_hangs);
+                        fault_id);
 
 #endif /* ^!SIMPLE_FILES */
 
@@ -3768,20 +4781,27 @@ keep_as_crash:
 
       if (!unique_crashes) write_crash_readme();
 
+      fault_id = next_fault_id(1);
+
 #ifndef SIMPLE_FILES
 
-      if (has_buffer_overflow) {
+      if (buffer_crash.gep_id) {
+        fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,%s,overflow:%lld,buf:%u,gep:%llu", out_dir,
+                          fault_id, kill_signal, describe_op(0), (long long)buffer_crash.distance,
+                          buffer_crash.buffer_id, (u64)buffer_crash.gep_id);
+        buffer_distance = 0;
+      } else if (has_buffer_overflow) {
         fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,%s,overflow:%d", out_dir,
-                        unique_crashes, kill_signal, describe_op(0), buffer_distance);
+                        fault_id, kill_signal, describe_op(0), buffer_distance);
         buffer_distance = 0;
       } else {
         fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,%s", out_dir,
-                          unique_crashes, kill_signal, describe_op(0));
+                          fault_id, kill_signal, describe_op(0));
       }
 
 #else
 
-      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, unique_crashes,
+      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, fault_id,
                         kill_signal);
 
 #endif /* ^!SIMPLE_FILES */
@@ -3823,6 +4843,8 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
   u8  hnb;
   s32 fd;
   u8  keeping = 0, res;
+  u32 id;
+  u64 fault_id;
 
   if (fault == crash_mode) {
 
@@ -3834,25 +4856,27 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
       return 0;
     }
 
+    id = next_queue_id();
+
 #ifndef SIMPLE_FILES
 
-    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
+    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, id,
                       describe_op(hnb));
 
 #else
 
-    fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
+    fn = alloc_printf("%s/queue/id_%06u", out_dir, id);
 
 #endif /* ^!SIMPLE_FILES */
 
-    add_to_queue(fn, len, 0, 0);
+    add_to_queue(fn, len, 0, id);
     
     if (hnb == 2) {
       queue_top->has_new_cov = 1;
       queued_with_cov++;
     }
 
-    queue_top->exec_cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    queue_top->exec_cksum = hash32(trace_bits, map_size, HASH_CONST);
 
     /* Try to calibrate inline; this also calls update_bitmap_score() when
        successful. */
@@ -3867,6 +4891,8 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
     ck_write(fd, mem, len, fn);
     close(fd);
 
+    publish_queue_entry(queue_top);
+
     keeping = 1;
 
   }
@@ -3918,15 +4944,17 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
 
       }
 
+      fault_id = next_fault_id(0);
+
 #ifndef SIMPLE_FILES
 
       fn = alloc_printf("%s/hangs/id:%06llu,%s", out_dir,
-                        unique_hangs, describe_op(0));
+                        fault_id, describe_op(0));
 
 #else
 
       fn = alloc_printf("%s/hangs/id_%06llu", out_dir,
-                        unique_hangs);
+                        fault_id);
 
 #endif /* ^!SIMPLE_FILES */
 
@@ -3962,14 +4990,16 @@ keep_as_crash:
 
       if (!unique_crashes) write_crash_readme();
 
+      fault_id = next_fault_id(1);
+
 #ifndef SIMPLE_FILES
 
       fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,%s", out_dir,
-                        unique_crashes, kill_signal, describe_op(0));
+                        fault_id, kill_signal, describe_op(0));
 
 #else
 
-      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, unique_crashes,
+      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, fault_id,
                         kill_signal);
 
 #endif /* ^!SIMPLE_FILES */
@@ -4081,7 +5111,8 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
   static double last_bcvg, last_stab, last_eps;
   static struct rusage usage;
 
-  u8* fn = alloc_printf("%s/fuzzer_stats", out_dir);
+  u8* fn = job_id ? alloc_printf("%s/fuzzer_stats.%u", out_dir, job_id)
+                  : alloc_printf("%s/fuzzer_stats", out_dir);
   s32 fd;
   FILE* f;
 
@@ -4136,7 +5167,8 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
              "afl_version       : " VERSION "\n"
              "target_mode       : %s%s%s%s%s%s%s\n"
              "command_line      : %s\n"
-             "slowest_exec_ms   : %llu\n",
+             "slowest_exec_ms   : %llu\n"
+             "buffer_dropped    : %llu\n",
              start_time / 1000, get_cur_time() / 1000, getpid(),
              queue_cycle ? (queue_cycle - 1) : 0, total_execs, eps,
              queued_paths, queued_favored, queued_discovered, queued_imported,
@@ -4150,7 +5182,7 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
              persistent_mode ? "persistent " : "", deferred_mode ? "deferred " : "",
              (qemu_mode || dumb_mode || no_forkserver || crash_mode ||
               persistent_mode || deferred_mode) ? "" : "default",
-             orig_cmdline, slowest_exec_ms);
+             orig_cmdline, slowest_exec_ms, buffer_records_dropped);
              /* ignore errors */
 
   /* Get rss value from the children
@@ -4180,6 +5212,8 @@ static void maybe_update_plot_file(double bitmap_cvg, double eps) {
   static u32 prev_qp, prev_pf, prev_pnf, prev_ce, prev_md;
   static u64 prev_qc, prev_uc, prev_uh;
 
+  if (!plot_file) return;
+
   if (prev_qp == queued_paths && prev_pf == pending_favored && 
       prev_pnf == pending_not_fuzzed && prev_ce == current_entry &&
       prev_qc == queue_cycle && prev_uc == unique_crashes &&
@@ -4643,7 +5677,7 @@ static void show_stats(void) {
   /* Do some bitmap stats. */
 
   t_bytes = count_non_255_bytes(virgin_bits);
-  t_byte_ratio = ((double)t_bytes * 100) / MAP_SIZE;
+  t_byte_ratio = ((double)t_bytes * 100) / map_size;
 
   if (t_bytes) 
     stab_ratio = 100 - ((double)var_byte_count) * 100 / t_bytes;
@@ -4683,7 +5717,7 @@ static void show_stats(void) {
 
   /* Compute some mildly useful bitmap stats. */
 
-  t_bits = (MAP_SIZE << 3) - count_bits(virgin_bits);
+  t_bits = (map_size << 3) - count_bits(virgin_bits);
 
   /* Now, for the visuals... */
 
@@ -4821,7 +5855,7 @@ static void show_stats(void) {
   SAYF(bV bSTOP "  now processing : " cRST "%-17s " bSTG bV bSTOP, tmp);
 
   sprintf(tmp, "%0.02f%% / %0.02f%%", ((double)queue_cur->bitmap_size) * 
-          100 / MAP_SIZE, t_byte_ratio);
+          100 / map_size, t_byte_ratio);
 
   SAYF("    map density : %s%-21s " bSTG bV "\n", t_byte_ratio > 70 ? cLRD : 
        ((t_bytes < 200 && !dumb_mode) ? cPIN : cRST), tmp);
@@ -5184,13 +6218,15 @@ static u32 next_p2(u32 val) {
 static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
   static u8 tmp[64];
-  static u8 clean_trace[MAP_SIZE];
+  static u8* clean_trace;
 
   u8  needs_write = 0, fault = 0;
   u32 trim_exec = 0;
   u32 remove_len;
   u32 len_p2;
 
+  if (!clean_trace) clean_trace = ck_alloc_nozero(map_size);
+
   /* Although the trimmer will be less useful when variable behavior is
      detected, it will still work to some extent, so we don't check for
      this. */
@@ -5232,7 +6268,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
       /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
 
-      cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+      cksum = hash32(trace_bits, map_size, HASH_CONST);
 
       /* If the deletion had no impact on the trace, make it permanent. This
          isn't perfect for variable-path inputs, but we're just making a
@@ -5255,7 +6291,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
         if (!needs_write) {
 
           needs_write = 1;
-          memcpy(clean_trace, trace_bits, MAP_SIZE);
+          memcpy(clean_trace, trace_bits, map_size);
 
         }
 
@@ -5288,7 +6324,8 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
     ck_write(fd, in_buf, q->len, q->fname);
     close(fd);
 
-    memcpy(trace_bits, clean_trace, MAP_SIZE);
+    memcpy(trace_bits, clean_trace, map_size);
+    trace_listed = 0;
     // update_bitmap_score(q);
 
   }
@@ -5310,7 +6347,6 @@ EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
   u8 fault;
   u8 has_higher_accessed_byte = 0;
   u8 has_buffer_overflow = 0;
-  u32 buffer_score = 0;
 
   if (post_handler) {
 
@@ -5330,8 +6366,7 @@ EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
   When 'has_buffer_overflow' is set write testcase to /overflow directory.
   */
 
-  struct updated_buffer_entry* updated_buffer_entries = NULL;
-  has_higher_accessed_byte = update_buffer_distances(&updated_buffer_entries, &has_buffer_overflow);
+  has_higher_accessed_byte = update_buffer_distances(&has_buffer_overflow);
 
   if (stop_soon) return 1;
 
@@ -5358,26 +6393,19 @@ EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
   struct queue_entry* new_entry = NULL;
   queued_discovered = save_if_interesting_custom(argv, out_buf, len, fault, has_higher_accessed_byte, has_buffer_overflow, &new_entry);
 
-  if (new_entry && updated_buffer_entries)
+  if (new_entry)
   {
-    /* We have created the new seed, now we can set the seeds in the buffer_distance_seed_map. */
-    struct updated_buffer_entry* current_buffer_entry = updated_buffer_entries;
-    while (current_buffer_entry != NULL)
+    dist_lock();
+
+    /* We have created the new seed, now we can set it for the geps it has improved. With -j,
+       skip geps another worker got closer on in the meantime. */
+    for (u32 i = 0; i < dist_updated_cnt; i++)
     {
-      current_buffer_entry->updated_buffer_entry->seed = new_entry;
-      current_buffer_entry = current_buffer_entry->next;
+      if (dist_min[dist_updated[i]] == dist_updated_min[i])
+        set_dist_seed(dist_updated[i], new_entry);
     }
 
-  }
-
-  /* Delete updated_seeds */
-  struct updated_buffer_entry* current_buffer_entry = updated_buffer_entries;
-  struct updated_buffer_entry* next_buffer_entry = NULL;
-  while (current_buffer_entry != NULL)
-  {
-    next_buffer_entry = current_buffer_entry->next;
-    free(current_buffer_entry);
-    current_buffer_entry = next_buffer_entry;
+    dist_unlock();
   }
 
   if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
@@ -5916,7 +6944,7 @@ static u8 could_be_interest(u32 old_val, u32 new_val, u8 blen, u8 check_le) {
 
     if (!dumb_mode && (stage_cur & 7) == 7) {
 
-      u32 cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+      u32 cksum = hash32(trace_bits, map_size, HASH_CONST);
 
       if (stage_cur == stage_max - 1 && cksum == prev_cksum) {
 
@@ -6072,7 +7100,7 @@ static u8 could_be_interest(u32 old_val, u32 new_val, u8 blen, u8 check_le) {
          without wasting time on checksums. */
 
       if (!dumb_mode && len >= EFF_MIN_LEN)
-        cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+        cksum = hash32(trace_bits, map_size, HASH_CONST);
       else
         cksum = ~queue_cur->exec_cksum;
 
@@ -7731,6 +8759,21 @@ EXP_ST void check_binary(u8* fname) {
 
   }
 
+  if (memmem(f_data, f_len, SPARSE_SIG, strlen(SPARSE_SIG) + 1)) {
+
+    OKF(cPIN "Sparse trace binary detected.");
+    setenv(SPARSE_ENV_VAR, "1", 1);
+    sparse_trace = 1;
+
+  }
+
+  if (!dumb_mode && memmem(f_data, f_len, SHM_FUZZ_SIG, strlen(SHM_FUZZ_SIG) + 1)) {
+
+    OKF(cPIN "Shared memory testcase binary detected.");
+    shm_fuzz_mode = 1;
+
+  }
+
   if (memmem(f_data, f_len, DEFER_SIG, strlen(DEFER_SIG) + 1)) {
 
     OKF(cPIN "Deferred forkserver binary detected.");
@@ -7848,6 +8891,7 @@ static void usage(u8* argv0) {
 
        "  -T text       - text banner to show on the screen\n"
        "  -M / -S id    - distributed mode (see parallel_fuzzing.txt)\n"
+       "  -j workers    - fuzz with several workers in one session\n"
        "  -C            - crash exploration mode (the peruvian rabbit thing)\n"
        "  -V            - show version number and exit\n\n"
        "  -b cpu_id     - bind the fuzzing process to the specified CPU core\n\n"
@@ -7998,7 +9042,8 @@ EXP_ST void setup_dirs_fds(void) {
 
 EXP_ST void setup_stdio_file(void) {
 
-  u8* fn = alloc_printf("%s/.cur_input", out_dir);
+  u8* fn = job_id ? alloc_printf("%s/.cur_input.%u", out_dir, job_id)
+                  : alloc_printf("%s/.cur_input", out_dir);
 
   unlink(fn); /* Ignore errors */
 
@@ -8077,6 +9122,28 @@ static void check_crash_handling(void) {
 }
 
 
+/* Use the AVX2 bitmap kernels if the CPU has them, unless AFL_NO_SIMD is set. */
+
+static void check_simd(void) {
+
+#ifdef HAVE_AVX2_KERNELS
+
+  if (getenv("AFL_NO_SIMD")) {
+    WARNF("Not using AVX2 for the bitmap scans (AFL_NO_SIMD set).");
+    return;
+  }
+
+  __builtin_cpu_init();
+
+  use_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+
+  if (use_avx2) OKF("Using AVX2 for the bitmap scans.");
+
+#endif /* HAVE_AVX2_KERNELS */
+
+}
+
+
 /* Check CPU governor. */
 
 static void check_cpu_governor(void) {
@@ -8320,7 +9387,8 @@ EXP_ST void detect_file_args(char** argv) {
       /* If we don't have a file name chosen yet, use a safe default. */
 
       if (!out_file)
-        out_file = alloc_printf("%s/.cur_input", out_dir);
+        out_file = job_id ? alloc_printf("%s/.cur_input.%u", out_dir, job_id)
+                          : alloc_printf("%s/.cur_input", out_dir);
 
       /* Be sure that we're always using fully-qualified paths. */
 
@@ -8392,6 +9460,273 @@ EXP_ST void setup_signal_handlers(void) {
 }
 
 
+/* Carve the next piece out of the shared mapping of -j. */
+
+#define JOB_ALIGN(_x) (((u64)(_x) + 63) & ~63ULL)
+
+static void* job_carve(u8** cur, u64 size) {
+
+  u8* ret = *cur;
+
+  *cur += JOB_ALIGN(size);
+
+  return ret;
+
+}
+
+
+/* Set up a -j worker in the child, right after the fork. It gets its own
+   SHM segments, forkserver, input file and CPU core, and leaves the screen,
+   plot_data and the deterministic stages to the first worker. */
+
+static void setup_job_worker(char** argv) {
+
+#ifdef __linux__
+
+  /* Don't outlive the first worker if it gets killed without a chance to
+     stop us. */
+
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+#endif /* __linux__ */
+
+  not_on_tty = 1;
+
+  if (plot_file) {
+    fclose(plot_file);
+    plot_file = NULL;
+  }
+
+  /* Reseed, or all workers would make the same mutations. */
+
+  rand_cnt = 0;
+
+  skip_deterministic = 1;
+  use_splicing = 1;
+
+  /* The inherited segments and forkserver belong to the first worker, and so
+     do the PIDs of the workers forked before this one. */
+
+  memset(job_pids, 0, sizeof(job_pids));
+
+  shmdt(trace_bits);
+  shmdt(buffer_shm);
+  buffer_shm_id = -1;
+
+  attach_target_shm();
+
+  close(fsrv_ctl_fd);
+  close(fsrv_st_fd);
+  forksrv_pid = 0;
+  child_pid = -1;
+
+  if (out_file) {
+
+    /* @@ has been replaced with the input file of the first worker, start
+       over from the original arguments. */
+
+    u32 i;
+
+    out_file = NULL;
+
+    for (i = 0; job_args[i]; i++) argv[i + 1] = job_args[i];
+
+    detect_file_args(argv + 1);
+
+  } else {
+
+    close(out_fd);
+    setup_stdio_file();
+
+  }
+
+#ifdef HAVE_AFFINITY
+
+  if (cpu_aff >= 0) {
+
+    cpu_set_t c;
+
+    cpu_aff = (cpu_aff + job_id) % cpu_core_count;
+
+    CPU_ZERO(&c);
+    CPU_SET(cpu_aff, &c);
+
+    if (sched_setaffinity(0, sizeof(c), &c))
+      PFATAL("sched_setaffinity failed");
+
+  }
+
+#endif /* HAVE_AFFINITY */
+
+  if (!no_forkserver) init_forkserver(argv);
+
+  /* Setup errors are still shown, from here on the first worker has the
+     screen to itself. */
+
+  dup2(dev_null_fd, 1);
+
+}
+
+
+/* Move the state shared by the -j workers to a MAP_SHARED mapping and fork
+   the other workers (see struct job_state). Called by the first worker after
+   the dry run, returns in all of them. */
+
+static void start_jobs(char** argv) {
+
+  u32 slots = buffer_sites ? dist_slots : MAX(dist_slots, JOBS_DIST_SLOTS);
+  u32 favor_copy = MIN(seed_favor_slots, JOBS_QUEUE_MAX);
+  u64 size;
+  u8 *mem, *cur;
+  u32* favor;
+  struct queue_entry* q;
+  u32 i;
+
+  /* Grow the local table first, so that the new slots are initialized. */
+
+  resize_distance_table(slots);
+
+  size = JOB_ALIGN(sizeof(struct job_state)) + 3 * JOB_ALIGN(map_size) +
+         JOB_ALIGN(BUFFER_DIST_MAP_SIZE) + JOB_ALIGN(slots * sizeof(s64)) +
+         JOB_ALIGN(slots) + 3 * JOB_ALIGN(slots * sizeof(u32)) +
+         JOB_ALIGN(JOBS_QUEUE_MAX * sizeof(u32)) +
+         JOB_ALIGN((u64)JOBS_QUEUE_MAX * sizeof(struct job_entry));
+
+  /* Pages are only backed once touched, most of the queue log never is. */
+
+  mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (mem == MAP_FAILED) PFATAL("mmap() failed for the -j shared state");
+
+  cur = mem;
+
+  job_state = job_carve(&cur, sizeof(struct job_state));
+
+  virgin_bits  = memcpy(job_carve(&cur, map_size), virgin_bits, map_size);
+  virgin_tmout = memcpy(job_carve(&cur, map_size), virgin_tmout, map_size);
+  virgin_crash = memcpy(job_carve(&cur, map_size), virgin_crash, map_size);
+  virgin_dist  = memcpy(job_carve(&cur, BUFFER_DIST_MAP_SIZE), virgin_dist,
+                        BUFFER_DIST_MAP_SIZE);
+
+#define JOB_SHARE(_ptr, _size) do { \
+    void* _shared = memcpy(job_carve(&cur, _size), _ptr, _size); \
+    ck_free(_ptr); \
+    _ptr = _shared; \
+  } while (0)
+
+  JOB_SHARE(dist_min, slots * sizeof(s64));
+  JOB_SHARE(dist_favor, slots);
+  JOB_SHARE(dist_buffer, slots * sizeof(u32));
+  JOB_SHARE(dist_seed, slots * sizeof(u32));
+  JOB_SHARE(dist_important, slots * sizeof(u32));
+
+#undef JOB_SHARE
+
+  job_state->dist_important_cnt = *dist_important_cnt;
+  dist_important_cnt = &job_state->dist_important_cnt;
+
+  favor = job_carve(&cur, JOBS_QUEUE_MAX * sizeof(u32));
+  memcpy(favor, seed_favor, favor_copy * sizeof(u32));
+  ck_free(seed_favor);
+  seed_favor = favor;
+  seed_favor_slots = JOBS_QUEUE_MAX;
+
+  job_queue = job_carve(&cur, (u64)JOBS_QUEUE_MAX * sizeof(struct job_entry));
+
+  /* Every worker has the initial queue already, the log starts after it. */
+
+  job_state->queue_ids = job_imported = queued_paths;
+  job_state->crash_ids = unique_crashes;
+  job_state->hang_ids  = unique_hangs;
+
+  for (q = queue; q; q = q->next) q->trim_done = 1;
+
+  ACTF("Starting %u more worker%s...", jobs - 1, jobs == 2 ? "" : "s");
+
+  fflush(stdout);
+  if (plot_file) fflush(plot_file);
+
+  for (i = 1; i < jobs; i++) {
+
+    s32 pid = fork();
+
+    if (pid < 0) PFATAL("fork() failed");
+
+    if (!pid) {
+
+      job_id = i;
+      setup_job_worker(argv);
+      return;
+
+    }
+
+    job_pids[i] = pid;
+
+  }
+
+}
+
+
+/* Reap -j workers that died on their own, in the first worker. The others
+   skip the queue entries they had claimed but not published yet. */
+
+static void check_jobs(void) {
+
+  u32 i, owner;
+
+  for (i = 1; i < jobs; i++) {
+
+    s32 status;
+
+    if (job_pids[i] <= 0 || waitpid(job_pids[i], &status, WNOHANG) <= 0) continue;
+
+    __atomic_store_n(&job_state->dead[i], 1, __ATOMIC_RELEASE);
+    job_pids[i] = 0;
+
+    /* Don't let the others wait for a lock it can't release anymore. */
+
+    owner = i + 1;
+    __atomic_compare_exchange_n(&job_state->dist_lock, &owner, 0, 0,
+                                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+
+    if (WIFSIGNALED(status))
+      WARNF("Worker %u was killed by signal %d, carrying on without it.", i,
+            WTERMSIG(status));
+    else
+      WARNF("Worker %u exited with status %d, carrying on without it.", i,
+            WEXITSTATUS(status));
+
+  }
+
+}
+
+
+/* Stop the other -j workers and wait for them, in the first worker. */
+
+static void stop_jobs(void) {
+
+  u32 i;
+
+  for (i = 1; i < jobs; i++)
+    if (job_pids[i] > 0) kill(job_pids[i], SIGTERM);
+
+  for (i = 1; i < jobs; i++) {
+
+    s32 status;
+
+    if (job_pids[i] <= 0 || waitpid(job_pids[i], &status, 0) <= 0) continue;
+
+    /* Workers stopped by the SIGTERM above exit cleanly. */
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+      WARNF("Worker %u stopped early.", i);
+
+  }
+
+}
+
+
 /* Rewrite argv for QEMU. */
 
 static char** get_qemu_argv(u8* own_loc, char** argv, int argc) {
@@ -8534,7 +9869,7 @@ int main(int argc, char** argv)
   gettimeofday(&tv, &tz);
   srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
 
-  while ((opt = getopt(argc, argv, "+i:o:f:m:b:t:T:dnCB:S:M:x:QV")) > 0)
+  while ((opt = getopt(argc, argv, "+i:o:f:m:b:t:T:dnCB:S:M:x:QVj:")) > 0)
 
     switch (opt) {
 
@@ -8683,7 +10018,6 @@ int main(int argc, char** argv)
         if (in_bitmap) FATAL("Multiple -B options not supported");
 
         in_bitmap = optarg;
-        read_bitmap(in_bitmap);
         break;
 
       case 'C': /* crash mode */
@@ -8714,6 +10048,15 @@ int main(int argc, char** argv)
 
         break;
 
+      case 'j': /* workers */
+
+        if (jobs > 1) FATAL("Multiple -j options not supported");
+
+        if (sscanf(optarg, "%u", &jobs) < 1 || optarg[0] == '-' ||
+            !jobs || jobs > JOBS_MAX) FATAL("Bad syntax used for -j (1-%u)", JOBS_MAX);
+
+        break;
+
       case 'V': /* Show version number */
 
         /* Version number has been printed already, just quit. */
@@ -8742,6 +10085,15 @@ int main(int argc, char** argv)
 
   }
 
+  if (jobs > 1) {
+
+    if (sync_id)   FATAL("-j and -S / -M are mutually exclusive");
+    if (dumb_mode) FATAL("-j and -n are mutually exclusive");
+    if (qemu_mode) FATAL("-j and -Q are mutually exclusive");
+    if (out_file)  FATAL("-j needs @@ or stdin, every worker has its own input file");
+
+  }
+
   // Try with not using forkserver
   // no_forkserver = 1;
   if (getenv("AFL_NO_FORKSRV"))    no_forkserver    = 1;
@@ -8750,6 +10102,7 @@ int main(int argc, char** argv)
   if (getenv("AFL_NO_ARITH"))      no_arith         = 1;
   if (getenv("AFL_SHUFFLE_QUEUE")) shuffle_queue    = 1;
   if (getenv("AFL_FAST_CAL"))      fast_cal         = 1;
+  if (getenv("AFL_BUFFER_DIST_MAP")) dist_map_mode  = 1;
 
   if (getenv("AFL_HANG_TMOUT")) {
     hang_tmout = atoi(getenv("AFL_HANG_TMOUT"));
@@ -8781,9 +10134,9 @@ int main(int argc, char** argv)
 
   check_crash_handling();
   check_cpu_governor();
+  check_simd();
 
   setup_post();
-  setup_shm();
   init_count_class16();
 
   setup_dirs_fds();
@@ -8796,11 +10149,21 @@ int main(int argc, char** argv)
 
   if (!timeout_given) find_timeout();
 
+  /* -j workers redo the @@ substitution with their own input file. */
+
+  if (jobs > 1) {
+    job_args = ck_alloc((argc - optind) * sizeof(char*));
+    memcpy(job_args, argv + optind + 1, (argc - optind - 1) * sizeof(char*));
+  }
+
   detect_file_args(argv + optind + 1);
 
   if (!out_file) setup_stdio_file();
 
   check_binary(argv[optind]);
+  load_map_size();
+  setup_shm();
+  load_buffer_sites();
 
   start_time = get_cur_time();
 
@@ -8810,6 +10173,7 @@ int main(int argc, char** argv)
     use_argv = argv + optind;
 
   perform_dry_run(use_argv);
+  write_buffer_sites();
 
   // cull_queue();
 
@@ -8824,6 +10188,15 @@ int main(int argc, char** argv)
 
   if (stop_soon) goto stop_fuzzing;
 
+  if (jobs > 1) {
+
+    if (jobs > cpu_core_count)
+      WARNF("More workers than CPU cores (%u), they will get in each other's way.", cpu_core_count);
+
+    start_jobs(use_argv);
+
+  }
+
   /* Woop woop woop */
 
   if (!not_on_tty) {
@@ -8836,6 +10209,11 @@ int main(int argc, char** argv)
   while (1) {
     u8 skipped_fuzz;
 
+    if (job_state) {
+      if (!job_id) check_jobs();
+      import_job_entries();
+    }
+
     // cull_queue();
     calculate_favored_entries();
 
@@ -8910,6 +10288,8 @@ int main(int argc, char** argv)
     WARNF("error waitpid\n");
   }
 
+  stop_jobs();
+
   write_bitmap();
   write_stats_file(0, 0, 0);
   save_auto();
@@ -8929,11 +10309,12 @@ stop_fuzzing:
 
   }
 
-  fclose(plot_file);
+  if (plot_file) fclose(plot_file);
   destroy_queue();
   destroy_extras();
   ck_free(target_path);
   ck_free(sync_id);
+  ck_free(job_args);
 
   alloc_report();
 
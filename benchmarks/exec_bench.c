@@ -0,0 +1,146 @@
+/*
+   american fuzzy lop - BufferMonitor exec benchmark
+   -------------------------------------------------
+
+   Runs a target a fixed number of times the way afl-fuzz does without a
+   forkserver (fork + execv, output to /dev/null) and reports:
+
+     - execs/s and usec/exec over all runs,
+
+     - the peak resident set size of the target, which includes the
+       BufferMonitor runtime tables if the target has them,
+
+     - the counters of the BufferMonitor runtime for one more run, taken
+       with AFL_BUFFER_STATS (see llvm_mode/config.h): update_buffer() calls,
+       registered buffers and the shm bytes afl-fuzz would read per exec.
+       Targets without the runtime report no counters.
+
+   The output is a single line of 'name value' pairs, so that overhead.sh can
+   compare the build flavours of a target.
+
+   Usage: ./exec_bench [ -n runs ] [ -i stdin_file ] -- /path/to/target [ args ]
+*/
+
+#include "../types.h"
+#include "../llvm_mode/config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+static u64 now_ns(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+/* Run the target once, returns its peak RSS in kB. */
+
+static long run_once(char** argv, char* in_file) {
+
+  struct rusage usage;
+  s32 status;
+  pid_t pid = fork();
+
+  if (pid < 0) { perror("fork"); exit(1); }
+
+  if (!pid) {
+
+    s32 null_fd = open("/dev/null", O_RDWR);
+    s32 in_fd = in_file ? open(in_file, O_RDONLY) : null_fd;
+
+    if (null_fd < 0 || in_fd < 0) { perror("open"); _exit(1); }
+
+    dup2(in_fd, 0);
+    dup2(null_fd, 1);
+    dup2(null_fd, 2);
+
+    execv(argv[0], argv);
+    _exit(127);
+
+  }
+
+  if (wait4(pid, &status, 0, &usage) < 0) { perror("wait4"); exit(1); }
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+    fprintf(stderr, "'%s' did not run to completion (status %d)\n", argv[0], status);
+    exit(1);
+  }
+
+  return usage.ru_maxrss;
+
+}
+
+int main(int argc, char** argv) {
+
+  char stats_file[] = "/tmp/.exec_bench_XXXXXX";
+  char line[512] = "";
+  char* in_file = NULL;
+  u32 runs = 200, i;
+  long peak_rss = 0;
+  u64 start, elapsed;
+  s32 opt, fd;
+  FILE* f;
+
+  while ((opt = getopt(argc, argv, "+n:i:")) > 0)
+
+    switch (opt) {
+
+      case 'n': runs = atoi(optarg); break;
+      case 'i': in_file = optarg; break;
+      default: goto usage;
+
+    }
+
+  if (optind >= argc || !runs) goto usage;
+
+  unsetenv(BUFFER_STATS_ENV_VAR);
+
+  start = now_ns();
+
+  for (i = 0; i < runs; i++) {
+
+    long rss = run_once(argv + optind, in_file);
+    if (rss > peak_rss) peak_rss = rss;
+
+  }
+
+  elapsed = now_ns() - start;
+
+  /* One extra run for the counters, so that writing them is not timed. */
+
+  fd = mkstemp(stats_file);
+  if (fd < 0) { perror("mkstemp"); return 1; }
+  close(fd);
+
+  setenv(BUFFER_STATS_ENV_VAR, stats_file, 1);
+  run_once(argv + optind, in_file);
+
+  f = fopen(stats_file, "r");
+  if (f) {
+    if (!fgets(line, sizeof(line), f)) line[0] = 0;
+    fclose(f);
+  }
+  unlink(stats_file);
+
+  line[strcspn(line, "\n")] = 0;
+
+  printf("execs_per_sec %.1f usec_per_exec %.1f peak_rss_kb %ld%s%s\n",
+         runs * 1e9 / elapsed, elapsed / 1e3 / runs, peak_rss,
+         line[0] ? " " : "", line);
+
+  return 0;
+
+usage:
+
+  fprintf(stderr, "Usage: %s [ -n runs ] [ -i stdin_file ] -- /path/to/target [ args ]\n", argv[0]);
+  return 1;
+
+}
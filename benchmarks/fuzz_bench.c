@@ -0,0 +1,539 @@
+/*
+   american fuzzy lop - afl-fuzz hot path benchmark
+   ------------------------------------------------
+
+   Measures the functions afl-fuzz runs once per exec or once per seed, on
+   synthetic data and without a target:
+
+     - classify_counts(), has_new_bits(), simplify_trace() and hash32() on
+       trace bitmaps of different densities. has_new_bits() is measured in
+       the common case, where the virgin map already knows every tuple, and
+       simplify_trace() restores its input before every call, the copy is
+       subtracted again. With AVX2, both the scalar and the AVX2 versions
+       are measured, after checking that they agree on random maps (the
+       benchmark fails if they don't),
+
+     - the bitmap work of one exec (clear_trace(), classify_trace() and
+       has_new_bits()) with a full scan and in sparse trace mode, where only
+       the entries in the touched list are looked at,
+
+     - the same for the smaller maps of binaries built with AFL_DENSE_MAP,
+       with the same number of entries set at every map size,
+
+     - handing a testcase to the target: write_to_testcase() on .cur_input
+       plus the read() the target does, against write_to_testcase() into
+       the testcase SHM of harnesses that use __AFL_FUZZ_TESTCASE_BUF,
+
+     - update_buffer_distances() on record streams of different lengths,
+       either in steady state (no gep gets closer, which is what almost every
+       exec looks like) or with every record improving on its gep,
+
+     - calculate_score_buffer_map() over a queue of seeds.
+
+   afl-fuzz.c is compiled in with AFL_LIB, so the functions are the real ones
+   and pick up any change to them. The bitmap size is MAP_SIZE from config.h;
+   the Makefile also builds fuzz_bench_1m with MAP_SIZE_POW2=20 to show how
+   the bitmap functions scale.
+
+   Usage: ./fuzz_bench [ iterations ]
+*/
+
+#define AFL_LIB
+
+#include "../afl-fuzz.c"
+
+#define SEEDS 4096
+
+static u64 rng_state = 0x2545F4914F6CDD1DULL;
+
+static inline u32 rnd(u32 limit) {
+
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (u32)(rng_state % limit);
+
+}
+
+static u64 now_ns(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+static volatile u64 sink;
+
+/* Fill the trace with 'permille' per mille non-zero bytes. Hit counts are
+   small most of the time, like in real traces. */
+
+static void fill_trace(u8* mem, u32 permille) {
+
+  u32 i;
+
+  memset(mem, 0, MAP_SIZE);
+
+  for (i = 0; i < MAP_SIZE; i++)
+    if (rnd(1000) < permille) mem[i] = rnd(8) ? 1 + rnd(4) : 1 + rnd(255);
+
+}
+
+/* Fill with arbitrary bytes, 'permille' of the 32-byte blocks are left
+   empty and as many are all 0xff, so that every kernel sees both skips. */
+
+static void fill_random(u8* mem, u32 permille) {
+
+  u32 i, j;
+
+  for (i = 0; i < MAP_SIZE; i += 32)
+    for (j = 0; j < 32; j++)
+      mem[i + j] = rnd(1000) < permille ? 0 : rnd(256);
+
+  for (i = 0; i < MAP_SIZE; i += 32) {
+    u32 r = rnd(1000);
+    if (r < permille) memset(mem + i, 0, 32);
+    else if (r < 2 * permille) memset(mem + i, 255, 32);
+  }
+
+}
+
+/* Run every kernel with and without AVX2 on the same input and compare the
+   results, including what they leave in the maps. */
+
+static void check_kernels(void) {
+
+  static u8 trace[MAP_SIZE], virgin[MAP_SIZE], out[2][MAP_SIZE], vout[2][MAP_SIZE];
+  static const u32 densities[] = { 0, 5, 50, 300, 1000 };
+
+  u32 round, mode, res[2][6];
+
+  for (round = 0; round < 500; round++) {
+
+    u32 permille = densities[round % (sizeof(densities) / sizeof(densities[0]))];
+
+    fill_random(trace, permille);
+
+    /* Mostly known tuples, with a few new ones and new hit counts. */
+
+    fill_random(virgin, 1000 - permille);
+    if (round & 1) memset(virgin, 255, MAP_SIZE);
+
+    for (mode = 0; mode < 2; mode++) {
+
+      use_avx2 = mode;
+
+      res[mode][0] = count_bits(trace);
+      res[mode][1] = count_bytes(trace);
+      res[mode][2] = count_non_255_bytes(trace);
+
+      memcpy(trace_bits, trace, MAP_SIZE);
+      memcpy(vout[mode], virgin, MAP_SIZE);
+      res[mode][3] = has_new_bits(vout[mode]);
+      res[mode][4] = has_new_bits(vout[mode]);
+
+      classify_counts((u64*)trace_bits);
+      memcpy(out[mode], trace_bits, MAP_SIZE);
+      simplify_trace((u64*)trace_bits);
+      res[mode][5] = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+
+    }
+
+    if (memcmp(res[0], res[1], sizeof(res[0])) || memcmp(out[0], out[1], MAP_SIZE) ||
+        memcmp(vout[0], vout[1], MAP_SIZE)) {
+
+      printf("AVX2 and scalar bitmap functions disagree (round %u, %u permille)\n",
+             round, permille);
+      exit(1);
+
+    }
+
+  }
+
+  use_avx2 = 0;
+
+  printf("AVX2 and scalar bitmap functions agree on %u maps.\n\n", round);
+
+}
+
+static void bench_bitmap(const char* name, u32 permille, u32 iterations) {
+
+  static u8 copy[MAP_SIZE];
+
+  u64 t0, t_classify, t_new_bits, t_copy, t_simplify, t_hash, acc = 0;
+  u32 i;
+
+  fill_trace(trace_bits, permille);
+  memcpy(copy, trace_bits, MAP_SIZE);
+
+  /* Bucketing a bucketed trace keeps the same bytes non-zero, so the trace
+     does not have to be restored between calls. */
+
+  t0 = now_ns();
+  for (i = 0; i < iterations; i++) {
+#ifdef WORD_SIZE_64
+    classify_counts((u64*)trace_bits);
+#else
+    classify_counts((u32*)trace_bits);
+#endif /* ^WORD_SIZE_64 */
+  }
+  t_classify = now_ns() - t0;
+
+  memset(virgin_bits, 255, MAP_SIZE);
+  acc += has_new_bits(virgin_bits);
+
+  t0 = now_ns();
+  for (i = 0; i < iterations; i++) acc += has_new_bits(virgin_bits);
+  t_new_bits = now_ns() - t0;
+
+  t0 = now_ns();
+  for (i = 0; i < iterations; i++) acc += hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  t_hash = now_ns() - t0;
+
+  t0 = now_ns();
+  for (i = 0; i < iterations; i++) {
+    memcpy(trace_bits, copy, MAP_SIZE);
+    acc += trace_bits[i % MAP_SIZE];
+  }
+  t_copy = now_ns() - t0;
+
+  t0 = now_ns();
+  for (i = 0; i < iterations; i++) {
+    memcpy(trace_bits, copy, MAP_SIZE);
+#ifdef WORD_SIZE_64
+    simplify_trace((u64*)trace_bits);
+#else
+    simplify_trace((u32*)trace_bits);
+#endif /* ^WORD_SIZE_64 */
+    acc += trace_bits[i % MAP_SIZE];
+  }
+  t_simplify = now_ns() - t0;
+
+  t_simplify = t_simplify > t_copy ? t_simplify - t_copy : 0;
+
+  sink = acc;
+
+  printf("%-8s %5.1f%%  %12.1f  %12.1f  %12.1f  %12.1f\n", name, permille / 10.0,
+         (double)t_classify / iterations, (double)t_new_bits / iterations,
+         (double)t_simplify / iterations, (double)t_hash / iterations);
+
+}
+
+/* One exec worth of bitmap work, as run_target() and save_if_interesting()
+   do it: clear the trace, write it (and in sparse mode the touched list)
+   like the target would, classify it and look for new bits. */
+
+static void bench_sparse(const char* name, u32 permille, u32 iterations) {
+
+  static u8  copy[MAP_SIZE];
+  static u32 list[MAP_SIZE + 1];
+
+  u64 t0, elapsed[2], acc = 0;
+  u32 i, j, cnt = 0;
+  u8  mode;
+
+  fill_trace(copy, permille);
+
+  for (i = 0; i < MAP_SIZE; i++)
+    if (copy[i]) list[++cnt] = i;
+
+  for (mode = 0; mode < 2; mode++) {
+
+    sparse_trace = mode;
+    trace_listed = 0;
+
+    memset(virgin_bits, 255, MAP_SIZE);
+
+    t0 = now_ns();
+
+    for (i = 0; i < iterations; i++) {
+
+      clear_trace();
+
+      for (j = 1; j <= cnt; j++) trace_bits[list[j]] = copy[list[j]];
+
+      if (mode) {
+        memcpy(touched + 1, list + 1, cnt * sizeof(u32));
+        touched[0] = cnt;
+      }
+
+      classify_trace();
+      acc += has_new_bits(virgin_bits);
+
+    }
+
+    elapsed[mode] = now_ns() - t0;
+
+  }
+
+  sparse_trace = trace_listed = 0;
+
+  sink = acc;
+
+  printf("%-8s %5.1f%%  %12.1f  %12.1f\n", name, permille / 10.0,
+         (double)elapsed[0] / iterations, (double)elapsed[1] / iterations);
+
+}
+
+/* One exec worth of bitmap work with a map_size of 'size', as afl-fuzz
+   would use it for a dense binary. */
+
+static void bench_map_size(u32 size, u32 hits, u32 iterations) {
+
+  static u32 list[MAP_SIZE];
+
+  u64 t0, elapsed, acc = 0;
+  u32 i, j;
+
+  for (j = 0; j < hits; j++) list[j] = rnd(size);
+
+  map_size = size;
+  memset(virgin_bits, 255, size);
+
+  t0 = now_ns();
+
+  for (i = 0; i < iterations; i++) {
+
+    clear_trace();
+
+    for (j = 0; j < hits; j++) trace_bits[list[j]]++;
+
+    classify_trace();
+    acc += has_new_bits(virgin_bits);
+
+  }
+
+  elapsed = now_ns() - t0;
+
+  map_size = MAP_SIZE;
+
+  sink = acc;
+
+  printf("%8u  %8u  %12.1f\n", size, hits, (double)elapsed / iterations);
+
+}
+
+/* Hand a testcase of 'len' bytes to the target 'iterations' times, through
+   .cur_input (the way stdin targets get it) or through the testcase SHM. */
+
+static void bench_testcase(u32 len, u32 iterations) {
+
+  static u8 data[MAX_FILE], target_buf[MAX_FILE];
+
+  char fname[] = "/tmp/.fuzz_bench_XXXXXX";
+  u64 t0, elapsed[2], acc = 0;
+  u32 i;
+  u8  mode;
+
+  for (i = 0; i < len; i++) data[i] = rnd(256);
+
+  out_fd = mkstemp(fname);
+  if (out_fd < 0) PFATAL("mkstemp() failed");
+  unlink(fname);
+
+  for (mode = 0; mode < 2; mode++) {
+
+    shm_fuzz = mode ? ck_alloc(SHM_FUZZ_SIZE) : NULL;
+
+    t0 = now_ns();
+
+    for (i = 0; i < iterations; i++) {
+
+      write_to_testcase(data, len);
+
+      if (mode) {
+        acc += *(u32*)shm_fuzz + shm_fuzz[4 + i % len];
+      } else {
+        acc += read(out_fd, target_buf, MAX_FILE);
+        lseek(out_fd, 0, SEEK_SET);
+      }
+
+    }
+
+    elapsed[mode] = now_ns() - t0;
+
+    if (mode) ck_free(shm_fuzz);
+
+  }
+
+  shm_fuzz = NULL;
+  close(out_fd);
+
+  sink = acc;
+
+  printf("%8u  %12.1f  %12.1f\n", len, (double)elapsed[0] / iterations,
+         (double)elapsed[1] / iterations);
+
+}
+
+/* Replay 'records' records over 'geps' different geps. With 'progress' set,
+   every record is 1 byte closer than in the call before. */
+
+static void bench_records(u32 records, u32 geps, u8 progress, u32 iterations) {
+
+  u64 t0, elapsed, acc = 0;
+  u32 i, j;
+  u8  overflow = 0;
+
+  /* Start every scenario from an empty table. */
+
+  for (i = 0; i < dist_slots; i++) {
+    dist_min[i] = DIST_UNSEEN;
+    dist_favor[i] = UNFAVORABLE;
+  }
+
+  *dist_important_cnt = 0;
+
+  for (i = 0; i < records; i++) {
+
+    buffer_shm->records[i].buffer_id = 1 + rnd(1024);
+    buffer_shm->records[i].gep_id = 1 + rnd(geps);
+    buffer_shm->records[i].flags = 0;
+    buffer_shm->records[i].distance = 1000000 + rnd(4096);
+
+  }
+
+  /* Warm up: the first call sees every gep for the first time. */
+
+  buffer_shm->header.count = records;
+  update_buffer_distances(&overflow);
+
+  t0 = now_ns();
+
+  for (i = 0; i < iterations; i++) {
+
+    if (progress)
+      for (j = 0; j < records; j++) buffer_shm->records[j].distance--;
+
+    buffer_shm->header.count = records;
+    acc += update_buffer_distances(&overflow);
+
+  }
+
+  elapsed = now_ns() - t0;
+
+  sink = acc;
+
+  printf("%8u  %8u  %-9s  %12.1f  %12.2f\n", records, geps,
+         progress ? "progress" : "steady", (double)elapsed / iterations,
+         (double)elapsed / iterations / records);
+
+}
+
+static void bench_score(u32 iterations) {
+
+  struct queue_entry* seeds = ck_alloc(SEEDS * sizeof(struct queue_entry));
+  u64 t0, elapsed, acc = 0;
+  u32 i, j;
+
+  seed_favor = ck_alloc(SEEDS * sizeof(u32));
+  seed_favor_slots = SEEDS;
+
+  for (i = 0; i < SEEDS; i++) {
+    seeds[i].id = i;
+    seed_favor[i] = rnd(64);
+  }
+
+  t0 = now_ns();
+  for (i = 0; i < iterations; i++)
+    for (j = 0; j < SEEDS; j++) acc += calculate_score_buffer_map(&seeds[j]);
+  elapsed = now_ns() - t0;
+
+  sink = acc;
+
+  printf("calculate_score_buffer_map: %.2f ns/call\n",
+         (double)elapsed / iterations / SEEDS);
+
+  ck_free(seeds);
+  ck_free(seed_favor);
+
+}
+
+int main(int argc, char** argv) {
+
+  static const u32 densities[] = { 5, 50, 300 };
+  static const char* names[] = { "sparse", "medium", "dense" };
+  static const u32 record_counts[] = { 16, 128, BUFFER_DATA_CHUNK_COUNT };
+
+  u32 iterations = 2000;
+  u32 i;
+  u8  avx2 = 0;
+
+  if (argc > 1) iterations = atoi(argv[1]);
+  if (!iterations) iterations = 1;
+
+  /* What setup_shm() would set up, without the shmget(). */
+
+  virgin_bits = ck_alloc(MAP_SIZE);
+  trace_bits = ck_alloc(MAP_SIZE + TOUCHED_LIST_SIZE);
+  touched = (u32*)(trace_bits + MAP_SIZE);
+  buffer_shm = ck_alloc(sizeof(buffer_shm_t));
+
+  init_count_class16();
+  resize_distance_table(DIST_TABLE_INIT);
+
+  /* check_simd() without the chatter; the scalar versions run first. */
+
+#ifdef HAVE_AVX2_KERNELS
+  __builtin_cpu_init();
+  avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+  if (avx2) check_kernels();
+#endif /* HAVE_AVX2_KERNELS */
+
+  printf("afl-fuzz hot paths, MAP_SIZE %u, %u iterations\n\n", MAP_SIZE, iterations);
+
+  printf("%-8s %6s  %12s  %12s  %12s  %12s\n", "trace", "set",
+         "classify ns", "new_bits ns", "simplify ns", "hash32 ns");
+
+  for (i = 0; i < sizeof(densities) / sizeof(densities[0]); i++)
+    bench_bitmap(names[i], densities[i], iterations);
+
+  if (avx2) {
+
+    printf("\nwith AVX2:\n");
+
+    use_avx2 = 1;
+
+    for (i = 0; i < sizeof(densities) / sizeof(densities[0]); i++)
+      bench_bitmap(names[i], densities[i], iterations);
+
+  }
+
+  /* Past the dry run, classify_trace() doesn't check the list anymore. */
+
+  queue_cycle = 1;
+
+  printf("\nper exec, full map vs. touched list\n\n%-8s %6s  %12s  %12s\n",
+         "trace", "set", "full ns", "sparse ns");
+
+  for (i = 0; i < sizeof(densities) / sizeof(densities[0]); i++)
+    bench_sparse(names[i], densities[i], iterations);
+
+  printf("\nper exec, dense map\n\n%8s  %8s  %12s\n", "entries", "set", "ns");
+
+  for (i = 10; i <= MAP_SIZE_POW2; i += 2)
+    bench_map_size(1 << i, 200, iterations);
+
+  printf("\ntestcase delivery\n\n%8s  %12s  %12s\n", "bytes", "file ns", "shm ns");
+
+  for (i = 64; i <= 65536; i *= 32)
+    bench_testcase(i, iterations * 10);
+
+  printf("\nupdate_buffer_distances()\n\n%8s  %8s  %-9s  %12s  %12s\n",
+         "records", "geps", "mode", "ns/call", "ns/record");
+
+  for (i = 0; i < sizeof(record_counts) / sizeof(record_counts[0]); i++) {
+
+    bench_records(record_counts[i], 64, 0, iterations * 10);
+    bench_records(record_counts[i], 1 << 18, 0, iterations * 10);
+    bench_records(record_counts[i], 1 << 18, 1, iterations * 10);
+
+  }
+
+  printf("\n");
+
+  bench_score(iterations);
+
+  return 0;
+
+}
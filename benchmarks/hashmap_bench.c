@@ -0,0 +1,166 @@
+/*
+   american fuzzy lop - BufferMonitor runtime table benchmark
+   ----------------------------------------------------------
+
+   Measures the per-access cost of the buffer table used by BufferMonitorLib
+   (llvm_mode/HashMap.c) and compares it against the original 500-bucket
+   chained implementation (legacy_hashmap.h).
+
+   Every scenario registers a number of live heap buffers, touches each of
+   them with a few gep IDs, and then replays a fixed, pre-generated sequence
+   of update_node() calls - which is exactly what update_buffer() does for
+   every instrumented access. The same sequence is then replayed through
+   pointers into the middle of the buffers, which the table resolves through
+   its range index (the legacy map has no equivalent and simply misses).
+   A last pass measures remove + insert churn, as seen with short-lived
+   allocations.
+
+   Usage: ./hashmap_bench [ accesses ]
+*/
+
+#include "../types.h"
+#include "../llvm_mode/HashMap.h"
+#include "legacy_hashmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define GEPS_PER_BUFFER 4
+
+static u64 rng_state = 0x2545F4914F6CDD1DULL;
+
+static inline u32 rnd(u32 limit) {
+
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (u32)(rng_state % limit);
+
+}
+
+static u64 now_ns(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+static volatile u64 sink;
+
+static void run_scenario(u32 buffers, u32 accesses) {
+
+  void** keys  = malloc(buffers * sizeof(void*));
+  u32*   order = malloc(accesses * sizeof(u32));
+  u32    i;
+
+  hash_map_t*   map    = create_hash_map();
+  legacy_map_t* legacy = legacy_create();
+
+  u64 t0, t_new, t_legacy, t_inner, c_new, c_legacy, hits = 0;
+  u32 churn = accesses / 16;
+
+  /* Real heap pointers, so that alignment matches what the runtime sees. */
+
+  for (i = 0; i < buffers; i++) {
+
+    keys[i] = malloc(16 + rnd(240));
+
+    insert_node(map, keys[i], i + 1, keys[i], 256, 0);
+    legacy_insert(legacy, keys[i], i + 1, 256);
+
+  }
+
+  for (i = 0; i < buffers * GEPS_PER_BUFFER; i++) {
+
+    update_node(map, keys[i / GEPS_PER_BUFFER], i % GEPS_PER_BUFFER + 1, 64, NULL);
+    legacy_update(legacy, keys[i / GEPS_PER_BUFFER], i % GEPS_PER_BUFFER + 1, 64);
+
+  }
+
+  for (i = 0; i < accesses; i++) order[i] = rnd(buffers * GEPS_PER_BUFFER);
+
+  /* Steady state: mostly non-improving accesses to known (buffer, gep) pairs. */
+
+  t0 = now_ns();
+  for (i = 0; i < accesses; i++)
+    hits += legacy_update(legacy, keys[order[i] / GEPS_PER_BUFFER],
+                          order[i] % GEPS_PER_BUFFER + 1, 1 + (i & 127));
+  t_legacy = now_ns() - t0;
+
+  t0 = now_ns();
+  for (i = 0; i < accesses; i++)
+    hits += !!update_node(map, keys[order[i] / GEPS_PER_BUFFER],
+                          order[i] % GEPS_PER_BUFFER + 1, 1 + (i & 127), NULL);
+  t_new = now_ns() - t0;
+
+  /* Interior pointers: every buffer is at least 16 bytes, so +8 stays inside. */
+
+  t0 = now_ns();
+  for (i = 0; i < accesses; i++)
+    hits += !!update_node(map, (u8*)keys[order[i] / GEPS_PER_BUFFER] + 8,
+                          order[i] % GEPS_PER_BUFFER + 1, 1 + (i & 127), NULL);
+  t_inner = now_ns() - t0;
+
+  /* Churn: a buffer goes away and its address gets registered again. */
+
+  t0 = now_ns();
+  for (i = 0; i < churn; i++) {
+    void* key = keys[order[i] / GEPS_PER_BUFFER];
+    legacy_remove(legacy, key);
+    legacy_insert(legacy, key, i, 256);
+  }
+  c_legacy = now_ns() - t0;
+
+  t0 = now_ns();
+  for (i = 0; i < churn; i++) {
+    void* key = keys[order[i] / GEPS_PER_BUFFER];
+    remove_node(map, key);
+    insert_node(map, key, i, key, 256, 0);
+  }
+  c_new = now_ns() - t0;
+
+  sink = hits;
+
+  printf("%9u  %13.2f  %13.2f  %7.1fx  %13.2f  %13.2f  %13.2f  %7.1fx\n",
+         buffers, (double)t_legacy / accesses, (double)t_new / accesses,
+         (double)t_legacy / (t_new ? t_new : 1),
+         (double)t_inner / accesses,
+         (double)c_legacy / churn, (double)c_new / churn,
+         (double)c_legacy / (c_new ? c_new : 1));
+
+  legacy_free(legacy);
+  free_hash_map(map);
+
+  for (i = 0; i < buffers; i++) free(keys[i]);
+
+  free(keys);
+  free(order);
+
+}
+
+int main(int argc, char** argv) {
+
+  static const u32 sizes[] = { 16, 256, 1024, 4096, 16384, 65536 };
+
+  u32 accesses = 1 << 22;
+  u32 i;
+
+  if (argc > 1) accesses = atoi(argv[1]);
+  if (accesses < 16) accesses = 16;
+
+  printf("BufferMonitor buffer table, %u accesses per scenario (%u geps per buffer)\n\n",
+         accesses, GEPS_PER_BUFFER);
+
+  printf("%9s  %13s  %13s  %8s  %13s  %13s  %13s  %8s\n", "buffers",
+         "legacy ns/acc", "table ns/acc", "speedup", "inner ns/acc",
+         "legacy ns/chg", "table ns/chg", "speedup");
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    run_scenario(sizes[i], accesses);
+
+  return 0;
+
+}
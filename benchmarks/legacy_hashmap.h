@@ -0,0 +1,141 @@
+/*
+   Reference copy of the original 500-bucket chained buffer map from
+   llvm_mode/HashMap.c, kept around so that hashmap_bench can compare the
+   current runtime table against it. Only the parts exercised on the hot
+   path (insert, update, remove) are reproduced; names carry a legacy_
+   prefix so both implementations can be linked into one binary.
+*/
+
+#ifndef LEGACY_HASHMAP_H
+#define LEGACY_HASHMAP_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define LEGACY_HASH_MAP_SIZE 500
+
+typedef struct legacy_gep {
+  uint64_t gep_id;
+  uint64_t accessed_byte;
+  struct legacy_gep* next;
+} legacy_gep_t;
+
+typedef struct legacy_node {
+  void* key;
+  uint32_t buffer_id;
+  uint64_t buffer_size;
+  legacy_gep_t* geps;
+  struct legacy_node* next;
+} legacy_node_t;
+
+typedef struct legacy_map {
+  legacy_node_t* buckets[LEGACY_HASH_MAP_SIZE];
+} legacy_map_t;
+
+static inline uint32_t legacy_hash(void* key) {
+  return (uint32_t)((uintptr_t)key % LEGACY_HASH_MAP_SIZE);
+}
+
+static legacy_map_t* legacy_create(void) {
+  return calloc(1, sizeof(legacy_map_t));
+}
+
+/* Appends at the tail of the bucket, like insert_node() used to. */
+
+static void legacy_insert(legacy_map_t* map, void* key, uint32_t buffer_id,
+                          uint64_t buffer_size) {
+
+  uint32_t hash = legacy_hash(key);
+  legacy_node_t* node = malloc(sizeof(legacy_node_t));
+
+  node->key         = key;
+  node->buffer_id   = buffer_id;
+  node->buffer_size = buffer_size;
+  node->geps        = NULL;
+  node->next        = NULL;
+
+  if (!map->buckets[hash]) {
+    map->buckets[hash] = node;
+  } else {
+    legacy_node_t* cur = map->buckets[hash];
+    while (cur->next) cur = cur->next;
+    cur->next = node;
+  }
+
+}
+
+static uint8_t legacy_update(legacy_map_t* map, void* key, uint64_t gep_id,
+                             uint64_t accessed_byte) {
+
+  legacy_node_t* node;
+
+  if (!accessed_byte) return 0;
+
+  for (node = map->buckets[legacy_hash(key)]; node; node = node->next) {
+
+    legacy_gep_t* gep;
+
+    if (node->key != key) continue;
+
+    for (gep = node->geps; gep; gep = gep->next)
+      if (gep->gep_id == gep_id) {
+        if (accessed_byte > gep->accessed_byte) gep->accessed_byte = accessed_byte;
+        return 1;
+      }
+
+    gep = malloc(sizeof(legacy_gep_t));
+    gep->gep_id        = gep_id;
+    gep->accessed_byte = accessed_byte;
+    gep->next          = node->geps;
+    node->geps         = gep;
+    return 1;
+
+  }
+
+  return 0;
+
+}
+
+static void legacy_remove(legacy_map_t* map, void* key) {
+
+  uint32_t hash = legacy_hash(key);
+  legacy_node_t *node = map->buckets[hash], *prev = NULL;
+
+  while (node) {
+
+    if (node->key == key) {
+
+      legacy_gep_t* gep = node->geps;
+
+      if (prev) prev->next = node->next; else map->buckets[hash] = node->next;
+
+      while (gep) {
+        legacy_gep_t* next = gep->next;
+        free(gep);
+        gep = next;
+      }
+
+      free(node);
+      return;
+
+    }
+
+    prev = node;
+    node = node->next;
+
+  }
+
+}
+
+static void legacy_free(legacy_map_t* map) {
+
+  uint32_t i;
+
+  for (i = 0; i < LEGACY_HASH_MAP_SIZE; i++)
+    while (map->buckets[i]) legacy_remove(map, map->buckets[i]->key);
+
+  free(map);
+
+}
+
+#endif /* !LEGACY_HASHMAP_H */
@@ -0,0 +1,76 @@
+#!/bin/sh
+#
+# american fuzzy lop - BufferMonitor overhead benchmark
+# -----------------------------------------------------
+#
+# Builds every program in targets/ three times with the same flags:
+#
+#   native  - plain $CC,
+#   afl     - afl-clang-fast with AFL_NO_BUFFER_MONITOR, i.e. edge coverage only,
+#   bm      - afl-clang-fast with the BufferMonitor pass and runtime,
+#
+# runs each build through exec_bench and prints one table row per target.
+# The BufferMonitor cost is taken relative to the 'afl' build, so that the
+# coverage instrumentation is not charged to it. See README.benchmarks.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at:
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+
+CC=${CC:-clang}
+BENCH_CFLAGS=${BENCH_CFLAGS:--O2}
+RUNS=${RUNS:-100}
+OUT=${OUT:-./overhead_bin}
+
+AFL_CC=../afl-clang-fast
+
+if [ ! -x "$AFL_CC" -o ! -f ../afl-llvm-rt.o ]; then
+  echo "[-] Error: build llvm_mode first ('make -C ../llvm_mode')." 1>&2
+  exit 1
+fi
+
+make -s exec_bench || exit 1
+mkdir -p "$OUT" || exit 1
+
+# afl-clang-fast adds its own optimization flags unless told otherwise, which
+# would make the flavours incomparable.
+
+export AFL_DONT_OPTIMIZE=1
+export AFL_QUIET=1
+
+printf "%-16s %10s %10s %10s %10s %10s %10s %10s\n" \
+  target native/s afl/s bm/s accesses "ns/acc" "rss+kB" "shm B/ex"
+
+for src in targets/*.c; do
+
+  name=`basename "$src" .c`
+
+  $CC $BENCH_CFLAGS "$src" -o "$OUT/$name.native" || exit 1
+  AFL_NO_BUFFER_MONITOR=1 $AFL_CC $BENCH_CFLAGS "$src" -o "$OUT/$name.afl" || exit 1
+  $AFL_CC $BENCH_CFLAGS "$src" -o "$OUT/$name.bm" 2>/dev/null || exit 1
+
+  native=`./exec_bench -n "$RUNS" -- "$OUT/$name.native"` || exit 1
+  afl=`./exec_bench -n "$RUNS" -- "$OUT/$name.afl"` || exit 1
+  bm=`./exec_bench -n "$RUNS" -- "$OUT/$name.bm"` || exit 1
+
+  echo "$native
+$afl
+$bm" | awk -v name="$name" '
+    function get(line, k,   n, f, i) {
+      n = split(line, f, " ")
+      for (i = 1; i < n; i++) if (f[i] == k) return f[i + 1]
+      return 0
+    }
+    { l[NR] = $0 }
+    END {
+      acc = get(l[3], "updates")
+      ns = acc ? (get(l[3], "usec_per_exec") - get(l[2], "usec_per_exec")) * 1000 / acc : 0
+      printf "%-16s %10.1f %10.1f %10.1f %10d %10.2f %10d %10d\n", name,
+        get(l[1], "execs_per_sec"), get(l[2], "execs_per_sec"), get(l[3], "execs_per_sec"),
+        acc, ns, get(l[3], "peak_rss_kb") - get(l[2], "peak_rss_kb"), get(l[3], "shm_bytes")
+    }'
+
+done
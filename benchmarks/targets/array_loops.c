@@ -0,0 +1,59 @@
+/*
+   american fuzzy lop - BufferMonitor benchmark target: array loops
+   -----------------------------------------------------------------
+
+   Dense loops over global, stack and heap arrays: a small matrix product,
+   prefix sums and a histogram with data dependent indices. Most of the
+   accesses here are candidates for the static bounds elimination and for
+   hoisting out of loops, so this is where pass changes show up.
+
+   Usage: ./array_loops [ rounds ]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 48
+
+static int matrix_a[N][N];
+static int matrix_b[N][N];
+
+int main(int argc, char** argv) {
+
+  int rounds = argc > 1 ? atoi(argv[1]) : 40;
+  int product[N][N];
+  unsigned histogram[256] = { 0 };
+  int* prefix = malloc(N * N * sizeof(int));
+  long checksum = 0;
+  int r, i, j, k;
+
+  for (i = 0; i < N; i++)
+    for (j = 0; j < N; j++) {
+      matrix_a[i][j] = (i * 31 + j * 17) & 0xff;
+      matrix_b[i][j] = (i * 7 + j * 13) & 0xff;
+    }
+
+  for (r = 0; r < rounds; r++) {
+
+    for (i = 0; i < N; i++)
+      for (j = 0; j < N; j++) {
+        int sum = 0;
+        for (k = 0; k < N; k++) sum += matrix_a[i][k] * matrix_b[k][j];
+        product[i][j] = sum + r;
+      }
+
+    prefix[0] = product[0][0];
+    for (i = 1; i < N * N; i++) prefix[i] = prefix[i - 1] + product[i / N][i % N];
+
+    for (i = 0; i < N * N; i++) histogram[prefix[i] & 0xff]++;
+
+    checksum += prefix[N * N - 1] + histogram[r & 0xff];
+
+  }
+
+  printf("%ld\n", checksum);
+
+  free(prefix);
+  return 0;
+
+}
@@ -0,0 +1,52 @@
+/*
+   american fuzzy lop - BufferMonitor benchmark target: heap churn
+   ----------------------------------------------------------------
+
+   Many small, short-lived heap allocations of varying size, each written and
+   read a few times before it is freed again, with a sliding window of live
+   blocks. Every allocation is registered with and released from the
+   runtime, so this measures the buffer table rather than the access path.
+
+   Usage: ./heap_churn [ allocations ]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define WINDOW 512
+
+int main(int argc, char** argv) {
+
+  int allocations = argc > 1 ? atoi(argv[1]) : 200000;
+  unsigned char* live[WINDOW] = { 0 };
+  unsigned sizes[WINDOW] = { 0 };
+  unsigned seed = 1;
+  long checksum = 0;
+  int i;
+  unsigned j;
+
+  for (i = 0; i < allocations; i++) {
+
+    unsigned slot = i % WINDOW;
+
+    if (live[slot]) {
+      checksum += live[slot][sizes[slot] - 1];
+      free(live[slot]);
+    }
+
+    seed = seed * 1103515245 + 12345;
+    sizes[slot] = 8 + (seed >> 16) % 120;
+
+    live[slot] = malloc(sizes[slot]);
+
+    for (j = 0; j < sizes[slot]; j++) live[slot][j] = (unsigned char)(i + j);
+
+  }
+
+  for (i = 0; i < WINDOW; i++) free(live[i]);
+
+  printf("%ld\n", checksum);
+
+  return 0;
+
+}
@@ -0,0 +1,48 @@
+/*
+   american fuzzy lop - BufferMonitor benchmark target: stack recursion
+   ---------------------------------------------------------------------
+
+   Deep recursion where every frame owns two small stack arrays that are
+   filled and read again on the way back up. Every call registers its
+   arrays and releases them on return, so this measures the cost of frames.
+
+   Usage: ./stack_recursion [ rounds ]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEPTH 200
+
+static long descend(int depth, int seed) {
+
+  char name[32];
+  int values[16];
+  long sum = 0;
+  int i;
+
+  for (i = 0; i < 16; i++) values[i] = seed + i * depth;
+  for (i = 0; i < 31; i++) name[i] = 'a' + (seed + i) % 26;
+  name[31] = 0;
+
+  if (depth) sum = descend(depth - 1, values[depth % 16] & 0xff);
+
+  for (i = 0; i < 16; i++) sum += values[i];
+
+  return sum + name[depth % 31];
+
+}
+
+int main(int argc, char** argv) {
+
+  int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+  long checksum = 0;
+  int r;
+
+  for (r = 0; r < rounds; r++) checksum += descend(DEPTH, r);
+
+  printf("%ld\n", checksum);
+
+  return 0;
+
+}
@@ -0,0 +1,50 @@
+/*
+   american fuzzy lop - BufferMonitor benchmark target: string functions
+   ----------------------------------------------------------------------
+
+   strcpy, memcpy and memset on small stack and heap buffers, as found in
+   parsers and protocol code. The pass instruments these calls rather than
+   the loads and stores inside of them, and strcpy costs an extra strlen().
+
+   Usage: ./string_ops [ rounds ]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* words[] = {
+  "GET", "POST", "Content-Length", "Transfer-Encoding", "chunked",
+  "keep-alive", "application/octet-stream", "Host", "localhost"
+};
+
+#define WORD_COUNT (sizeof(words) / sizeof(words[0]))
+
+int main(int argc, char** argv) {
+
+  int rounds = argc > 1 ? atoi(argv[1]) : 300000;
+  char line[128];
+  char* copy = malloc(128);
+  long checksum = 0;
+  int r;
+
+  for (r = 0; r < rounds; r++) {
+
+    const char* word = words[r % WORD_COUNT];
+    size_t len = strlen(word);
+
+    memset(line, ' ', sizeof(line));
+    strcpy(line, word);
+    memcpy(copy, line, len + 1);
+    memcpy(copy + len, ": ", 3);
+
+    checksum += copy[len] + line[len - 1] + (long)len;
+
+  }
+
+  printf("%ld\n", checksum);
+
+  free(copy);
+  return 0;
+
+}
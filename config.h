@@ -216,6 +216,21 @@
 
 #define SYNC_INTERVAL       5
 
+/* Maximum number of workers for -j, and the number of queue entries they can
+   share (later entries stay with the worker that found them): */
+
+#define JOBS_MAX            64
+#define JOBS_QUEUE_MAX      (1 << 18)
+
+/* Longest queue file name that can be shared between -j workers: */
+
+#define JOBS_FNAME_MAX      192
+
+/* Size of the shared distance table for -j if the target has no site table
+   to size it from (see llvm_mode/BufferSites.h): */
+
+#define JOBS_DIST_SLOTS     (1 << 20)
+
 /* Output directory reuse grace period (minutes): */
 
 #define OUTPUT_GRACE        25
@@ -284,11 +299,22 @@
 #define AS_LOOP_ENV_VAR     "__AFL_AS_LOOPCHECK"
 #define PERSIST_ENV_VAR     "__AFL_PERSISTENT"
 #define DEFER_ENV_VAR       "__AFL_DEFER_FORKSRV"
+#define SPARSE_ENV_VAR      "__AFL_SPARSE_TRACE"
+#define SHM_FUZZ_ENV_VAR    "__AFL_SHM_FUZZ_ID"
 
-/* In-code signatures for deferred and persistent mode. */
+/* In-code signatures for deferred, persistent, sparse trace mode and
+   shared memory testcases. */
 
 #define PERSIST_SIG         "##SIG_AFL_PERSISTENT##"
 #define DEFER_SIG           "##SIG_AFL_DEFER_FORKSRV##"
+#define SPARSE_SIG          "##SIG_AFL_SPARSE_TRACE##"
+#define SHM_FUZZ_SIG        "##SIG_AFL_SHM_FUZZ##"
+
+/* Size of the SHM region that holds the testcase for harnesses that use
+   __AFL_FUZZ_TESTCASE_BUF and __AFL_FUZZ_TESTCASE_LEN: a u32 length,
+   followed by up to MAX_FILE bytes of data. */
+
+#define SHM_FUZZ_SIZE       (MAX_FILE + 4)
 
 /* Distinctive bitmap signature used to indicate failed execution: */
 
@@ -323,11 +349,44 @@
    2; you probably want to keep it under 18 or so for performance reasons
    (adjusting AFL_INST_RATIO when compiling is probably a better way to solve
    problems with complex programs). You need to recompile the target binary
-   after changing this - otherwise, SEGVs may ensue. */
+   after changing this - otherwise, SEGVs may ensue. Only benchmarks/ sets it
+   on the command line. */
 
-#define MAP_SIZE_POW2       16
+#ifndef MAP_SIZE_POW2
+#  define MAP_SIZE_POW2     16
+#endif /* !MAP_SIZE_POW2 */
 #define MAP_SIZE            (1 << MAP_SIZE_POW2)
 
+/* Targets built with AFL_SPARSE_TRACE list the map entries they touch in
+   the same SHM segment, right after the bitmap: a u32 count, followed by up
+   to MAP_SIZE u32 indices. Indices past the end wrap around, so the count is
+   all afl-fuzz can trust once it gets that high. */
+
+#define TOUCHED_LIST_SIZE   ((MAP_SIZE + 1) * 4)
+
+/* Longest touched list afl-fuzz walks; past that, scanning the whole map is
+   faster (see benchmarks/fuzz_bench): */
+
+#define TOUCHED_LIST_MAX    (MAP_SIZE >> 6)
+
+/* Targets built with AFL_DENSE_MAP number their map entries from 1 up,
+   instead of picking them at random from MAP_SIZE. Every module puts one
+   byte per entry into this section, so its size in the linked binary, plus
+   entry 0 for the runtime, is what the map has to hold; afl-fuzz reads it
+   from there. Keep the name a valid C identifier, the linker only provides
+   __start_ and __stop_ symbols for those: */
+
+#define DENSE_MAP_SECTION   "afl_dense_map"
+
+/* Modules built without AFL_DENSE_MAP put a byte into this section instead,
+   so that binaries that mix both kinds can be refused: */
+
+#define CLASSIC_MAP_SECTION "afl_classic_map"
+
+/* Largest map afl-fuzz allocates for a dense binary: */
+
+#define DENSE_MAP_MAX       (1 << 24)
+
 /* Maximum allocator request size (keep well under INT_MAX): */
 
 #define MAX_ALLOC           0x40000000
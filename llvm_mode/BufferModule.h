@@ -0,0 +1,43 @@
+#ifndef BUFFER_MODULE_H
+#define BUFFER_MODULE_H
+
+#include <stdint.h>
+
+#include "HashMap.h"
+
+/*
+    Every module instrumented by BufferMonitor numbers its buffers and getelementptr instructions
+    starting at zero and describes itself with one of these. A constructor of the module registers it
+    with __buffer_monitor_register_module(), and the runtime hands out consecutive ranges of global IDs
+    in registration order. The IDs in a module do not depend on anything outside of it, so parallel
+    and cached builds produce the same objects.
+
+    The instrumentation adds 'gep_base' or 'buffer_base' to its local IDs, and looks up the inline
+    shadow of its gep i at shadow[i]. The layout has to match moduleDescriptorType in BufferMonitor.cpp.
+
+    The global arrays of the module are not registered by instrumented code but by the runtime, from
+    the 'globals' table, when the module registers. Global i has local buffer ID i.
+*/
+
+typedef struct buffer_global
+{
+    void* address;
+    uint64_t size;
+} buffer_global_t;
+
+typedef struct buffer_module
+{
+    uint64_t gep_base;          // Global ID of gep 0 of this module, 0 until registered
+    uint32_t buffer_base;       // Global ID of buffer 0 of this module
+    uint32_t gep_count;
+    uint32_t buffer_count;
+    uint32_t module_hash;       // Identifies the module, see BufferSites.h
+    buffer_shadow_t* shadow;    // Private to the module until registered, then part of __buffer_shadow_
+    const void* sites;          // Site blob of the module, keeps it from being garbage collected
+    const buffer_global_t* globals;
+    uint32_t global_count;
+} buffer_module_t;
+
+void __buffer_monitor_register_module(buffer_module_t* module);
+
+#endif // BUFFER_MODULE_H
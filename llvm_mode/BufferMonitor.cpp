@@ -4,20 +4,41 @@
 #include "llvm/IR/Constant.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Attributes.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/ConstantRange.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
-#include <mutex>
 #include <string>
-#include <fstream>
+#include <cstring>
+#include <vector>
 #include <cstdint>
+#include <fstream>
 #include <iostream>
+#include <unordered_map>
+#include <fnmatch.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "BufferSites.h"
+#include "../debug.h"
 
 // Print on console only when in debug mode
 #ifdef DEBUG
@@ -43,44 +64,110 @@ namespace
         Module* module;
         std::unique_ptr<IRBuilder<>> builder;
 
-        /*
-        Declare mutex for writing to file.
-        */
-        std::mutex mutex;
-
         /* 
-        Each time a new buffer is found, the bufferID is incremented to assign each buffer a unique id
-        The value zero marks an invalid buffer id
+        Each time a new buffer is found, the bufferID is incremented to assign each buffer a unique id.
+        IDs are local to the module and start at zero, the runtime adds the base of the module when it
+        registers the module descriptor (see BufferModule.h), so the global ID zero still marks an
+        invalid buffer id.
         */
-        uint32_t bufferID = 1;
-        /* This vector contains all ID's of the global data arrays. */
-        std::vector<uint32_t> globalsBufferID;
-        bool globalDataArraysStoredInMain = false;
+        uint32_t bufferID = 0;
+        /*
+        Global arrays of this module, global i has local buffer ID i. They are registered from the table that
+        finalizeModule() puts into the module descriptor, see BufferModule.h.
+        */
+        std::vector<GlobalVariable*> monitoredGlobals;
 
         /*
         Each time a new getelementptr instruction is found, the gepID is incremented to assign each getelementptr instruction a unique id
         Don't get confused by the name, this also counts for malloc, calloc, realloc, etc.
+        Local to the module like bufferID.
         */
-        uint64_t gepID = 1;
+        uint64_t gepID = 0;
 
         // Functions from BufferMonitorLib.c used by the instrumentation
         Function* storeBufferFunction;
+        Function* storeStackBufferFunction;
         Function* updateBufferFunction;
-        Function* storeBufferPointerFunction;
+        Function* releaseBufferFunction;
+        Function* enterFrameFunction;
+        Function* leaveFrameFunction;
 
         // Functions used by the instrumentation
         Function* strlenFunction;
 
-        /* 
-        Global variable set is set to true if global data arrays are stored so we now, we don't have to store
-        them again.
+        /*
+        Static bounds elimination. An access that has been instrumented in the current function is remembered
+        with its base pointer and the SCEV of its index, so that later accesses it dominates and that can never
+        get closer to the end of the buffer can be skipped.
         */
-        GlobalVariable* globalDataArraysStored;
+        struct InstrumentedAccess
+        {
+            const SCEV* index;
+            unsigned elementSizeInBytes;
+            Instruction* position;
+        };
+
+        std::unordered_map<Value*, std::vector<InstrumentedAccess>> instrumentedAccesses;
+
+        /* Descriptor of this module, its layout has to match buffer_module_t in BufferModule.h. */
+        GlobalVariable* moduleDescriptor;
+        StructType* moduleDescriptorType;
+        StructType* bufferShadowEntryType;
+        StructType* globalEntryType;
+
+        Function* registerModuleFunction;
+
+        /*
+        Compile time description of every ID handed out, site i describes local ID i. finalizeModule() writes
+        them to the BUFFER_SITES_SECTION section, see BufferSites.h.
+        */
+        struct SiteInfo
+        {
+            uint32_t kind;
+            uint64_t staticSize;
+            uint32_t line;
+            std::string file;
+            std::string function;
+        };
+
+        std::vector<SiteInfo> gepSites;
+        std::vector<SiteInfo> bufferSites;
+
+        /*
+        Partial instrumentation. The files named by BUFFER_ALLOWLIST_ENV_VAR and BUFFER_DENYLIST_ENV_VAR hold one
+        pattern per line, 'fun:<pattern>' for function names and 'src:<pattern>' for source files, '#' starts a
+        comment. Patterns are shell wildcards. Only the accesses of excluded functions are left out, their buffers
+        are still tracked, since they may be accessed by instrumented code.
+        */
+        struct FunctionList
+        {
+            bool present = false;
+            std::vector<std::string> functions;
+            std::vector<std::string> files;
+        };
+
+        FunctionList allowlist;
+        FunctionList denylist;
+
+        uint64_t functionsExcluded = 0;
+
+        /* Number of accesses that were not instrumented because of the static bounds elimination. */
+        uint64_t accessesInBounds = 0;
+        uint64_t accessesCovered = 0;
+        uint64_t accessesHoisted = 0;
+
+        /* Like afl-llvm-pass, stay quiet if stderr is not a terminal or AFL_QUIET is set. */
+        bool beQuiet = false;
 
         BufferMonitor() : ModulePass(ID)
         {
         }
 
+        void getAnalysisUsage(AnalysisUsage &AU) const override
+        {
+            AU.addRequired<TargetLibraryInfoWrapperPass>();
+        }
+
         Function *GetOrCreateFunction(const std::string &name, Module &module, LLVMContext &context, FunctionType *functionType)
         {
             Function *function = module.getFunction(name);
@@ -91,52 +178,120 @@ namespace
             return function;
         }
 
-        /*
-            Reads bufferID and GepID from file.
-        */
+        /* Describes the next ID, has to be called once for every gepID++ and bufferID++. */
+        void recordSite(std::vector<SiteInfo>& sites, uint32_t kind, Instruction* instruction, uint64_t staticSize)
+        {
+            SiteInfo site = {kind, staticSize, 0, module->getSourceFileName(), instruction->getFunction()->getName().str()};
 
-        void ReadStatsFromFile()
+            if (const DebugLoc& location = instruction->getDebugLoc())
+            {
+                site.line = location.getLine();
+                site.file = location->getFilename().str();
+            }
+
+            sites.push_back(site);
+        }
+
+        /* Size of the buffer pointer points into if it is a stack array or a global, 0 otherwise. */
+        uint64_t staticBufferSize(Value* pointer)
         {
-            /* Read bufferID from file */
+            const DataLayout& dataLayout = module->getDataLayout();
+            pointer = pointer->stripPointerCasts();
 
-            // Lock mutex to prevent other threads from writing to the file
-            std::lock_guard<std::mutex> lock(mutex);
+            if (AllocaInst* allocaInst = dyn_cast<AllocaInst>(pointer))
+            {
+                Optional<TypeSize> size = allocaInst->getAllocationSizeInBits(dataLayout);
+                return size && !size->isScalable() ? size->getFixedSize() / 8 : 0;
+            }
 
-            std::ifstream file("/var/tmp/ID.log");
+            if (GlobalVariable* global = dyn_cast<GlobalVariable>(pointer))
+            {
+                return dataLayout.getTypeAllocSize(global->getValueType()).getFixedSize();
+            }
+
+            return 0;
+        }
+
+        void readFunctionList(const char* envName, FunctionList& list)
+        {
+            const char* fileName = getenv(envName);
 
-            if (!file.is_open())
+            if (!fileName)
             {
-                std::cout << "Could not read file 'ID.log'. Will create it after module is processed." << std::endl;
                 return;
             }
 
-            file >> this->bufferID >> this->gepID;
+            std::ifstream file(fileName);
 
-            file.close();
-        }
+            if (!file)
+            {
+                report_fatal_error(Twine("BufferMonitor: unable to read ") + envName + " file '" + fileName + "'");
+            }
 
-        /*
-            Writes bufferID and GepID from file.
-        */
+            list.present = true;
+
+            std::string line;
+            while (std::getline(file, line))
+            {
+                StringRef entry = StringRef(line).split('#').first.trim();
+
+                if (entry.empty())
+                {
+                    continue;
+                }
 
-        void WriteStatsToFile()
+                if (entry.startswith("fun:"))
+                {
+                    list.functions.push_back(entry.drop_front(4).trim().str());
+                }
+                else if (entry.startswith("src:"))
+                {
+                    list.files.push_back(entry.drop_front(4).trim().str());
+                }
+                else
+                {
+                    report_fatal_error(Twine("BufferMonitor: bad entry '") + entry + "' in " + fileName + ", expected fun: or src:");
+                }
+            }
+        }
+
+        static bool matchesAny(const std::vector<std::string>& patterns, const std::string& name)
         {
-            /* Write bufferID to file */
+            for (const std::string& pattern : patterns)
+            {
+                if (fnmatch(pattern.c_str(), name.c_str(), 0) == 0)
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        }
 
-            // Lock mutex to prevent other threads from writing to the file
-            std::lock_guard<std::mutex> lock(mutex);
+        bool matchesList(const FunctionList& list, Function& F)
+        {
+            // Inline functions from headers are matched against the header
+            std::string fileName = module->getSourceFileName();
 
-            std::ofstream file("/var/tmp/ID.log");
-            
-            if (!file.is_open())
+            if (DISubprogram* subprogram = F.getSubprogram())
             {
-                std::cerr << "Error: Could not write file 'ID.log'" << std::endl;
-                return;
+                fileName = subprogram->getFilename().str();
             }
 
-            file << this->bufferID << " " << this->gepID;
+            std::string baseName = sys::path::filename(fileName).str();
+
+            return matchesAny(list.functions, F.getName().str()) || matchesAny(list.files, fileName) || matchesAny(list.files, baseName);
+        }
+
+        /* Whether the accesses of 'F' are instrumented, see FunctionList. */
+        bool isAccessInstrumented(Function& F)
+        {
+            if (denylist.present && matchesList(denylist, F))
+            {
+                return false;
+            }
 
-            file.close();
+            return !allowlist.present || matchesList(allowlist, F);
         }
 
         bool init(Module &M)
@@ -145,10 +300,15 @@ namespace
 
             this->module = &M;
 
+            this->beQuiet = !isatty(2) || getenv("AFL_QUIET");
+
             // Get context, module and create IRBuilder for instrumentations
             LLVMContext &context = M.getContext();
             builder = std::make_unique<IRBuilder<>>(context);
 
+            readFunctionList(BUFFER_ALLOWLIST_ENV_VAR, allowlist);
+            readFunctionList(BUFFER_DENYLIST_ENV_VAR, denylist);
+
             /*
                 Get all functions used by the instrumentation from BufferMonitorLib.c
             */
@@ -156,11 +316,36 @@ namespace
             FunctionType* storeBufferFunctionType = FunctionType::get(Type::getVoidTy(context), {Type::getInt32Ty(context), Type::getInt8PtrTy(context), Type::getInt64Ty(context), Type::getInt64Ty(context)}, false);
             this->storeBufferFunction = GetOrCreateFunction("store_buffer", *module, context, storeBufferFunctionType);
 
+            FunctionType* storeStackBufferFunctionType = FunctionType::get(Type::getVoidTy(context), {Type::getInt32Ty(context), Type::getInt8PtrTy(context), Type::getInt64Ty(context)}, false);
+            this->storeStackBufferFunction = GetOrCreateFunction("store_stack_buffer", *module, context, storeStackBufferFunctionType);
+
+            FunctionType* releaseBufferFunctionType = FunctionType::get(Type::getVoidTy(context), {Type::getInt8PtrTy(context)}, false);
+            this->releaseBufferFunction = GetOrCreateFunction("release_buffer", *module, context, releaseBufferFunctionType);
+
+            FunctionType* enterFrameFunctionType = FunctionType::get(Type::getInt32Ty(context), {}, false);
+            this->enterFrameFunction = GetOrCreateFunction("enter_frame", *module, context, enterFrameFunctionType);
+
+            FunctionType* leaveFrameFunctionType = FunctionType::get(Type::getVoidTy(context), {Type::getInt32Ty(context)}, false);
+            this->leaveFrameFunction = GetOrCreateFunction("leave_frame", *module, context, leaveFrameFunctionType);
+
             FunctionType* updateBufferFunctionType = FunctionType::get(Type::getVoidTy(context), {Type::getInt64Ty(context), Type::getInt8PtrTy(context), Type::getInt64Ty(context)}, false);
             this->updateBufferFunction = GetOrCreateFunction("update_buffer", *module, context, updateBufferFunctionType);
 
-            FunctionType* storeBufferPointerFunctionType = FunctionType::get(Type::getVoidTy(context), {Type::getInt32Ty(context), Type::getInt8PtrTy(context), Type::getInt8PtrTy(context), Type::getInt64Ty(context)}, false);
-            this->storeBufferPointerFunction = GetOrCreateFunction("store_buffer_pointer", *module, context, storeBufferPointerFunctionType);
+            /*
+                The module descriptor. Its counts and its private shadow are filled in by finalizeModule(),
+                once all IDs of the module are known.
+            */
+
+            this->bufferShadowEntryType = StructType::get(context, {Type::getInt8PtrTy(context), Type::getInt64Ty(context)});
+            this->globalEntryType = StructType::get(context, {Type::getInt8PtrTy(context), Type::getInt64Ty(context)});
+            this->moduleDescriptorType = StructType::get(context, {Type::getInt64Ty(context), Type::getInt32Ty(context), Type::getInt32Ty(context),
+                                                                   Type::getInt32Ty(context), Type::getInt32Ty(context), PointerType::getUnqual(bufferShadowEntryType),
+                                                                   Type::getInt8PtrTy(context), PointerType::getUnqual(globalEntryType), Type::getInt32Ty(context)});
+            this->moduleDescriptor = new GlobalVariable(M, moduleDescriptorType, false, GlobalValue::InternalLinkage,
+                                                        Constant::getNullValue(moduleDescriptorType), "__buffer_module");
+
+            FunctionType* registerModuleFunctionType = FunctionType::get(Type::getVoidTy(context), {PointerType::getUnqual(moduleDescriptorType)}, false);
+            this->registerModuleFunction = GetOrCreateFunction("__buffer_monitor_register_module", *module, context, registerModuleFunctionType);
 
             FunctionType* strlenFunctionType = FunctionType::get(Type::getInt64Ty(context), {Type::getInt8PtrTy(context)}, false);
             this->strlenFunction = GetOrCreateFunction("strlen", *module, context, strlenFunctionType);
@@ -204,282 +389,537 @@ namespace
             return nullptr;
         }
 
-        virtual bool runOnModule(Module& M)
-        {
-            DEBUG_PRINT_INFO("Run pass in debug mode");
-
-            init(M);
-
-            LLVMContext &context = M.getContext();
+        /*
+            Returns true if 'indexValue' provably stays within [0, numElements). Such an access can never overflow
+            the array, so there is nothing to learn from its distance.
+        */
 
-            /* Read IDs from the ID.log file */
+        bool isProvablyInBounds(ScalarEvolution& SE, Value* indexValue, uint64_t numElements)
+        {
+            if (!SE.isSCEVable(indexValue->getType()) || indexValue->getType()->getScalarSizeInBits() > 64)
+            {
+                return false;
+            }
 
-            ReadStatsFromFile();
+            ConstantRange range = SE.getSignedRange(SE.getSCEV(indexValue));
 
-            assignGlobalConstantsIDs(M, builder);
+            if (range.isEmptySet() || range.isFullSet())
+            {
+                return false;
+            }
 
-            /* Get the boolean type (i1 in LLVM) */
-            Type* BoolType = llvm::Type::getInt1Ty(context);
+            return range.getSignedMin().getSExtValue() >= 0 && (uint64_t) range.getSignedMax().getSExtValue() < numElements;
+        }
 
-            /* Create a global boolean variable initialized to 'false', with internal linkage */
-            Constant* InitialValue = ConstantInt::get(BoolType, 0); 
-            this->globalDataArraysStored = new GlobalVariable(
-                M,
-                BoolType,
-                false,
-                /* Use InternalLinkage here because this has to be done in every module. */
-                llvm::GlobalVariable::InternalLinkage,  
-                InitialValue,
-                "globalDataArraysStored"
-            );
+        /*
+            Returns true if an access to 'basePtr' that has already been instrumented dominates 'position' and its
+            index is known to be at least as large as 'index'. The later access can then never report a smaller
+            distance.
+        */
 
-            /* Try to insert global data arrasy in main funtion. */
-            getGlobalConstants(M, builder);
+        bool isCoveredByEarlierAccess(ScalarEvolution& SE, DominatorTree& DT, Value* basePtr, const SCEV* index, unsigned elementSizeInBytes, Instruction* position)
+        {
+            auto accesses = instrumentedAccesses.find(basePtr);
 
-            Function* storeGlobalDataArraysFunction = createStoreGlobalDataArraysFunction(M, context, builder);
+            if (accesses == instrumentedAccesses.end())
+            {
+                return false;
+            }
 
-            // Iterate over all functions in the module
-            for (Function& F : M)
+            for (InstrumentedAccess& access : accesses->second)
             {
-                if (F.isDeclaration() || F.empty() || F.getEntryBlock().empty())
+                if (access.elementSizeInBytes != elementSizeInBytes || access.index->getType() != index->getType())
                 {
                     continue;
                 }
 
-                /* Get function name */
-                StringRef functionName = F.getName();
-
-                if (functionName == "storeGlobalDataArraysFunction")
+                if (!DT.dominates(access.position, position))
                 {
                     continue;
                 }
-    
-                /* Ignore all ASAN functions. */
-                if (functionName.contains("asan"))
+
+                const SCEV* difference = SE.getMinusSCEV(access.index, index);
+
+                if (isa<SCEVConstant>(difference) && SE.isKnownNonNegative(difference))
                 {
-                    continue;
+                    return true;
                 }
+            }
+
+            return false;
+        }
+
+        /*
+            A loop is only left through its exits, if it does not contain any calls. The instrumentation itself,
+            debug info, lifetime markers and memory intrinsics are fine.
+        */
 
-                /* In the case there is no main function, we try to store it in this function. */
-                if (!this->globalDataArraysStoredInMain && this->globalsBufferID.size() != 0) 
+        bool loopRunsToCompletion(Loop* loop)
+        {
+            for (BasicBlock* block : loop->blocks())
+            {
+                for (Instruction& instruction : *block)
                 {
-                    IRBuilder<> localBuilder(&F.getEntryBlock(), F.getEntryBlock().begin());
-                    localBuilder.CreateCall(storeGlobalDataArraysFunction, {}); // Assuming the function takes no arguments
-                }
+                    CallBase* call = dyn_cast<CallBase>(&instruction);
 
-                procesFunction(F);
-            }
+                    if (!call)
+                    {
+                        continue;
+                    }
 
-            /* 
-            After the module was processed we write the ID's to a file so and can be
-            used when the next module is processed. 
-            */
+                    if (isa<DbgInfoIntrinsic>(call) || isa<MemIntrinsic>(call) || call->isLifetimeStartOrEnd())
+                    {
+                        continue;
+                    }
 
-            WriteStatsToFile();
+                    Function* calledFunction = call->getCalledFunction();
+
+                    if (calledFunction == updateBufferFunction || calledFunction == storeBufferFunction || calledFunction == storeStackBufferFunction)
+                    {
+                        continue;
+                    }
+
+                    return false;
+                }
+            }
 
             return true;
         }
 
         /*
-            Responsible for handling global data arrays. If the 'function' parameter is nullptr,
-            the function will try to add the global data arrays in the main function. Otherwise
-            the function will try to add the global data arrays in the function that is passed as
-            parameter.
+            If 'indexValue' is an affine induction variable of the innermost loop around 'gepInst' and the trip count
+            of the loop is known, the largest index the loop will access is reported once in the preheader instead
+            of in every iteration. Returns true if the access has been hoisted.
         */
 
-        void getGlobalConstants(Module& M, std::unique_ptr<IRBuilder<>>& builder, BasicBlock* basicBlock = nullptr) 
+        bool hoistOutOfLoop(ScalarEvolution& SE, LoopInfo& LI, DominatorTree& DT, GetElementPtrInst* gepInst, Value* basePtr, Value* indexValue, unsigned elementSizeInBytes)
         {
-            
-            if (this->globalDataArraysStoredInMain == true)
+            LLVMContext& context = gepInst->getContext();
+            BasicBlock* gepBlock = gepInst->getParent();
+            Loop* loop = LI.getLoopFor(gepBlock);
+
+            if (!loop || !SE.isSCEVable(indexValue->getType()) || !loop->isLoopInvariant(basePtr))
             {
-                /* We already have stored all global data arrays of this module in the main function, so we can leave again */
-                return;
+                return false;
             }
-            
-            LLVMContext& context = M.getContext();
 
-            Constant* zeroValue = ConstantInt::get(Type::getInt64Ty(context), 0);
+            BasicBlock* preheader = loop->getLoopPreheader();
+            BasicBlock* exitingBlock = loop->getExitingBlock();
+            BasicBlock* latch = loop->getLoopLatch();
 
-            /* Get main function */
-            Function* mainFunction = M.getFunction("main");
+            if (!preheader || !exitingBlock || !latch)
+            {
+                return false;
+            }
 
-            if (mainFunction)
+            const SCEVAddRecExpr* addRec = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(indexValue));
+
+            if (!addRec || addRec->getLoop() != loop || !addRec->isAffine())
             {
-                /* Since we have a main function, we can store all global data arrays in it with this call. */
-                this->globalDataArraysStoredInMain = true;
-            
-                if (mainFunction->empty() || mainFunction->getEntryBlock().empty())
-                {
-                    return;
-                }
+                return false;
+            }
+
+            const SCEV* backedgeTakenCount = SE.getBackedgeTakenCount(loop);
+
+            if (isa<SCEVCouldNotCompute>(backedgeTakenCount) || !loopRunsToCompletion(loop))
+            {
+                return false;
             }
 
             /*
-            If there is no main function, try to add the global data arrays in the function that is passed as parameter.
+            If the access runs before the exit check, it runs in all backedgeTakenCount + 1 iterations. If it runs
+            after the exit check, it runs in all but the last one, and not at all if the backedge is never taken.
             */
-            if (!mainFunction && basicBlock == nullptr)
+            bool runsInLastIteration;
+
+            if (DT.dominates(gepBlock, exitingBlock))
             {
-                /* We have no entry point given so we just return. */
-                return;
+                runsInLastIteration = true;
+            }
+            else if (DT.dominates(gepBlock, latch) && DT.dominates(exitingBlock, gepBlock))
+            {
+                runsInLastIteration = false;
+            }
+            else
+            {
+                return false;
             }
 
+            Type* indexType = addRec->getType();
+            const SCEV* lastIteration = SE.getTruncateOrZeroExtend(backedgeTakenCount, indexType);
 
-            /* If main function exists in this module we insert global data arrays there, else set insert point to the passed basic block. */
-            if (mainFunction)
+            if (!runsInLastIteration)
             {
-                builder->SetInsertPoint(&mainFunction->getEntryBlock(), mainFunction->getEntryBlock().begin());
+                lastIteration = SE.getMinusSCEV(lastIteration, SE.getOne(indexType));
+            }
 
-            } else 
+            const SCEV* maxIndex = SE.getSMaxExpr(addRec->getStart(), addRec->evaluateAtIteration(lastIteration, SE));
+            Instruction* insertPoint = preheader->getTerminator();
+
+            if (!isSafeToExpandAt(maxIndex, insertPoint, SE) || !isSafeToExpandAt(backedgeTakenCount, insertPoint, SE))
             {
-                builder->SetInsertPoint(basicBlock, basicBlock->begin());
+                return false;
             }
 
-            int index = 0;
-            for (auto &global : M.globals()) {
-                if (global.getType()->isPointerTy()) { 
-                    Type *elementType = global.getType()->getPointerElementType();
-                    if (elementType->isArrayTy()) {  
-                        std::cout << "Found global array: " << global.getName().str() << std::endl;
+            SCEVExpander expander(SE, module->getDataLayout(), "buffermonitor");
+            Value* maxIndexValue = expander.expandCodeFor(maxIndex, indexType, insertPoint);
 
-                        /* Skip if @llvm.global_ctors */
-                        if (!global.getName().contains("global_ctors"))
-                        {
-                            std::cout << "Store global array: " << global.getName().str() << std::endl;
+            IRBuilder<> preheaderBuilder(insertPoint);
 
-                            ArrayType *arrayType = dyn_cast<ArrayType>(elementType);
-                            if (arrayType) 
-                            {
-                                uint32_t globalBufferID = this->globalsBufferID[index];
-                                
-                                Value* bufferIDValue = ConstantInt::get(Type::getInt32Ty(context), globalBufferID);
+            maxIndexValue = preheaderBuilder.CreateSExtOrTrunc(maxIndexValue, Type::getInt64Ty(context));
+            Value* accessedByte = preheaderBuilder.CreateMul(maxIndexValue, ConstantInt::get(Type::getInt64Ty(context), elementSizeInBytes));
+            Value* bufferAddress = preheaderBuilder.CreateBitCast(basePtr, Type::getInt8PtrTy(context));
 
-                                // Determine size of global data array
-                                uint64_t arraySizeInBytes = arrayType->getNumElements() * (arrayType->getElementType()->getPrimitiveSizeInBits() / 8);
-                                Value* arraySizeInBytesValue = ConstantInt::get(Type::getInt64Ty(context), arraySizeInBytes);
+            if (!runsInLastIteration)
+            {
+                /* The runtime ignores accesses through a null pointer. */
+                Value* backedgeTakenCountValue = expander.expandCodeFor(backedgeTakenCount, backedgeTakenCount->getType(), insertPoint);
+                Value* isExecuted = preheaderBuilder.CreateICmpNE(backedgeTakenCountValue, ConstantInt::get(backedgeTakenCount->getType(), 0));
+                bufferAddress = preheaderBuilder.CreateSelect(isExecuted, bufferAddress, ConstantPointerNull::get(Type::getInt8PtrTy(context)));
+            }
 
-                                // Get constant array address
-                                // Value* bufferAddress = builder->CreateBitCast(&global, Type::getInt8PtrTy(context));
+            Value* gepIDValue = ConstantInt::get(Type::getInt64Ty(context), this->gepID);
 
-                                this->builder->CreateCall(storeBufferFunction, {bufferIDValue, &global, arraySizeInBytesValue, zeroValue});
-                            }
-                            index++;
+            // Attributed to the access in the loop, in the debugger and in the site table
+            CallInst* updateBufferCall = preheaderBuilder.CreateCall(updateBufferFunction, {gepIDValue, bufferAddress, accessedByte});
+            updateBufferCall->setDebugLoc(gepInst->getDebugLoc());
 
-                        }
+            return true;
+        }
 
-                    }
+        /*
+            Guards every update_buffer() call in 'F' with an inline check against the shadow entry of its gep ID,
+            so the runtime is only called if the access goes through another pointer than last time or past the
+            largest byte seen so far. Done after the function has been instrumented, since it splits blocks.
+        */
+
+        void emitShadowChecks(Function& F)
+        {
+            LLVMContext& context = F.getContext();
+            std::vector<CallInst*> updateBufferCalls;
+
+            for (Instruction& instruction : instructions(F))
+            {
+                CallInst* callInst = dyn_cast<CallInst>(&instruction);
+
+                if (callInst && callInst->getCalledFunction() == updateBufferFunction && isa<ConstantInt>(callInst->getArgOperand(0)))
+                {
+                    updateBufferCalls.push_back(callInst);
                 }
             }
-        }
 
-        void assignGlobalConstantsIDs(Module& M, std::unique_ptr<IRBuilder<>>& builder) {
-            if (this->globalsBufferID.size() != 0)
+            MDNode* unlikely = MDBuilder(context).createBranchWeights(1, 1000);
+            MDNode* noSanitize = MDNode::get(context, None);
+
+            for (CallInst* callInst : updateBufferCalls)
             {
-                return;
-            }
+                uint64_t gepID = cast<ConstantInt>(callInst->getArgOperand(0))->getZExtValue();
 
-            for (GlobalVariable& global : M.globals()) {
-                if (global.hasInitializer()) {
-                    this->globalsBufferID.push_back(this->bufferID);
-                    std::cout << "Found global! Assign ID: " << this->bufferID << std::endl;
-                    this->bufferID++;
-                }
+                IRBuilder<> shadowBuilder(callInst);
+
+                // The shadow of the module starts at its first gep
+                LoadInst* moduleShadow = shadowBuilder.CreateLoad(PointerType::getUnqual(bufferShadowEntryType), shadowBuilder.CreateStructGEP(moduleDescriptorType, moduleDescriptor, 5));
+                moduleShadow->setMetadata(module->getMDKindID("nosanitize"), noSanitize);
+
+                Value* shadowEntry = shadowBuilder.CreateConstInBoundsGEP1_64(bufferShadowEntryType, moduleShadow, gepID);
+                LoadInst* shadowBase = shadowBuilder.CreateLoad(Type::getInt8PtrTy(context), shadowBuilder.CreateStructGEP(bufferShadowEntryType, shadowEntry, 0));
+                LoadInst* shadowMax = shadowBuilder.CreateLoad(Type::getInt64Ty(context), shadowBuilder.CreateStructGEP(bufferShadowEntryType, shadowEntry, 1));
+
+                shadowBase->setMetadata(module->getMDKindID("nosanitize"), noSanitize);
+                shadowMax->setMetadata(module->getMDKindID("nosanitize"), noSanitize);
+
+                Value* otherBuffer = shadowBuilder.CreateICmpNE(shadowBase, callInst->getArgOperand(1));
+                Value* newMaximum = shadowBuilder.CreateICmpUGT(callInst->getArgOperand(2), shadowMax);
+
+                Instruction* slowPath = SplitBlockAndInsertIfThen(shadowBuilder.CreateOr(otherBuffer, newMaximum), callInst, false, unlikely);
+                callInst->moveBefore(slowPath);
             }
         }
 
-        Function* createStoreGlobalDataArraysFunction(Module& M, LLVMContext& context, std::unique_ptr<IRBuilder<>>& builder) 
+        /*
+            Writes the sites of this module as one blob to the BUFFER_SITES_SECTION section, laid out as described
+            in BufferSites.h, and returns a pointer to it for the module descriptor. 'moduleHash' is the FNV-1a hash
+            of the module name and its counts.
+        */
+
+        Constant* emitSites(Module& M, uint32_t& moduleHash)
         {
-            /* Create new function. */
-            FunctionType* funcType = FunctionType::get(Type::getVoidTy(context), false);
-            Function* newFunction = Function::Create(funcType, Function::InternalLinkage, "storeGlobalDataArraysFunction", &M);
+            LLVMContext& context = M.getContext();
 
-            /* Create basic blocks for the new function */
-            BasicBlock* entryBlock = BasicBlock::Create(context, "entry", newFunction);
-            BasicBlock* trueBlock = BasicBlock::Create(context, "trueBlock", newFunction);
-            BasicBlock* exitBlock = BasicBlock::Create(context, "exitBlock", newFunction);
+            /* A site for every ID, even if an ID was handed out without one. */
+            if (this->gepSites.size() != this->gepID || this->bufferSites.size() != this->bufferID)
+            {
+                if (!this->beQuiet) WARNF("Site table does not match the IDs, triage output of %s will be wrong.", M.getName().str().c_str());
+            }
 
-            builder->SetInsertPoint(entryBlock);
+            this->gepSites.resize(this->gepID, SiteInfo{0, 0, 0, "", ""});
+            this->bufferSites.resize(this->bufferID, SiteInfo{0, 0, 0, "", ""});
 
-            /* Get global var that holds information if we already have stored global data arrays. */
-            GlobalVariable* globalDataArraysStored = M.getNamedGlobal("globalDataArraysStored");
+            moduleHash = BUFFER_SITES_CHAIN_INIT;
+            std::string identity = M.getModuleIdentifier() + ":" + std::to_string(this->gepID) + ":" + std::to_string(this->bufferID);
 
-            Type* BoolType = llvm::Type::getInt1Ty(context);
+            for (unsigned char c : identity)
+            {
+                moduleHash = (moduleHash ^ c) * 16777619u;
+            }
 
-            /* Load global variable and decide branching. */
-            LoadInst* globalDataArraysStoredValue = builder->CreateLoad(globalDataArraysStored);
-            globalDataArraysStoredValue->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(context, None));
+            std::string strings;
+            std::unordered_map<std::string, uint32_t> stringOffsets;
+            std::vector<buffer_site_t> records;
 
-            builder->CreateCondBr(globalDataArraysStoredValue, exitBlock, trueBlock); 
+            auto internString = [&](const std::string& string) -> uint32_t
+            {
+                auto it = stringOffsets.find(string);
 
-            builder->SetInsertPoint(trueBlock);
-            getGlobalConstants(M, builder, trueBlock);
+                if (it != stringOffsets.end())
+                {
+                    return it->second;
+                }
 
-            /* Store true back to globalDataArraysStored after execution of trueBlock */
-            StoreInst* storeInstruction = builder->CreateStore(ConstantInt::get(BoolType, 1), globalDataArraysStored);
-            storeInstruction->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(context, None));
+                uint32_t offset = strings.size();
+                strings.append(string.c_str(), string.size() + 1);
+                stringOffsets[string] = offset;
 
-            //* Exit function. */
-            builder->CreateBr(exitBlock);
+                return offset;
+            };
 
-            builder->SetInsertPoint(exitBlock);
-            builder->CreateRetVoid();
+            for (std::vector<SiteInfo>* sites : {&this->gepSites, &this->bufferSites})
+            {
+                for (SiteInfo& site : *sites)
+                {
+                    records.push_back({site.staticSize, site.kind, site.line, internString(site.file), internString(site.function)});
+                }
+            }
 
-            return newFunction;
+            buffer_sites_header_t header;
+            header.magic = BUFFER_SITES_MAGIC;
+            header.module_hash = moduleHash;
+            header.gep_count = this->gepID;
+            header.buffer_count = this->bufferID;
+            header.strings = sizeof(header) + records.size() * sizeof(buffer_site_t);
+            header.size = (header.strings + strings.size() + 7) & ~7u;
+
+            std::vector<uint8_t> blob(header.size, 0);
+            memcpy(blob.data(), &header, sizeof(header));
+            memcpy(blob.data() + sizeof(header), records.data(), records.size() * sizeof(buffer_site_t));
+            memcpy(blob.data() + header.strings, strings.data(), strings.size());
+
+            /* Aligned to and padded to 8 bytes, so the linker puts the blobs of all modules back to back. */
+            Constant* blobData = ConstantDataArray::get(context, ArrayRef<uint8_t>(blob));
+            GlobalVariable* sitesGlobal = new GlobalVariable(M, blobData->getType(), true, GlobalValue::PrivateLinkage, blobData, "__buffer_module_sites");
+            sitesGlobal->setSection(BUFFER_SITES_SECTION);
+            sitesGlobal->setAlignment(Align(8));
+
+            return ConstantExpr::getPointerCast(sitesGlobal, Type::getInt8PtrTy(context));
         }
 
-
-        /* 
-        Create a basic block for stroring all global data arrays from this module and add it to the beginning of the 
-        passed function.
+        /*
+            All instrumentation uses module local IDs. This turns them into global ones by adding the bases that the
+            runtime has stored in the module descriptor, and adds the constructor that registers the descriptor.
+            The constructor runs with the highest priority, before the forkserver starts and before any other
+            constructor can reach instrumented code.
         */
 
-        void storeGlobalDataArraysBB(Module& M, Function* function, std::unique_ptr<IRBuilder<>>& builder) {
+        void finalizeModule(Module& M)
+        {
             LLVMContext& context = M.getContext();
 
-            if (!function || function->empty() || function->getEntryBlock().empty())
+            if (this->gepID == 0 && this->bufferID == 0)
             {
+                // Nothing in this module refers to the descriptor
+                moduleDescriptor->eraseFromParent();
                 return;
             }
 
-            Type* BoolType = llvm::Type::getInt1Ty(context);
+            /* Until the module is registered, its inline checks use a private shadow the runtime never fills. */
+            ArrayType* privateShadowType = ArrayType::get(bufferShadowEntryType, this->gepID ? this->gepID : 1);
+            GlobalVariable* privateShadow = new GlobalVariable(M, privateShadowType, false, GlobalValue::PrivateLinkage,
+                                                               ConstantAggregateZero::get(privateShadowType), "__buffer_module_shadow");
+
+            uint32_t moduleHash;
+            Constant* sites = emitSites(M, moduleHash);
+
+            /* Registered by the runtime together with the module, before the forkserver starts. */
+            const DataLayout& dataLayout = M.getDataLayout();
+            std::vector<Constant*> globalEntries;
+
+            for (GlobalVariable* global : this->monitoredGlobals)
+            {
+                globalEntries.push_back(ConstantStruct::get(globalEntryType, {
+                    ConstantExpr::getPointerCast(global, Type::getInt8PtrTy(context)),
+                    ConstantInt::get(Type::getInt64Ty(context), dataLayout.getTypeAllocSize(global->getValueType()).getFixedSize())
+                }));
+            }
+
+            Constant* globalTable = ConstantPointerNull::get(PointerType::getUnqual(globalEntryType));
 
-            /* Create basic blocks */
-            BasicBlock* entryBlock = BasicBlock::Create(context, "entry", function);
-            BasicBlock* trueBlock = BasicBlock::Create(context, "trueBlock", function);
+            if (!globalEntries.empty())
+            {
+                ArrayType* globalTableType = ArrayType::get(globalEntryType, globalEntries.size());
+                GlobalVariable* globalTableVariable = new GlobalVariable(M, globalTableType, true, GlobalValue::PrivateLinkage,
+                                                                         ConstantArray::get(globalTableType, globalEntries), "__buffer_module_globals");
+                globalTable = ConstantExpr::getInBoundsGetElementPtr(globalTableType, globalTableVariable, ArrayRef<Constant*>{
+                    ConstantInt::get(Type::getInt64Ty(context), 0), ConstantInt::get(Type::getInt64Ty(context), 0)});
+            }
 
-            /* Get the original entry block */
-            BasicBlock* originalEntryBlock = &function->getEntryBlock();
+            moduleDescriptor->setInitializer(ConstantStruct::get(moduleDescriptorType, {
+                ConstantInt::get(Type::getInt64Ty(context), 0),
+                ConstantInt::get(Type::getInt32Ty(context), 0),
+                ConstantInt::get(Type::getInt32Ty(context), this->gepID),
+                ConstantInt::get(Type::getInt32Ty(context), this->bufferID),
+                ConstantInt::get(Type::getInt32Ty(context), moduleHash),
+                ConstantExpr::getInBoundsGetElementPtr(privateShadowType, privateShadow, ArrayRef<Constant*>{
+                    ConstantInt::get(Type::getInt64Ty(context), 0), ConstantInt::get(Type::getInt64Ty(context), 0)}),
+                sites,
+                globalTable,
+                ConstantInt::get(Type::getInt32Ty(context), globalEntries.size())
+            }));
+
+            std::vector<CallInst*> instrumentationCalls;
 
-            /* Relink the new entry block to be the first block */
-            entryBlock->moveBefore(originalEntryBlock);
-            
-            /* Set insert point to entry block */
-            builder->SetInsertPoint(entryBlock);
+            for (Function& F : M)
+            {
+                for (Instruction& instruction : instructions(F))
+                {
+                    CallInst* callInst = dyn_cast<CallInst>(&instruction);
+
+                    if (!callInst)
+                    {
+                        continue;
+                    }
+
+                    Function* calledFunction = callInst->getCalledFunction();
+
+                    if (calledFunction != updateBufferFunction && calledFunction != storeBufferFunction && calledFunction != storeStackBufferFunction)
+                    {
+                        continue;
+                    }
 
-            /* Load global variable that decides if we jump to trueBlock or falseBlock */
-            LoadInst* globalDataArraysStoredValue = builder->CreateLoad(globalDataArraysStored);
+                    if (isa<ConstantInt>(callInst->getArgOperand(0)))
+                    {
+                        instrumentationCalls.push_back(callInst);
+                    }
+                }
+            }
 
-            /* To make Address Sanitizer ignore this store instruction. */
-            globalDataArraysStoredValue->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(context, None));
+            MDNode* noSanitize = MDNode::get(context, None);
 
-            /* Create a conditional branch */
-            builder->CreateCondBr(globalDataArraysStoredValue, originalEntryBlock, trueBlock);
+            for (CallInst* callInst : instrumentationCalls)
+            {
+                IRBuilder<> idBuilder(callInst);
+                Value* localID = callInst->getArgOperand(0);
 
-            /* Set insert point to trueBlock */
-            builder->SetInsertPoint(trueBlock);
+                // gep IDs are 64 bit and stored in field 0, buffer IDs are 32 bit and stored in field 1
+                unsigned field = callInst->getCalledFunction() == updateBufferFunction ? 0 : 1;
 
-            /* This function creates the store operations and inserts them in the passed basic block */
-            getGlobalConstants(M, builder, trueBlock);
+                LoadInst* base = idBuilder.CreateLoad(localID->getType(), idBuilder.CreateStructGEP(moduleDescriptorType, moduleDescriptor, field));
+                base->setMetadata(M.getMDKindID("nosanitize"), noSanitize);
 
-            /* After executing the trueBlock, we set the 'globalDataArraysStored' to true, so we don't store them again. */
-            StoreInst* storeInstruction = builder->CreateStore(ConstantInt::get(BoolType, 1), globalDataArraysStored);
+                callInst->setArgOperand(0, idBuilder.CreateAdd(base, localID));
+            }
 
-            /* To make Address Sanitizer ignore this store instruction. */
-            storeInstruction->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(context, None));
+            FunctionType* constructorType = FunctionType::get(Type::getVoidTy(context), false);
+            Function* constructor = Function::Create(constructorType, Function::InternalLinkage, "__buffer_module_register", &M);
 
-            /* Create an unconditional branch to the falseBlock */
-            builder->CreateBr(originalEntryBlock);
+            IRBuilder<> constructorBuilder(BasicBlock::Create(context, "entry", constructor));
+            constructorBuilder.CreateCall(registerModuleFunction, {moduleDescriptor});
+            constructorBuilder.CreateRetVoid();
 
-            return;
+            appendToGlobalCtors(M, constructor, 0);
+        }
+
+        virtual bool runOnModule(Module& M)
+        {
+            DEBUG_PRINT_INFO("Run pass in debug mode");
+
+            init(M);
+
+            assignGlobalConstantsIDs(M);
+
+            // Iterate over all functions in the module
+            for (Function& F : M)
+            {
+                if (F.isDeclaration() || F.empty() || F.getEntryBlock().empty())
+                {
+                    continue;
+                }
+
+                /* Get function name */
+                StringRef functionName = F.getName();
+
+                /* Ignore all ASAN functions. */
+                if (functionName.contains("asan"))
+                {
+                    continue;
+                }
+
+                bool instrumentAccesses = isAccessInstrumented(F);
+
+                if (!instrumentAccesses)
+                {
+                    this->functionsExcluded++;
+                }
+
+                procesFunction(F, instrumentAccesses);
+                emitShadowChecks(F);
+            }
+
+            if (!this->beQuiet)
+            {
+                OKF("Static bounds elimination: %llu accesses in bounds, %llu covered by earlier accesses, %llu hoisted out of loops.",
+                    (u64)this->accessesInBounds, (u64)this->accessesCovered, (u64)this->accessesHoisted);
+            }
+
+            if (!this->beQuiet && (allowlist.present || denylist.present))
+            {
+                OKF("Accesses of %llu functions not instrumented (allow/deny list).", (u64)this->functionsExcluded);
+            }
+
+            finalizeModule(M);
+
+            return true;
+        }
+
+        /*
+            Gives every global array defined in this module a buffer ID. Has to run before anything else hands out
+            buffer IDs, so that global i gets local ID i.
+        */
+
+        void assignGlobalConstantsIDs(Module& M)
+        {
+            for (GlobalVariable& global : M.globals())
+            {
+                /*
+                    Declarations and available_externally copies are defined in another module, the address of a
+                    thread local global differs per thread, and llvm.* are not part of the program.
+                */
+                if (!global.hasInitializer() || global.isDeclarationForLinker() || global.isThreadLocal() || global.getName().startswith("llvm."))
+                {
+                    continue;
+                }
+
+                if (!global.getValueType()->isArrayTy())
+                {
+                    continue;
+                }
+
+                this->monitoredGlobals.push_back(&global);
+                std::cout << "Found global! Assign ID: " << this->bufferID << std::endl;
+
+                // Globals have no debug location, the function name is the name of the global
+                SiteInfo site = {BUFFER_SITE_GLOBAL, staticBufferSize(&global), 0, M.getSourceFileName(), global.getName().str()};
+                SmallVector<DIGlobalVariableExpression*, 1> debugInfo;
+                global.getDebugInfo(debugInfo);
+
+                if (!debugInfo.empty())
+                {
+                    site.line = debugInfo[0]->getVariable()->getLine();
+                    site.file = debugInfo[0]->getVariable()->getFilename().str();
+                }
+
+                this->bufferSites.push_back(site);
+                this->bufferID++;
+            }
         }
 
         /*
@@ -515,6 +955,8 @@ namespace
 
                 // Increment bufferID
                 std::cout << "Stored buffer with ID: " << this->bufferID << std::endl;
+                ConstantInt* constantSize = dyn_cast<ConstantInt>(bufferSizeValue);
+                recordSite(this->bufferSites, BUFFER_SITE_HEAP, callInst, constantSize ? constantSize->getZExtValue() : 0);
                 this->bufferID++;
             } else if (functionName == "realloc")
             {
@@ -525,9 +967,74 @@ namespace
                 Constant* bufferIDValue = ConstantInt::get(Type::getInt32Ty(context), this->bufferID);
                 Constant* isReallocFunctionCall = ConstantInt::get(Type::getInt64Ty(context), 1);
 
+                /*
+                    The old buffer is gone, unless realloc returned the same address (store_buffer handles that) or
+                    failed. A failed realloc returns NULL and leaves the old buffer alone, so NULL is released instead,
+                    which does nothing. No branch, the analyses of procesFunction must stay valid.
+                */
+                Value* oldBuffer = callInst->getArgOperand(0);
+                Constant* nullBuffer = ConstantPointerNull::get(cast<PointerType>(oldBuffer->getType()));
+                Value* failed = this->builder->CreateICmpEQ(bufferAddress, ConstantPointerNull::get(cast<PointerType>(bufferAddress->getType())));
+
+                this->builder->CreateCall(releaseBufferFunction, {this->builder->CreateSelect(failed, nullBuffer, oldBuffer)});
+
                 // Store dynamically allocated buffer in linked list
                 std::cout << "Stored buffer with ID: " << this->bufferID << std::endl;
                 this->builder->CreateCall(storeBufferFunction, {bufferIDValue, bufferAddress, bufferSizeValue, isReallocFunctionCall});
+
+                // Increment bufferID
+                ConstantInt* constantSize = dyn_cast<ConstantInt>(bufferSizeValue);
+                recordSite(this->bufferSites, BUFFER_SITE_REALLOC, callInst, constantSize ? constantSize->getZExtValue() : 0);
+                this->bufferID++;
+            } else if (functionName == "free" || functionName.startswith("_ZdlPv") || functionName.startswith("_ZdaPv"))
+            {
+                /*
+                    free, delete and delete[] (including the sized and aligned variants). The address may be
+                    handed out again by the allocator, so the buffer has to be forgotten.
+                */
+
+                Value* bufferAddress = callInst->getArgOperand(0);
+
+                if (bufferAddress->getType() != Type::getInt8PtrTy(context))
+                {
+                    bufferAddress = builder->CreateBitCast(bufferAddress, Type::getInt8PtrTy(context));
+                }
+
+                this->builder->CreateCall(releaseBufferFunction, {bufferAddress});
+            }
+        }
+
+        /*
+            Stack buffers are registered with store_stack_buffer(), which remembers them in the frame that is
+            currently active. Every function that registers one opens a frame on entry and closes it before each
+            return, which releases all buffers registered since. A frame skipped by longjmp or an exception is
+            closed together with the next outer frame that returns normally.
+        */
+
+        void emitFrameScope(Function& F)
+        {
+            IRBuilder<> entryBuilder(&*F.getEntryBlock().getFirstInsertionPt());
+            Value* frame = entryBuilder.CreateCall(enterFrameFunction, {});
+
+            for (BasicBlock& basicBlock : F)
+            {
+                ReturnInst* returnInst = dyn_cast<ReturnInst>(basicBlock.getTerminator());
+
+                if (!returnInst)
+                {
+                    continue;
+                }
+
+                // Nothing may come between a musttail call and the return
+                Instruction* insertPoint = returnInst;
+
+                if (CallInst* mustTailCall = basicBlock.getTerminatingMustTailCall())
+                {
+                    insertPoint = mustTailCall;
+                }
+
+                IRBuilder<> returnBuilder(insertPoint);
+                returnBuilder.CreateCall(leaveFrameFunction, {frame});
             }
         }
 
@@ -553,6 +1060,7 @@ namespace
                 this->builder->CreateCall(updateBufferFunction, {gepIDValue1, destBufferAddress, lastManipulatedByte});
                 
                 // Increment gepID
+                recordSite(this->gepSites, BUFFER_SITE_MEMCPY_DST, callInst, staticBufferSize(destBufferAddress));
                 this->gepID++;
 
                 // Create gepID value
@@ -561,6 +1069,7 @@ namespace
                 this->builder->CreateCall(updateBufferFunction, {gepIDValue2, srcBufferAddress, lastManipulatedByte});
 
                 // Increment gepID
+                recordSite(this->gepSites, BUFFER_SITE_MEMCPY_SRC, callInst, staticBufferSize(srcBufferAddress));
                 this->gepID++;
 
             } else if (functionName.contains("memset") )
@@ -578,6 +1087,7 @@ namespace
                 this->builder->CreateCall(updateBufferFunction, {gepIDValue, destBufferAddress, lastManipulatedByte});
 
                 // Increment gepID
+                recordSite(this->gepSites, BUFFER_SITE_MEMSET, callInst, staticBufferSize(destBufferAddress));
                 this->gepID++;
 
             } else if (functionName.contains("strcpy"))
@@ -598,17 +1108,33 @@ namespace
                 this->builder->CreateCall(updateBufferFunction, {gepIDValue, destBufferAddress, sourceBufferSize});
 
                 // Increment gepID
+                recordSite(this->gepSites, BUFFER_SITE_STRCPY, callInst, staticBufferSize(destBufferAddress));
                 this->gepID++;
                 
             }
         }
 
-        bool procesFunction(Function& F)
+        bool procesFunction(Function& F, bool instrumentAccesses)
         {
             DEBUG_PRINT_INFO("Pass on function: " << F.getName().str());
 
             LLVMContext &context = F.getContext();
 
+            /*
+            The analyses for the static bounds elimination are built here rather than requested from the pass manager,
+            since getAnalysis<>(F) from a module pass does not keep the results of several analyses alive at once. They
+            are built before any instrumentation is added to this function, which only adds instructions, not blocks.
+            */
+            DominatorTree DT(F);
+            LoopInfo LI(DT);
+            AssumptionCache AC(F);
+            TargetLibraryInfo& TLI = getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(F);
+            ScalarEvolution SE(F, TLI, AC, DT, LI);
+
+            this->instrumentedAccesses.clear();
+
+            bool hasStackBuffers = false;
+
             auto I = inst_begin(F);
             auto nextInstruction = I;
             while (I != inst_end(F))
@@ -656,13 +1182,15 @@ namespace
                         }
 
                         Constant* bufferIDValue = ConstantInt::get(Type::getInt32Ty(context), this->bufferID);
-                        Constant* zeroValue = ConstantInt::get(Type::getInt64Ty(context), 0);
 
-                        // Store statically allocated buffer in linked list
-                        this->builder->CreateCall(storeBufferFunction, {bufferIDValue, bufferAddress, arraySizeInBytesValue, zeroValue});
+                        // Store statically allocated buffer in the current frame
+                        this->builder->CreateCall(storeStackBufferFunction, {bufferIDValue, bufferAddress, arraySizeInBytesValue});
+                        hasStackBuffers = true;
 
                         // Increment bufferID
                         std::cout << "Stored buffer with ID: " << this->bufferID << std::endl;
+                        ConstantInt* constantSize = dyn_cast<ConstantInt>(arraySizeInBytesValue);
+                        recordSite(this->bufferSites, BUFFER_SITE_VLA, allocaInst, constantSize ? constantSize->getZExtValue() : 0);
                         this->bufferID++;
                     }
                     else if (ArrayType *arrayType = dyn_cast<ArrayType>(allocaInst->getAllocatedType()))
@@ -690,13 +1218,14 @@ namespace
                         }
 
                         Constant* bufferIDValue = ConstantInt::get(Type::getInt32Ty(context), this->bufferID);
-                        Constant* zeroValue = ConstantInt::get(Type::getInt64Ty(context), 0);
 
-                        // Store statically allocated buffer in linked list
-                        this->builder->CreateCall(storeBufferFunction, {bufferIDValue, bufferAddress, bufferSizeValue, zeroValue});
+                        // Store statically allocated buffer in the current frame
+                        this->builder->CreateCall(storeStackBufferFunction, {bufferIDValue, bufferAddress, bufferSizeValue});
+                        hasStackBuffers = true;
 
                         // Increment bufferID
                         std::cout << "Stored buffer with ID: " << this->bufferID << std::endl;
+                        recordSite(this->bufferSites, BUFFER_SITE_STACK, allocaInst, arraySizeInBytes);
                         this->bufferID++;
                     }
                 } else if (auto callInst = dyn_cast<CallInst>(&*I))
@@ -716,7 +1245,10 @@ namespace
 
                         processDynamicAllocation(funcName, callInst, context);
 
-                        processStandardCFunctions(funcName, callInst, context);
+                        if (instrumentAccesses)
+                        {
+                            processStandardCFunctions(funcName, callInst, context);
+                        }
                     }
                 } 
                 
@@ -740,7 +1272,7 @@ namespace
                 }
 
                 
-                if (gepInst)
+                if (gepInst && instrumentAccesses)
                 {
                     /*
                         This is a getelementptr instruction, a buffer is being accessed here
@@ -766,9 +1298,11 @@ namespace
 
                     // Get base pointer of the buffer
                     Value *basePtr = gepInst->getPointerOperand();
+                    Value *originalBasePtr = basePtr;
 
                     // Get type of the base pointer to determine the size of the elements
                     Type *baseType = basePtr->getType();
+                    ArrayType *baseArrayType = nullptr;
                     unsigned elementSizeInBytes = 0;
                     if (PointerType *ptrType = dyn_cast<PointerType>(baseType))
                     {
@@ -780,6 +1314,7 @@ namespace
                             // It's an array. Get its element type and then its size.
                             Type *elementType = arrayType->getElementType();
                             elementSizeInBytes = elementType->getPrimitiveSizeInBits() / 8;
+                            baseArrayType = arrayType;
                         }
                         else
                         {
@@ -813,6 +1348,29 @@ namespace
                             elementSizeInBytes = 1;
                         }
 
+                        /* The second index selects the element of an array, skip it if it can never leave the array. */
+                        if (iteration == 1 && baseArrayType && isProvablyInBounds(SE, indexValue, baseArrayType->getNumElements()))
+                        {
+                            this->accessesInBounds++;
+                            continue;
+                        }
+
+                        const SCEV* indexSCEV = SE.isSCEVable(indexValue->getType()) ? SE.getSCEV(indexValue) : nullptr;
+
+                        if (indexSCEV && isCoveredByEarlierAccess(SE, DT, originalBasePtr, indexSCEV, elementSizeInBytes, gepInst))
+                        {
+                            this->accessesCovered++;
+                            continue;
+                        }
+
+                        if (hoistOutOfLoop(SE, LI, DT, gepInst, originalBasePtr, indexValue, elementSizeInBytes))
+                        {
+                            this->accessesHoisted++;
+                            recordSite(this->gepSites, BUFFER_SITE_GEP_LOOP, gepInst, staticBufferSize(originalBasePtr));
+                            this->gepID++;
+                            continue;
+                        }
+
                         /* Multiplay the accessed index by the size of the element to get accessed byte instead of index. */
                         Value *accessedByte = builder->CreateMul(indexValue, ConstantInt::get(Type::getInt64Ty(context), elementSizeInBytes));
 
@@ -840,37 +1398,25 @@ namespace
                         // Update the highest accessed byte of the currentl acessed buffer if accessedByte > highest_accessed_byte
                         this->builder->CreateCall(updateBufferFunction, {gepIDValue, basePtr, accessedByte});
 
+                        if (indexSCEV)
+                        {
+                            this->instrumentedAccesses[originalBasePtr].push_back({indexSCEV, elementSizeInBytes, gepInst});
+                        }
+
                         // Increment gepID
+                        recordSite(this->gepSites, BUFFER_SITE_GEP, gepInst, staticBufferSize(originalBasePtr));
                         this->gepID++;
-
-#ifdef TRACK_BUFFER_POINTERS
-                        /*
-                        To track every buffer access, we also have to store pointers that point to the buffer.
-                        This is done by storing the returned pointer of the getelementptr instruction.
-                        */
-
-                        /* Move insert point after the current gep instruction. */
-                        builder->SetInsertPoint(gepInst->getNextNode());
-                    
-                        /* Get the address returned by gep instruction */
-                        Value *gepAddress = gepInst;
-
-                        Constant* bufferIDValue = ConstantInt::get(Type::getInt32Ty(context), this->bufferID);
-
-
-                        /* Store the buffer pointer */
-                        this->builder->CreateCall(storeBufferPointerFunction, {bufferIDValue, basePtr, gepAddress, accessedByte});
-
-                        // Increment bufferID
-                        std::cout << "Stored buffer with ID: " << this->bufferID << std::endl;
-                        this->bufferID++;
-#endif
                     }
                 }
 
                 I = nextInstruction;
             }
 
+            if (hasStackBuffers)
+            {
+                emitFrameScope(F);
+            }
+
             return true;
         }
     };
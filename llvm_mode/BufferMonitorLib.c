@@ -12,6 +12,9 @@
 
 #include "config.h"
 #include "HashMap.h"
+#include "BufferShm.h"
+#include "BufferModule.h"
+#include "BufferSites.h"
 
 /*
     This file contains everything related to the shared memory containing the buffer data.
@@ -20,18 +23,153 @@
 #ifndef WRITE_BUFFER_DATA_TO_FILE
 
     /*
-    Layout of shared memory:
-    | Buffer ID (uint32_t) | GEP ID (uint64_t) | Distance (uint64_t) | Buffer ID | GEP ID | Distance | ...
+    Layout of shared memory: see BufferShm.h
     */
 
+    /*
+    Used instead of the shared memory when the target is not running under afl-fuzz (e.g. afl-showmap
+    or a manual run), so the data has somewhere to go without touching another fuzzer's segment. Also
+    catches accesses from constructors that run before buffer_monitor_constructor().
+    */
+    buffer_shm_t __shared_memory_initial_;
+
     // Pointer to shared memory location
-    char* __shared_memory_ = NULL;
+    buffer_shm_t* __shared_memory_ = &__shared_memory_initial_;
 
 #endif
 
 // Hashmap for mapping buffer addresses to buffer IDs
 hash_map_t* __buffer_id_map_;
 
+/*
+    Largest accessed byte per gep ID, read inline by the instrumentation and kept up to date by the hash
+    map. Grows with every registered module, the shadow pointers of all modules are moved along.
+*/
+buffer_shadow_t* __buffer_shadow_ = NULL;
+
+// All registered modules, and the next free global IDs
+static buffer_module_t** __buffer_modules_ = NULL;
+static uint32_t __buffer_modules_count_ = 0;
+static uint64_t __next_gep_id_ = 1;
+static uint32_t __next_buffer_id_ = 1;
+static uint32_t __buffer_modules_chain_ = BUFFER_SITES_CHAIN_INIT;
+
+void store_buffer(uint32_t buffer_id, void* buffer_address, uint64_t buffer_size, uint64_t is_realloc_function_call);
+void buffer_monitor_destructor(void);
+
+// Abort on the first access past the end of a buffer, see BUFFER_FAIL_FAST_ENV_VAR
+static uint8_t __buffer_fail_fast_ = 0;
+
+/*
+    With BUFFER_THROTTLE_ENV_VAR set to N, a gep that has called update_buffer() N times in one execution
+    without a new maximum is ignored for the rest of it. Such geps walk over many buffers (hash tables,
+    lists), so the inline shadow check can not keep them out of the runtime. The geps with a count are
+    listed in __buffer_throttle_touched_, so the reset only costs as much as the execution used.
+*/
+static uint32_t __buffer_throttle_ = 0;
+static uint32_t* __buffer_throttle_hits_ = NULL;
+static uint64_t* __buffer_throttle_touched_ = NULL;
+static uint64_t __buffer_throttle_touched_count_ = 0;
+static uint64_t __buffer_throttle_size_ = 0;
+
+/* Counted all the time, written to the file named by BUFFER_STATS_ENV_VAR at exit. */
+static uint64_t __buffer_stats_updates_ = 0;   // update_buffer() calls, i.e. monitored accesses that reached the runtime
+static uint64_t __buffer_stats_stores_ = 0;    // Registered buffers
+
+static void reset_buffer_throttle(void)
+{
+    for (uint64_t i = 0; i < __buffer_throttle_touched_count_; i++)
+    {
+        __buffer_throttle_hits_[__buffer_throttle_touched_[i]] = 0;
+    }
+
+    __buffer_throttle_touched_count_ = 0;
+}
+
+/*
+    The hash map is needed as soon as the first module registers its globals, which happens before
+    buffer_monitor_constructor() runs.
+*/
+
+static void create_buffer_id_map(void)
+{
+    if (__buffer_id_map_ != NULL)
+    {
+        return;
+    }
+
+    __buffer_id_map_ = create_hash_map();
+
+    if (__buffer_id_map_ != NULL)
+    {
+        __buffer_id_map_->shadow = __buffer_shadow_;
+        __buffer_id_map_->shadow_size = __buffer_shadow_ ? (uint32_t) __next_gep_id_ : 0;
+    }
+}
+
+/*
+    Called by the constructor of every instrumented module, before any of its code runs. Assigns the
+    module its ranges of global IDs and its part of the shadow, and registers its global arrays. The
+    constructors run before the forkserver starts, so every child inherits the registered globals.
+*/
+
+void __buffer_monitor_register_module(buffer_module_t* module)
+{
+    if (module->gep_base != 0)
+    {
+        return;
+    }
+
+    buffer_module_t** new_modules = (buffer_module_t**) realloc(__buffer_modules_, (__buffer_modules_count_ + 1) * sizeof(buffer_module_t*));
+    buffer_shadow_t* new_shadow = (buffer_shadow_t*) realloc(__buffer_shadow_, (__next_gep_id_ + module->gep_count) * sizeof(buffer_shadow_t));
+
+    if (new_modules != NULL)
+    {
+        __buffer_modules_ = new_modules;
+    }
+
+    if (new_shadow != NULL)
+    {
+        __buffer_shadow_ = new_shadow;
+    }
+
+    if (new_modules == NULL || new_shadow == NULL)
+    {
+        perror("Error: Could not register module");
+        exit(1);
+    }
+
+    module->gep_base = __next_gep_id_;
+    module->buffer_base = __next_buffer_id_;
+
+    memset(&__buffer_shadow_[module->gep_base], 0, module->gep_count * sizeof(buffer_shadow_t));
+
+    __next_gep_id_ += module->gep_count;
+    __next_buffer_id_ += module->buffer_count;
+
+    __buffer_modules_[__buffer_modules_count_++] = module;
+    __buffer_modules_chain_ = buffer_sites_chain(__buffer_modules_chain_, module->module_hash);
+
+    /* The shadow may have moved. */
+    for (uint32_t i = 0; i < __buffer_modules_count_; i++)
+    {
+        __buffer_modules_[i]->shadow = &__buffer_shadow_[__buffer_modules_[i]->gep_base];
+    }
+
+    create_buffer_id_map();
+
+    if (__buffer_id_map_ != NULL)
+    {
+        __buffer_id_map_->shadow = __buffer_shadow_;
+        __buffer_id_map_->shadow_size = (uint32_t) __next_gep_id_;
+    }
+
+    for (uint32_t i = 0; i < module->global_count; i++)
+    {
+        store_buffer(module->buffer_base + i, module->globals[i].address, module->globals[i].size, 0);
+    }
+}
+
 /* 
     Stores a buffer in shared memory at location id * CHUNK_SIZE.
     If the new created buffer was created with the realloc function, we have to delte the old
@@ -40,6 +178,13 @@ hash_map_t* __buffer_id_map_;
 
 void store_buffer(uint32_t buffer_id, void* buffer_address, uint64_t buffer_size, uint64_t is_realloc_function_call)
 {
+    /* A failed allocation returns NULL, there is no buffer to keep track of. */
+    if (!buffer_address)
+    {
+        return;
+    }
+
+    __buffer_stats_stores_++;
     
     if (is_realloc_function_call)
     {
@@ -58,67 +203,244 @@ void store_buffer(uint32_t buffer_id, void* buffer_address, uint64_t buffer_size
 }
 
 /*
-    To track every buffer access, we also have to store pointers that point to the buffer.
+    Stack buffers of all active frames, innermost last. A frame is the part of the list that has been
+    added since its enter_frame() call. Every stack buffer in the hash map is somewhere in this list.
 */
 
-void store_buffer_pointer(uint32_t buffer_id, void* buffer_address, void* ptr_address, uint64_t accessed_byte) 
+static void** __stack_buffers_ = NULL;
+static uint32_t __stack_buffers_count_ = 0;
+static uint32_t __stack_buffers_capacity_ = 0;
+
+/*
+    Stores a stack buffer like store_buffer() and adds it to the current frame, so that it is released
+    when the function that owns it returns.
+*/
+
+void store_stack_buffer(uint32_t buffer_id, void* buffer_address, uint64_t buffer_size)
 {
-    /* Get buffer size. */
-    uint64_t buffer_size = get_buffer_data(__buffer_id_map_, buffer_address).buffer_size;
+    /* Arrays in loops register the same address on every iteration, it only has to be listed once. */
+    uint8_t is_listed = get_buffer_data(__buffer_id_map_, buffer_address).buffer_id != 0;
+
+    store_buffer(buffer_id, buffer_address, buffer_size, 0);
+
+    if (is_listed)
+    {
+        return;
+    }
 
-    /* Calculate the size of the buffer that the pointer ponits to. */
-    uint64_t size = buffer_size - accessed_byte;
+    if (__stack_buffers_count_ == __stack_buffers_capacity_)
+    {
+        uint32_t new_capacity = __stack_buffers_capacity_ ? __stack_buffers_capacity_ * 2 : 256;
+        void** new_stack_buffers = (void**) realloc(__stack_buffers_, (size_t) new_capacity * sizeof(void*));
+
+        if (new_stack_buffers == NULL)
+        {
+            /* Not fatal, the buffer just stays in the map until its address is registered again. */
+            perror("Error: Could not grow stack buffer list");
+            return;
+        }
+
+        __stack_buffers_ = new_stack_buffers;
+        __stack_buffers_capacity_ = new_capacity;
+    }
+
+    __stack_buffers_[__stack_buffers_count_++] = buffer_address;
+}
 
-    /* Store the buffer pointer. */
-    insert_node(__buffer_id_map_, ptr_address, buffer_id, ptr_address, size, 0);
+/*
+    Called on function entry. Returns the mark that has to be passed to leave_frame() on return.
+*/
+
+uint32_t enter_frame(void)
+{
+    return __stack_buffers_count_;
+}
+
+/*
+    Called before a function returns. Releases all stack buffers registered since the matching
+    enter_frame(), including those of inner frames that were left by longjmp or an exception.
+*/
+
+void leave_frame(uint32_t frame)
+{
+    while (__stack_buffers_count_ > frame)
+    {
+        remove_node(__buffer_id_map_, __stack_buffers_[--__stack_buffers_count_]);
+    }
+}
+
+/*
+    Called for free, delete and the old pointer of realloc. The memory may be handed out again, so
+    the buffer has to be forgotten before another one is registered at the same address.
+*/
+
+void release_buffer(void* buffer_address)
+{
+    remove_node(__buffer_id_map_, buffer_address);
+}
+
+/*
+    Pointers into a buffer are resolved through the range index of the buffer map (see
+    find_owning_buffer), so they no longer have to be registered one by one. Kept so that objects
+    instrumented with TRACK_BUFFER_POINTERS by older versions of the pass still link.
+*/
+
+void store_buffer_pointer(uint32_t buffer_id, void* buffer_address, void* ptr_address, uint64_t accessed_byte) 
+{
+    (void) buffer_id;
+    (void) buffer_address;
+    (void) ptr_address;
+    (void) accessed_byte;
 }
 
 /* 
     Updates the accessed byte of a buffer with id 'buffer_id' if accessed_byte is greater 
-    then the currently set accessed byte 
+    then the currently set accessed byte. 'buffer_address' may point anywhere into the buffer.
 */
 
-void update_buffer(uint64_t getelementptr_id, void* buffer_address, uint64_t accessed_byte)
+#if defined(STREAM_BUFFER_DATA) && !defined(WRITE_BUFFER_DATA_TO_FILE)
+
+/*
+    Publish the new maximum of one (buffer, gep) pair. The first time a pair is seen in the current
+    generation, a record is appended; afterwards, the distance of that record is lowered in place, so
+    every pair only takes up one record.
+*/
+
+static void stream_buffer_record(BufferInfo* buffer_info, gep_instruction* gep)
 {
-    update_node(__buffer_id_map_, buffer_address, getelementptr_id, accessed_byte);
+    buffer_shm_header_t* header = &__shared_memory_->header;
+    uint32_t generation = header->generation;
+
+    /* If size of buffer is zero (because it is unknown) we use 10000 as size value. */
+    uint64_t buffer_size = buffer_info->buffer_size ? buffer_info->buffer_size : 10000;
+    int64_t distance = (int64_t)buffer_size - (int64_t)gep->accessed_byte;
+
+    if (gep->record != 0 && gep->record_generation == generation)
+    {
+        /* UINT32_MAX marks a pair that did not fit and has already been counted as overflow. */
+        if (gep->record != UINT32_MAX)
+        {
+            __atomic_store_n(&__shared_memory_->records[gep->record - 1].distance, distance, __ATOMIC_RELAXED);
+        }
+
+        return;
+    }
+
+    uint32_t count = header->count;
+
+    gep->record_generation = generation;
+
+    if (count >= BUFFER_DATA_CHUNK_COUNT)
+    {
+        header->overflow++;
+        gep->record = UINT32_MAX;
+        return;
+    }
+
+    buffer_shm_record_t* record = &__shared_memory_->records[count];
+
+    record->buffer_id = buffer_info->buffer_id;
+    record->flags = 0;
+    record->gep_id = gep->gep_id;
+    record->distance = distance;
+
+    /* The record has to be complete before afl-fuzz can see it, the target may die at any point. */
+    __atomic_store_n(&header->count, count + 1, __ATOMIC_RELEASE);
+
+    gep->record = count + 1;
 }
 
-#ifndef WRITE_BUFFER_DATA_TO_FILE
+#endif
 
 /*
-    Store buffer data that is stored in the '__buffer_id_map_' into shared memory
+    Leaves the access in the crash record of the shared memory, publishes everything else the way a
+    normal exit would, and aborts, so afl-fuzz sees a crash right at the out of bounds access.
 */
 
-void store_buffer_data_shm()
+static void buffer_fail_fast(BufferInfo* buffer_info, gep_instruction* gep)
+{
+    int64_t distance = (int64_t)buffer_info->buffer_size - (int64_t)gep->accessed_byte;
+
+#ifndef WRITE_BUFFER_DATA_TO_FILE
+    buffer_shm_record_t* crash = &__shared_memory_->header.crash;
+
+    crash->buffer_id = buffer_info->buffer_id;
+    crash->flags = 0;
+    crash->distance = distance;
+    __atomic_store_n(&crash->gep_id, gep->gep_id, __ATOMIC_RELEASE);
+#endif
+
+    fprintf(stderr, "BufferMonitor: out of bounds access to buffer %u by gep %llu, distance %lld\n",
+            buffer_info->buffer_id, (unsigned long long) gep->gep_id, (long long) distance);
+
+    buffer_monitor_destructor();
+    abort();
+}
+
+void update_buffer(uint64_t getelementptr_id, void* buffer_address, uint64_t accessed_byte)
 {
-    uint32_t shared_memory_offset = 0;
+    uint8_t throttled = __buffer_throttle_ && getelementptr_id < __buffer_throttle_size_;
+
+    __buffer_stats_updates_++;
 
-    /* Check if shared memory is emtpy, else find empty place. */
-    uint32_t empty_offset = 0;
-    while (shared_memory_offset < SHARED_MEM_SIZE) 
+    if (throttled && __buffer_throttle_hits_[getelementptr_id] >= __buffer_throttle_)
     {
-        uint32_t buffer_id = 0;
-        uint64_t gep_id = 0;
-        int64_t distance = 0;
+        return;
+    }
 
-        memcpy(&buffer_id, __shared_memory_ + empty_offset, sizeof(uint32_t));
-        memcpy(&gep_id, __shared_memory_ + empty_offset + sizeof(uint32_t), sizeof(uint64_t));
-        memcpy(&distance, __shared_memory_ + empty_offset + sizeof(uint32_t) + sizeof(uint64_t), sizeof(int64_t));
+    BufferInfo* buffer_info;
+    gep_instruction* gep = update_node(__buffer_id_map_, buffer_address, getelementptr_id, accessed_byte, &buffer_info);
 
-        if (buffer_id == 0 && gep_id == 0 && distance == 0)
+    if (gep == NULL)
+    {
+        if (throttled && __buffer_throttle_hits_[getelementptr_id]++ == 0)
         {
-            shared_memory_offset = empty_offset;
-            break;
+            __buffer_throttle_touched_[__buffer_throttle_touched_count_++] = getelementptr_id;
         }
 
-        empty_offset += CHUNK_SIZE;
+        return;
     }
 
-    for (int i = 0; i < HASH_MAP_SIZE; i++)
+#if defined(STREAM_BUFFER_DATA) && !defined(WRITE_BUFFER_DATA_TO_FILE)
+    stream_buffer_record(buffer_info, gep);
+#endif
+
+#ifndef WRITE_BUFFER_DATA_TO_FILE
     {
-        node_t* current_node = __buffer_id_map_->buckets[i];
+        /* Same distance as in the records, unknown sizes count as 10000. */
+        uint64_t buffer_size = buffer_info->buffer_size ? buffer_info->buffer_size : 10000;
+        int64_t distance = (int64_t)buffer_size - (int64_t)gep->accessed_byte;
 
-        while (current_node != NULL)
+        __shared_memory_->dist_map[gep->gep_id & (BUFFER_DIST_MAP_SIZE - 1)] |= buffer_dist_bucket(distance);
+    }
+#endif
+
+    /* The size of some buffers is unknown (0), they can not overflow. */
+    if (__buffer_fail_fast_ && buffer_info->buffer_size != 0 && gep->accessed_byte > buffer_info->buffer_size)
+    {
+        buffer_fail_fast(buffer_info, gep);
+    }
+}
+
+#ifndef WRITE_BUFFER_DATA_TO_FILE
+
+/*
+    Store buffer data that is stored in the '__buffer_id_map_' into shared memory
+*/
+
+void store_buffer_data_shm()
+{
+    buffer_shm_header_t* header = &__shared_memory_->header;
+
+    /* Records of earlier runs, that afl-fuzz has not consumed yet, are kept. */
+    uint32_t count = header->count;
+    uint32_t overflow = 0;
+
+    for (uint32_t i = 0; i < __buffer_id_map_->capacity; i++)
+    {
+        node_t* current_node = &__buffer_id_map_->slots[i];
+
+        if (current_node->key != NULL)
         {
             BufferInfo buffer_info = current_node->value;
 
@@ -141,43 +463,40 @@ void store_buffer_data_shm()
                 // Caluclate the distance of the buffer defined as: buffer_size - accessed_byte
                 int64_t distance = (int64_t)buffer_size - (int64_t)accessed_byte;
 
-                // Check if buffer data fits into shared memory
-                if (shared_memory_offset + CHUNK_SIZE >= SHARED_MEM_SIZE)
+                /* Store buffer data in shared memory, or remember that it did not fit. */
+                if (count < BUFFER_DATA_CHUNK_COUNT)
                 {
-                    return;
-                }
-
-                /* Store buffer data in shared memory. */
+                    buffer_shm_record_t* record = &__shared_memory_->records[count++];
 
-                /* Store buffer ID */
-                memcpy(__shared_memory_ + shared_memory_offset, &buffer_id, sizeof(uint32_t));
-                shared_memory_offset += sizeof(uint32_t);
-                
-                /* Store gep id */
-                memcpy(__shared_memory_ + shared_memory_offset, &gep_id, sizeof(uint64_t));
-                shared_memory_offset += sizeof(uint64_t);
-                
-                /* Store distance */
-                memcpy(__shared_memory_ + shared_memory_offset, &distance, sizeof(int64_t));
-                shared_memory_offset += sizeof(int64_t);
+                    record->buffer_id = buffer_id;
+                    record->flags = 0;
+                    record->gep_id = gep_id;
+                    record->distance = distance;
+                }
+                else
+                {
+                    overflow++;
+                }
 
                 current_gep_instruction = current_gep_instruction->next_gep_instruction;
             }
-
-            current_node = current_node->next;
         }
     
     }
+
+    /* Publish the records, afl-fuzz must not see the new count before the records themselves. */
+    header->overflow += overflow;
+    __atomic_store_n(&header->count, count, __ATOMIC_RELEASE);
 }
 #endif
 
 void print_hash_map()
 {
-    for (int i = 0; i < HASH_MAP_SIZE; i++)
+    for (uint32_t i = 0; i < __buffer_id_map_->capacity; i++)
     {
-        node_t* current_node = __buffer_id_map_->buckets[i];
+        node_t* current_node = &__buffer_id_map_->slots[i];
 
-        while (current_node != NULL)
+        if (current_node->key != NULL)
         {
             BufferInfo buffer_info = current_node->value;
 
@@ -195,8 +514,6 @@ void print_hash_map()
 
                 current_gep_instruction = current_gep_instruction->next_gep_instruction;
             }
-
-            current_node = current_node->next;
         }
     }
 
@@ -216,11 +533,11 @@ void log_buffer_data()
         return;
     }
 
-    for (int i = 0; i < HASH_MAP_SIZE; i++)
+    for (uint32_t i = 0; i < __buffer_id_map_->capacity; i++)
     {
-        node_t* current_node = __buffer_id_map_->buckets[i];
+        node_t* current_node = &__buffer_id_map_->slots[i];
 
-        while (current_node != NULL)
+        if (current_node->key != NULL)
         {
             BufferInfo buffer_info = current_node->value;
             uint32_t buffer_id = buffer_info.buffer_id;
@@ -237,57 +554,182 @@ void log_buffer_data()
 
                 current_gep_instruction = current_gep_instruction->next_gep_instruction;
             }
-
-            current_node = current_node->next;
         }
     }
 
     fclose(log_file);
 }
 
+/*
+    Persistent mode and deferred forkserver support. These are called by afl-llvm-rt.o (where they are
+    declared weak) at the points where a new execution starts without a new process.
+*/
+
+/*
+    Called before the forkserver starts in deferred mode and before the first iteration of __AFL_LOOP.
+    Everything that has been allocated so far is kept for all following executions, but the accesses
+    made until now do not belong to any input and are discarded, including records already published.
+*/
+
+void __buffer_monitor_snapshot(void)
+{
+    if (__buffer_id_map_ == NULL)
+    {
+        /* The constructor has not run yet, there is nothing to keep. */
+        return;
+    }
+
+    mark_buffers_persistent(__buffer_id_map_);
+    reset_hash_map(__buffer_id_map_);
+    reset_buffer_throttle();
+
+#ifndef WRITE_BUFFER_DATA_TO_FILE
+    __shared_memory_->header.overflow = 0;
+    __atomic_store_n(&__shared_memory_->header.count, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+/*
+    Called at the end of every iteration of __AFL_LOOP, right before the process stops itself and
+    afl-fuzz reads the results.
+*/
+
+void __buffer_monitor_iteration_end(void)
+{
+    if (__buffer_id_map_ == NULL)
+    {
+        return;
+    }
+
+#if !defined(WRITE_BUFFER_DATA_TO_FILE) && !defined(STREAM_BUFFER_DATA)
+    store_buffer_data_shm();
+#endif
+
+    reset_hash_map(__buffer_id_map_);
+    reset_buffer_throttle();
+}
+
 // Constructor funtction (runs before main function)
 __attribute__((constructor)) void buffer_monitor_constructor(void) 
 {
-    // Create hash map
-    __buffer_id_map_ = create_hash_map();
+    // Create hash map, unless a module has done so already
+    create_buffer_id_map();
+
+    __buffer_fail_fast_ = getenv(BUFFER_FAIL_FAST_ENV_VAR) != NULL;
+
+    /* All modules linked into the binary have registered by now, later ones are not throttled. */
+    char* throttle_str = getenv(BUFFER_THROTTLE_ENV_VAR);
+
+    if (throttle_str && atoi(throttle_str) > 0)
+    {
+        __buffer_throttle_hits_ = (uint32_t*) calloc(__next_gep_id_, sizeof(uint32_t));
+        __buffer_throttle_touched_ = (uint64_t*) malloc(__next_gep_id_ * sizeof(uint64_t));
+
+        if (__buffer_throttle_hits_ != NULL && __buffer_throttle_touched_ != NULL)
+        {
+            __buffer_throttle_ = (uint32_t) atoi(throttle_str);
+            __buffer_throttle_size_ = __next_gep_id_;
+        }
+    }
     
 #ifndef WRITE_BUFFER_DATA_TO_FILE
 
-    // Create shared memory before running target program
-    key_t key = ftok("/bin/clang", 1);
-    int shmid = shmget(key, SHARED_MEM_SIZE, IPC_CREAT | 0666);
-    if (shmid < 0) 
+    /* 
+    When running under afl-fuzz, the shared memory has been created by the fuzzer and its ID is passed
+    in the environment. Every fuzzer instance has its own segment.
+    */
+    char* shm_id_str = getenv(BUFFER_SHM_ENV_VAR);
+
+    if (!shm_id_str)
     {
-        perror("shmget");
+        __shared_memory_ = &__shared_memory_initial_;
         return;
     }
 
     // Attach shared memory
-    __shared_memory_ = (char*) shmat(shmid, NULL, 0);
-    if (__shared_memory_ == (char *) -1) 
+    __shared_memory_ = (buffer_shm_t*) shmat(atoi(shm_id_str), NULL, 0);
+    if (__shared_memory_ == (buffer_shm_t*) -1) 
     {
         perror("shmat");
+        __shared_memory_ = &__shared_memory_initial_;
         return;
     }
+
+    /* Lets afl-fuzz check that the sites it read from the binary got the same IDs. */
+    __shared_memory_->header.module_count = __buffer_modules_count_;
+    __shared_memory_->header.module_chain = __buffer_modules_chain_;
 #endif
 }
 
+/*
+    One line of counters for the execution. 'shm_bytes' is what afl-fuzz has to read afterwards: the
+    header and the records, the closeness map is read in full either way.
+*/
+
+static void write_buffer_stats(const char* path)
+{
+    FILE* file = fopen(path, "a");
+
+    if (file == NULL)
+    {
+        return;
+    }
+
+#ifndef WRITE_BUFFER_DATA_TO_FILE
+    uint32_t records = __shared_memory_->header.count;
+#else
+    uint32_t records = 0;
+#endif
+
+    fprintf(file, "updates %llu stores %llu records %u shm_bytes %llu modules %u geps %llu\n",
+            (unsigned long long) __buffer_stats_updates_, (unsigned long long) __buffer_stats_stores_, records,
+            (unsigned long long) (sizeof(buffer_shm_header_t) + records * sizeof(buffer_shm_record_t)),
+            __buffer_modules_count_, (unsigned long long) (__next_gep_id_ - 1));
+
+    fclose(file);
+}
+
 // Destructor function (runs after main function)
 __attribute__((destructor)) void buffer_monitor_destructor(void) 
 {
+    char* stats_path = getenv(BUFFER_STATS_ENV_VAR);
+
 #ifndef WRITE_BUFFER_DATA_TO_FILE
+#ifndef STREAM_BUFFER_DATA
     store_buffer_data_shm();
+#endif
+
+    if (stats_path)
+    {
+        write_buffer_stats(stats_path);
+    }
     
     // Detach shared memory
-    if (shmdt(__shared_memory_) == -1) 
+    if (__shared_memory_ != &__shared_memory_initial_ && shmdt(__shared_memory_) == -1) 
     {
         perror("shmdt");
         return;
     }
 #else
     log_buffer_data();
+
+    if (stats_path)
+    {
+        write_buffer_stats(stats_path);
+    }
 #endif
 
     // Delete hash map
-    free_hash_map(__buffer_id_map_);    
+    free_hash_map(__buffer_id_map_);
+
+    __buffer_throttle_ = 0;
+    free(__buffer_throttle_hits_);
+    free(__buffer_throttle_touched_);
+    __buffer_throttle_hits_ = NULL;
+    __buffer_throttle_touched_ = NULL;
+
+    free(__stack_buffers_);
+    __stack_buffers_ = NULL;
+    __stack_buffers_count_ = 0;
+    __stack_buffers_capacity_ = 0;
 }
\ No newline at end of file
@@ -0,0 +1,83 @@
+#ifndef BUFFER_SHM_H
+#define BUFFER_SHM_H
+
+#include <stdint.h>
+
+#include "config.h"
+
+/*
+    Layout of the shared memory holding the buffer data:
+
+    | Header (BUFFER_SHM_HEADER_SIZE bytes) | Record 0 | Record 1 | ... | Record BUFFER_DATA_CHUNK_COUNT - 1 | Closeness map |
+
+    The target is the only writer and afl-fuzz the only reader, and the reader only looks at the
+    segment after the target has finished. The target fills in records starting at index 'count' and
+    then publishes the new count with a release store. afl-fuzz reads exactly 'count' records, so there
+    is no need to scan for an empty record or to wipe the segment, and resets the header before every run.
+    Records that do not fit are counted in 'overflow' instead of being dropped silently.
+
+    With AFL_BUFFER_FAIL_FAST set, the target aborts on the first access past the end of a buffer and
+    leaves that access in 'crash'. Its gep_id is stored last, a gep_id of 0 means there is no record.
+
+    Next to the records, the target keeps one byte per gep ID (modulo BUFFER_DIST_MAP_SIZE) that says
+    how close the gep got to the end of its buffer, see buffer_dist_bucket(). The buckets are coded
+    as a thermometer, every bucket sets the bits of all farther ones too, so OR-ing them keeps the
+    closest and a closer bucket always sets a new bit. afl-fuzz can then find distance progress
+    with a virgin map, the same way it finds new coverage in trace_bits (AFL_BUFFER_DIST_MAP).
+*/
+
+typedef struct buffer_shm_record
+{
+    uint32_t buffer_id;
+    uint32_t flags;         // Currently always 0
+    uint64_t gep_id;
+    int64_t distance;
+} buffer_shm_record_t;
+
+typedef struct buffer_shm_header
+{
+    uint32_t count;         // Number of valid records
+    uint32_t generation;    // Incremented by afl-fuzz every time it resets the records
+    uint32_t overflow;      // Number of records that did not fit into the segment
+
+    uint32_t module_count;  // Written by the target at startup, see buffer_sites_chain() in BufferSites.h
+    uint32_t module_chain;
+    uint32_t reserved;
+
+    buffer_shm_record_t crash;
+
+    uint8_t padding[BUFFER_SHM_HEADER_SIZE - 6 * sizeof(uint32_t) - sizeof(buffer_shm_record_t)];
+} buffer_shm_header_t;
+
+typedef struct buffer_shm
+{
+    buffer_shm_header_t header;
+    buffer_shm_record_t records[BUFFER_DATA_CHUNK_COUNT];
+    uint8_t dist_map[BUFFER_DIST_MAP_SIZE];
+} __attribute__((aligned(BUFFER_SHM_HEADER_SIZE))) buffer_shm_t;
+
+/*
+    Closeness byte of a distance. Past the end is 0xff, the last two bytes 0x7f, and every further
+    step of four times the distance drops one bit, down to 0x01 from 2048 bytes away.
+*/
+
+static inline uint8_t buffer_dist_bucket(int64_t distance)
+{
+    uint32_t level;
+
+    if (distance < 0)
+    {
+        return 0xff;
+    }
+
+    level = distance ? (64 - __builtin_clzll((uint64_t) distance)) / 2 : 0;
+
+    if (level > 6)
+    {
+        level = 6;
+    }
+
+    return (uint8_t)((1u << (7 - level)) - 1);
+}
+
+#endif // BUFFER_SHM_H
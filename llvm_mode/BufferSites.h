@@ -0,0 +1,73 @@
+#ifndef BUFFER_SITES_H
+#define BUFFER_SITES_H
+
+#include <stdint.h>
+
+/*
+    Compile time description of every buffer and gep ID, emitted by BufferMonitor into a read-only
+    section of the binary. Every instrumented module adds one blob:
+
+    | Header | gep_count gep sites | buffer_count buffer sites | String table |
+
+    Blobs are padded to a multiple of 8 bytes, so the section is just the blobs of all modules one
+    after the other, in link order. Local ID i of a module is described by site i of its blob, the
+    global ID is the module's base plus i (see BufferModule.h). Strings are referenced by their offset
+    into the string table of the blob, so the section needs no relocations.
+
+    afl-fuzz reads the section from the target binary to size its tables and to write the
+    'buffer_sites' file to the output directory.
+*/
+
+#define BUFFER_SITES_SECTION "buffer_monitor_sites"
+#define BUFFER_SITES_MAGIC 0x31534d42  // "BMS1"
+
+/* Kinds of gep sites: how the access was found. */
+
+#define BUFFER_SITE_GEP         1   // getelementptr index
+#define BUFFER_SITE_GEP_LOOP    2   // Largest getelementptr index of a loop, reported in front of it
+#define BUFFER_SITE_MEMCPY_DST  3
+#define BUFFER_SITE_MEMCPY_SRC  4
+#define BUFFER_SITE_MEMSET      5
+#define BUFFER_SITE_STRCPY      6
+
+/* Kinds of buffer sites: where the buffer lives. */
+
+#define BUFFER_SITE_GLOBAL      16
+#define BUFFER_SITE_STACK       17
+#define BUFFER_SITE_VLA         18
+#define BUFFER_SITE_HEAP        19
+#define BUFFER_SITE_REALLOC     20
+
+typedef struct buffer_sites_header
+{
+    uint32_t magic;
+    uint32_t size;          // Size of the blob in bytes, including this header and the padding
+    uint32_t module_hash;   // Same as in the module descriptor
+    uint32_t gep_count;
+    uint32_t buffer_count;
+    uint32_t strings;       // Offset of the string table from the start of the blob
+} buffer_sites_header_t;
+
+typedef struct buffer_site
+{
+    uint64_t static_size;   // Size of the accessed or allocated buffer in bytes, 0 if not known at compile time
+    uint32_t kind;
+    uint32_t line;          // 0 without debug info
+    uint32_t file;          // String table offsets
+    uint32_t function;
+} buffer_site_t;
+
+/*
+    Hash of the module descriptors in registration order, published by the runtime in the shared
+    memory header. afl-fuzz computes the same over the blobs in the section, if the two differ, the
+    constructors ran in another order than the modules were linked and the sites cannot be used.
+*/
+
+#define BUFFER_SITES_CHAIN_INIT 2166136261u
+
+static inline uint32_t buffer_sites_chain(uint32_t chain, uint32_t module_hash)
+{
+    return (chain ^ module_hash) * 16777619u;
+}
+
+#endif // BUFFER_SITES_H
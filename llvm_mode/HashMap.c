@@ -1,13 +1,36 @@
 #include "HashMap.h"
 
+/*
+    Heap and stack addresses are at least 8 or 16 byte aligned, so the low bits of a key carry almost
+    no information. Fibonacci hashing multiplies the address with 2^64 / golden ratio, which moves
+    the entropy of all bits into the upper half. The slot index is taken from the top bits.
+*/
+
 uint32_t hash_function(void* key)
 {
-    return (uint32_t)((uintptr_t) key % HASH_MAP_SIZE);
+    return (uint32_t)(((uint64_t)(uintptr_t) key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static inline uint32_t home_slot(hash_map_t* map, void* key)
+{
+    return hash_function(key) >> map->shift;
+}
+
+static uint32_t log2_of(uint32_t value)
+{
+    uint32_t result = 0;
+
+    while (value >>= 1)
+    {
+        result++;
+    }
+
+    return result;
 }
 
 hash_map_t* create_hash_map()
 {
-    hash_map_t* map = (hash_map_t*) malloc(sizeof(hash_map_t));
+    hash_map_t* map = (hash_map_t*) calloc(1, sizeof(hash_map_t));
 
     if (map == NULL)
     {
@@ -15,11 +38,18 @@ hash_map_t* create_hash_map()
         return NULL;
     }
 
-    for (int i = 0; i < HASH_MAP_SIZE; i++)
+    map->slots = (node_t*) calloc(HASH_MAP_SIZE, sizeof(node_t));
+
+    if (map->slots == NULL)
     {
-        map->buckets[i] = NULL;
+        perror("Error: Could not allocate memory for hash map.\n");
+        free(map);
+        return NULL;
     }
 
+    map->capacity = HASH_MAP_SIZE;
+    map->shift = 32 - log2_of(HASH_MAP_SIZE);
+
     return map;
 }
 
@@ -30,52 +60,337 @@ void free_hash_map(hash_map_t* map)
         return;
     }
 
-    for (int i = 0; i < HASH_MAP_SIZE; i++)
+    gep_arena_chunk_t* current_chunk = map->arena;
+
+    while (current_chunk != NULL)
+    {
+        gep_arena_chunk_t* next_chunk = current_chunk->next;
+        free(current_chunk);
+        current_chunk = next_chunk;
+    }
+
+    free(map->range_nodes);
+    free(map->slots);
+    free(map);
+}
+
+/*
+    Returns a gep_instruction node, either from the free list or from the current arena chunk.
+*/
+
+static gep_instruction* alloc_gep_instruction(hash_map_t* map)
+{
+    gep_instruction* gep = map->free_gep_instructions;
+
+    if (gep != NULL)
+    {
+        map->free_gep_instructions = gep->next_gep_instruction;
+        return gep;
+    }
+
+    if (map->arena == NULL || map->arena_used == GEP_ARENA_CHUNK)
     {
-        node_t* current_node = map->buckets[i];
+        gep_arena_chunk_t* new_chunk = (gep_arena_chunk_t*) malloc(sizeof(gep_arena_chunk_t));
 
-        while (current_node != NULL)
+        if (new_chunk == NULL)
         {
-            gep_instruction* current_gep_instruction = current_node->value.gep_instructions;
-            while (current_gep_instruction != NULL)
+            perror("Error: Could not allocate memory for gep instructions\n");
+            return NULL;
+        }
+
+        new_chunk->next = map->arena;
+        map->arena = new_chunk;
+        map->arena_used = 0;
+    }
+
+    return &map->arena->nodes[map->arena_used++];
+}
+
+/* Hand the whole gep instruction list of a buffer back to the free list. */
+
+static void release_gep_instructions(hash_map_t* map, gep_instruction* gep)
+{
+    while (gep != NULL)
+    {
+        gep_instruction* next_gep_instruction = gep->next_gep_instruction;
+
+        if (gep->gep_id < map->shadow_size)
+        {
+            map->shadow[gep->gep_id].base = NULL;
+            map->shadow[gep->gep_id].max_accessed_byte = 0;
+        }
+
+        gep->next_gep_instruction = map->free_gep_instructions;
+        map->free_gep_instructions = gep;
+
+        gep = next_gep_instruction;
+    }
+}
+
+/*
+    Range index. All functions work on node indices, the node array may move when it grows, so
+    pointers into it must not be held across range_alloc().
+*/
+
+static uint32_t range_alloc(hash_map_t* map, uintptr_t start, uint64_t size)
+{
+    uint32_t index = map->range_free;
+
+    if (index != 0)
+    {
+        map->range_free = map->range_nodes[index].left;
+    }
+    else
+    {
+        /* Index 0 is reserved for the empty tree. */
+        if (map->range_used == 0)
+        {
+            map->range_used = 1;
+        }
+
+        if (map->range_used >= map->range_capacity)
+        {
+            uint32_t new_capacity = map->range_capacity ? map->range_capacity * 2 : HASH_MAP_SIZE;
+            range_node_t* new_nodes = (range_node_t*) realloc(map->range_nodes, (size_t) new_capacity * sizeof(range_node_t));
+
+            if (new_nodes == NULL)
             {
-                gep_instruction* next_gep_instruction = current_gep_instruction->next_gep_instruction;
-                free(current_gep_instruction);
-                current_gep_instruction = next_gep_instruction;
+                perror("Error: Could not grow range index\n");
+                return 0;
             }
 
-            node_t* next_node = current_node->next;
-            free(current_node);
-            current_node = next_node;
+            map->range_nodes = new_nodes;
+            map->range_capacity = new_capacity;
         }
+
+        index = map->range_used++;
     }
 
-    free(map);
+    /* xorshift32, the priorities only have to be independent of the insertion order. */
+    uint32_t seed = map->range_seed ? map->range_seed : 0x9E3779B9;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    map->range_seed = seed;
+
+    range_node_t* node = &map->range_nodes[index];
+
+    node->start = start;
+    node->size = size;
+    node->priority = seed;
+    node->left = 0;
+    node->right = 0;
+
+    return index;
 }
 
-BufferInfo get_buffer_data(hash_map_t* map, void* key)
+/*
+    Insertion walks down while the existing nodes have a higher priority, then splits the remaining
+    subtree around the new start address into the two children of the new node. Removal replaces
+    the node by the merge of its two subtrees. Both are single top-down passes without rotations.
+*/
+
+static void range_index_insert(hash_map_t* map, void* start, uint64_t size)
 {
-    if (key == NULL || map == NULL)
-        return (BufferInfo){0, NULL, 0, NULL};
-    
-    uint32_t hash = hash_function(key);
+    uint32_t index = range_alloc(map, (uintptr_t) start, size);
+
+    if (index == 0)
+    {
+        return;
+    }
+
+    range_node_t* nodes = map->range_nodes;
+    uintptr_t key = (uintptr_t) start;
+    uint32_t* link = &map->range_root;
+
+    while (*link != 0 && nodes[*link].priority > nodes[index].priority)
+    {
+        link = key < nodes[*link].start ? &nodes[*link].left : &nodes[*link].right;
+    }
+
+    uint32_t current = *link;
+    uint32_t* left = &nodes[index].left;
+    uint32_t* right = &nodes[index].right;
+
+    while (current != 0)
+    {
+        if (nodes[current].start < key)
+        {
+            *left = current;
+            left = &nodes[current].right;
+            current = nodes[current].right;
+        }
+        else
+        {
+            *right = current;
+            right = &nodes[current].left;
+            current = nodes[current].left;
+        }
+    }
+
+    *left = 0;
+    *right = 0;
+    *link = index;
+}
+
+static void range_index_remove(hash_map_t* map, void* start)
+{
+    range_node_t* nodes = map->range_nodes;
+    uintptr_t key = (uintptr_t) start;
+    uint32_t* link = &map->range_root;
+
+    while (*link != 0 && nodes[*link].start != key)
+    {
+        link = key < nodes[*link].start ? &nodes[*link].left : &nodes[*link].right;
+    }
+
+    uint32_t removed = *link;
+
+    if (removed == 0)
+    {
+        return;
+    }
+
+    uint32_t left = nodes[removed].left;
+    uint32_t right = nodes[removed].right;
+
+    while (left != 0 && right != 0)
+    {
+        if (nodes[left].priority > nodes[right].priority)
+        {
+            *link = left;
+            link = &nodes[left].right;
+            left = nodes[left].right;
+        }
+        else
+        {
+            *link = right;
+            link = &nodes[right].left;
+            right = nodes[right].left;
+        }
+    }
+
+    *link = left ? left : right;
+
+    nodes[removed].left = map->range_free;
+    map->range_free = removed;
+}
+
+void* find_owning_buffer(hash_map_t* map, void* address)
+{
+    if (address == NULL || map == NULL)
+        return NULL;
+
+    range_node_t* nodes = map->range_nodes;
+    uintptr_t target = (uintptr_t) address;
+    uint32_t current = map->range_root;
+    uint32_t best = 0;
+
+    /* Find the buffer with the greatest start address that is not above the target. */
+    while (current != 0)
+    {
+        if (nodes[current].start <= target)
+        {
+            best = current;
+            current = nodes[current].right;
+        }
+        else
+        {
+            current = nodes[current].left;
+        }
+    }
+
+    if (best == 0 || target - nodes[best].start >= nodes[best].size)
+    {
+        return NULL;
+    }
+
+    return (void*) nodes[best].start;
+}
+
+/*
+    Returns the slot holding 'key' or NULL if the key is not in the map.
+*/
+
+static node_t* find_slot(hash_map_t* map, void* key)
+{
+    uint32_t mask = map->capacity - 1;
+    uint32_t index = home_slot(map, key);
+
+    while (map->slots[index].key != NULL)
+    {
+        if (map->slots[index].key == key)
+        {
+            return &map->slots[index];
+        }
+
+        index = (index + 1) & mask;
+    }
+
+    return NULL;
+}
+
+/* Double the number of slots and re-insert every entry. */
+
+static int grow_hash_map(hash_map_t* map)
+{
+    uint32_t old_capacity = map->capacity;
+    node_t* old_slots = map->slots;
+
+    node_t* new_slots = (node_t*) calloc((size_t) old_capacity * 2, sizeof(node_t));
+
+    if (new_slots == NULL)
+    {
+        perror("Error: Could not grow hash map\n");
+        return 0;
+    }
+
+    map->slots = new_slots;
+    map->capacity = old_capacity * 2;
+    map->shift--;
 
-    node_t* current_node = map->buckets[hash];
+    uint32_t mask = map->capacity - 1;
 
-    while (current_node != NULL)
+    for (uint32_t i = 0; i < old_capacity; i++)
     {
-        if (current_node->key == key)
+        if (old_slots[i].key == NULL)
         {
-            return current_node->value;
+            continue;
         }
 
-        current_node = current_node->next;
+        uint32_t index = home_slot(map, old_slots[i].key);
+
+        while (new_slots[index].key != NULL)
+        {
+            index = (index + 1) & mask;
+        }
+
+        new_slots[index] = old_slots[i];
+    }
+
+    free(old_slots);
+
+    return 1;
+}
+
+BufferInfo get_buffer_data(hash_map_t* map, void* key)
+{
+    if (key == NULL || map == NULL)
+        return (BufferInfo){0, NULL, 0, NULL};
+
+    node_t* node = find_slot(map, key);
+
+    if (node != NULL)
+    {
+        return node->value;
     }
 
     BufferInfo buffer_info;
     buffer_info.buffer_id = 0;
     buffer_info.buffer_address = NULL;
     buffer_info.buffer_size = 0;
+    buffer_info.gep_instructions = NULL;
+    buffer_info.persistent = 0;
 
     return buffer_info;
 }
@@ -84,134 +399,236 @@ void insert_node(hash_map_t* map, void* key, uint32_t buffer_id, void* buffer_ad
 {
     if (key == NULL || map == NULL)
         return;
-    
-    uint32_t hash = hash_function(key);
 
-    node_t* new_node = (node_t*) malloc(sizeof(node_t));
-
-    if (new_node == NULL)
+    /* Keep the load factor at or below 1/2 so probe sequences stay short. */
+    if ((map->count + 1) * 2 > map->capacity && !grow_hash_map(map))
     {
-        perror("Error: Could not allocate memory for hash map node\n");
         return;
     }
 
+    uint32_t mask = map->capacity - 1;
+    uint32_t index = home_slot(map, key);
+
+    while (map->slots[index].key != NULL)
+    {
+        index = (index + 1) & mask;
+    }
+
+    node_t* new_node = &map->slots[index];
+
     new_node->key = key;
     new_node->value.buffer_id = buffer_id;
     new_node->value.buffer_address = buffer_address;
     new_node->value.buffer_size = buffer_size;
     new_node->value.gep_instructions = NULL;
-    new_node->next = NULL;
+    new_node->value.persistent = 0;
 
-    if (map->buckets[hash] == NULL)
+    map->count++;
+
+    /* A buffer without a size cannot contain an interior pointer. */
+    if (buffer_size != 0)
     {
-        map->buckets[hash] = new_node;
+        range_index_insert(map, key, buffer_size);
     }
-    else
+}
+
+/* Remember the largest accessed byte of a (buffer, gep) pair relative to the pointer the access went through. */
+
+static inline void update_shadow(hash_map_t* map, void* key, uint64_t offset, gep_instruction* gep)
+{
+    if (gep->gep_id < map->shadow_size)
     {
-        node_t* current_node = map->buckets[hash];
+        map->shadow[gep->gep_id].base = key;
+        map->shadow[gep->gep_id].max_accessed_byte = gep->accessed_byte - offset;
+    }
+}
+
+gep_instruction* update_node(hash_map_t* map, void* key, uint64_t getelementptr_id, uint64_t accessed_byte, BufferInfo** buffer_info)
+{
+    uint64_t offset = 0;
+    node_t* current_node = find_slot(map, key);
 
-        while (current_node->next != NULL)
+    if (current_node == NULL)
+    {
+        /* Not the start of a buffer, it may still point into one. */
+        void* start = find_owning_buffer(map, key);
+
+        if (start == NULL)
         {
-            current_node = current_node->next;
+            return NULL;
         }
 
-        current_node->next = new_node;
+        offset = (uintptr_t) key - (uintptr_t) start;
+        accessed_byte += offset;
+        current_node = find_slot(map, start);
+
+        if (current_node == NULL)
+        {
+            return NULL;
+        }
     }
-}
 
-uint8_t update_node(hash_map_t* map, void* key, uint64_t getelementptr_id, uint64_t accessed_byte)
-{
     if (accessed_byte == 0)
-        return 0;
-    
-    uint32_t hash = hash_function(key);
+        return NULL;
+
+    /*
+    Iterate through the gep instructions performed on this buffer and check if the
+    and check if a getelementptr instruction with the same ID has already been performed.
+    */
 
-    node_t* current_node = map->buckets[hash];
+    gep_instruction* previous_gep_instruction = NULL;
+    gep_instruction* current_gep_instruction = current_node->value.gep_instructions;
 
-    while (current_node != NULL)
+    while (current_gep_instruction != NULL)
     {
-        if (current_node->key == key)
+        if (current_gep_instruction->gep_id == getelementptr_id)
         {
-            /* 
-            Iterate through the gep instructions performed on this buffer and check if the
-            and check if a getelementptr instruction with the same ID has already been performed. 
-            */
-
-            gep_instruction* current_gep_instruction = current_node->value.gep_instructions;
+            /* Move the hit to the front, loops tend to hit the same gep instruction over and over. */
+            if (previous_gep_instruction != NULL)
+            {
+                previous_gep_instruction->next_gep_instruction = current_gep_instruction->next_gep_instruction;
+                current_gep_instruction->next_gep_instruction = current_node->value.gep_instructions;
+                current_node->value.gep_instructions = current_gep_instruction;
+            }
 
-            while (current_gep_instruction != NULL)
+            if (accessed_byte > current_gep_instruction->accessed_byte)
             {
-                if (current_gep_instruction->gep_id == getelementptr_id)
-                {
-                    if (accessed_byte > current_gep_instruction->accessed_byte)
-                    {
-                        current_gep_instruction->accessed_byte = accessed_byte;
-                    }
+                current_gep_instruction->accessed_byte = accessed_byte;
+                update_shadow(map, key, offset, current_gep_instruction);
 
-                    return 1;
+                if (buffer_info != NULL)
+                {
+                    *buffer_info = &current_node->value;
                 }
 
-                current_gep_instruction = current_gep_instruction->next_gep_instruction;
+                return current_gep_instruction;
             }
 
-            gep_instruction* new_gep_instruction = (gep_instruction*) malloc(sizeof(gep_instruction));
-            new_gep_instruction->gep_id = getelementptr_id;
-            new_gep_instruction->accessed_byte = accessed_byte;
-            new_gep_instruction->next_gep_instruction = NULL;
-
-            if (current_node->value.gep_instructions == NULL)
-            {
-                current_node->value.gep_instructions = new_gep_instruction;
-            } else 
-            {
-                // Insert new gep instruction at the beginning of the list
-                new_gep_instruction->next_gep_instruction = current_node->value.gep_instructions;
-                current_node->value.gep_instructions = new_gep_instruction;
-            }
+            update_shadow(map, key, offset, current_gep_instruction);
 
-            return 1;
+            return NULL;
         }
 
-        current_node = current_node->next;
+        previous_gep_instruction = current_gep_instruction;
+        current_gep_instruction = current_gep_instruction->next_gep_instruction;
+    }
+
+    gep_instruction* new_gep_instruction = alloc_gep_instruction(map);
+
+    if (new_gep_instruction == NULL)
+    {
+        return NULL;
+    }
+
+    new_gep_instruction->gep_id = getelementptr_id;
+    new_gep_instruction->accessed_byte = accessed_byte;
+    new_gep_instruction->record = 0;
+    new_gep_instruction->record_generation = 0;
+
+    // Insert new gep instruction at the beginning of the list
+    new_gep_instruction->next_gep_instruction = current_node->value.gep_instructions;
+    current_node->value.gep_instructions = new_gep_instruction;
+
+    update_shadow(map, key, offset, new_gep_instruction);
+
+    if (buffer_info != NULL)
+    {
+        *buffer_info = &current_node->value;
     }
 
-    return 0;
+    return new_gep_instruction;
 }
 
 void remove_node(hash_map_t* map, void* key)
 {
-    uint32_t hash = hash_function(key);
+    if (key == NULL || map == NULL)
+        return;
+
+    node_t* node = find_slot(map, key);
+
+    if (node == NULL)
+    {
+        return;
+    }
+
+    /* Remove all gep instructions of this node */
+    release_gep_instructions(map, node->value.gep_instructions);
 
-    node_t* current_node = map->buckets[hash];
-    node_t* previous_node = NULL;
+    if (node->value.buffer_size != 0)
+    {
+        range_index_remove(map, key);
+    }
+
+    map->count--;
+
+    /*
+    Backward shift deletion: walk the rest of the probe run and move every entry, whose home slot
+    does not lie between the hole and its current position, into the hole. This keeps all probe
+    sequences intact without leaving tombstones behind.
+    */
 
-    while (current_node != NULL)
+    uint32_t mask = map->capacity - 1;
+    uint32_t hole = (uint32_t)(node - map->slots);
+    uint32_t index = (hole + 1) & mask;
+
+    while (map->slots[index].key != NULL)
     {
-        if (current_node->key == key)
+        uint32_t home = home_slot(map, map->slots[index].key);
+
+        if (((index - home) & mask) >= ((index - hole) & mask))
         {
-            if (previous_node == NULL)
-            {
-                map->buckets[hash] = current_node->next;
-            }
-            else
-            {
-                previous_node->next = current_node->next;
-            }
+            map->slots[hole] = map->slots[index];
+            hole = index;
+        }
 
-            /* Remove all gep instructions of this node */
-            gep_instruction* current_gep_instruction = current_node->value.gep_instructions;
-            while (current_gep_instruction != NULL)
-            {
-                gep_instruction* next_gep_instruction = current_gep_instruction->next_gep_instruction;
-                free(current_gep_instruction);
-                current_gep_instruction = next_gep_instruction;
-            }
+        index = (index + 1) & mask;
+    }
+
+    map->slots[hole].key = NULL;
+    map->slots[hole].value.gep_instructions = NULL;
+}
 
-            free(current_node);
-            return;
+void mark_buffers_persistent(hash_map_t* map)
+{
+    if (map == NULL)
+        return;
+
+    for (uint32_t i = 0; i < map->capacity; i++)
+    {
+        if (map->slots[i].key != NULL)
+        {
+            map->slots[i].value.persistent = 1;
         }
+    }
+}
 
-        previous_node = current_node;
-        current_node = current_node->next;
+void reset_hash_map(hash_map_t* map)
+{
+    if (map == NULL)
+        return;
+
+    uint32_t i = 0;
+
+    while (i < map->capacity)
+    {
+        node_t* node = &map->slots[i];
+
+        if (node->key != NULL && !node->value.persistent)
+        {
+            /*
+            The backward shift may move another entry into this slot, so look at it again. Entries
+            that wrap around from the start of the table may be visited twice, which does no harm.
+            */
+            remove_node(map, node->key);
+            continue;
+        }
+
+        if (node->key != NULL)
+        {
+            release_gep_instructions(map, node->value.gep_instructions);
+            node->value.gep_instructions = NULL;
+        }
+
+        i++;
     }
-}
\ No newline at end of file
+}
@@ -5,17 +5,29 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-#define HASH_MAP_SIZE 500
+/* Initial number of slots, has to be a power of two. The table doubles whenever it is half full. */
+#define HASH_MAP_SIZE 1024
+
+/* Number of gep_instruction nodes carved out of one arena chunk. */
+#define GEP_ARENA_CHUNK 1024
 
 /*
     Hash map implementation for mapping buffer addresses to buffer IDs
     This is used to find the buffer ID of a buffer given its address
+
+    The map uses open addressing with linear probing. Entries are stored inline in the slot
+    array, a slot with key NULL is empty. Deleted entries are not marked with tombstones,
+    instead the following entries of the probe sequence are shifted back.
 */
 
 typedef struct gep_instruction {
     uint64_t gep_id;
     uint64_t accessed_byte;
 
+    /* Used by the runtime to find the shared memory record of this access again, 0 if there is none. */
+    uint32_t record;
+    uint32_t record_generation;
+
     struct gep_instruction* next_gep_instruction;
 } gep_instruction;
 
@@ -28,19 +40,77 @@ typedef struct BufferInfo {
     void* buffer_address;
     uint64_t buffer_size;
     gep_instruction* gep_instructions;
+    uint8_t persistent;     // Survives reset_hash_map(), see mark_buffers_persistent()
 } BufferInfo;
 
 typedef struct map_node
 {
     void* key;
     BufferInfo value;
-
-    struct map_node* next;
 } node_t;
 
+/*
+    gep_instruction nodes are handed out from chunks of GEP_ARENA_CHUNK nodes. Nodes of removed
+    buffers go back to a free list and are reused before a new chunk is allocated.
+*/
+
+typedef struct gep_arena_chunk
+{
+    struct gep_arena_chunk* next;
+    gep_instruction nodes[GEP_ARENA_CHUNK];
+} gep_arena_chunk_t;
+
+/*
+    Every buffer with a known size is also kept in a range index, so that a pointer into the middle of a
+    buffer can be resolved to the buffer that contains it. The index is a treap (a binary search tree
+    on the start address that is kept balanced by random heap priorities), which gives O(log n) lookups,
+    insertions and removals. Nodes live in one growable array and refer to each other by index, index 0
+    is the empty tree.
+*/
+
+typedef struct range_node
+{
+    uintptr_t start;
+    uint64_t size;
+    uint32_t priority;
+    uint32_t left;
+    uint32_t right;
+} range_node_t;
+
+/*
+    Shadow of the largest accessed byte per gep ID, checked inline by the instrumentation so that
+    update_buffer() is only called for an access that may be a new maximum. The map keeps it in sync:
+    update_node() fills the entry of every (buffer, gep) pair it looks at, and the entry is cleared as
+    soon as the pair is dropped. 'base' is the pointer the access went through, 'max_accessed_byte' is
+    relative to it.
+*/
+
+typedef struct buffer_shadow
+{
+    void* base;
+    uint64_t max_accessed_byte;
+} buffer_shadow_t;
+
 typedef struct hash_map
 {
-    node_t* buckets[HASH_MAP_SIZE];
+    node_t* slots;
+    uint32_t capacity;      // Number of slots, always a power of two
+    uint32_t shift;         // 32 - log2(capacity), used to turn a hash into a slot index
+    uint32_t count;         // Number of used slots
+
+    gep_arena_chunk_t* arena;
+    uint32_t arena_used;    // Nodes used in the newest chunk
+    gep_instruction* free_gep_instructions;
+
+    range_node_t* range_nodes;
+    uint32_t range_capacity;
+    uint32_t range_used;    // Next never used node index
+    uint32_t range_root;
+    uint32_t range_free;    // Free list of removed nodes, linked through 'left'
+    uint32_t range_seed;
+
+    buffer_shadow_t* shadow;    // Optional, NULL if there is none
+    uint32_t shadow_size;
 } hash_map_t;
 
 hash_map_t* create_hash_map();
@@ -55,15 +125,38 @@ uint32_t hash_function(void* key);
 
 BufferInfo get_buffer_data(hash_map_t* map, void* key);
 
+/*
+    Returns the start address of the buffer that contains 'address', or NULL if there is none.
+*/
+
+void* find_owning_buffer(hash_map_t* map, void* address);
+
 void insert_node(hash_map_t* map, void* key, uint32_t buffer_id, void* buffer_address, uint64_t buffer_size, uint64_t accessed_byte);
 
 /*
     Update the accessed byte of a buffer if the new accessed byte is greater than the current accessed byte.
-    Returns true if the accessed byte was updated, false otherwise.
+    'key' may also point into the middle of a buffer, in this case the offset of 'key' is added to the
+    accessed byte. Returns the gep instruction entry if the accessed byte was updated (or the entry was
+    created), NULL otherwise. If 'buffer_info' is not NULL, it is set to the buffer of the updated entry;
+    the pointer is only valid until the map is modified again.
 */
 
-uint8_t update_node(hash_map_t* map, void* key, uint64_t getelementptr_id, uint64_t accessed_byte);
+gep_instruction* update_node(hash_map_t* map, void* key, uint64_t getelementptr_id, uint64_t accessed_byte, BufferInfo** buffer_info);
 
 void remove_node(hash_map_t* map, void* key);
 
-#endif // HASH_MAP_H
\ No newline at end of file
+/*
+    Mark every buffer that is currently in the map as persistent. Used in persistent mode for the
+    buffers that have been created before the first iteration (globals, locals of main).
+*/
+
+void mark_buffers_persistent(hash_map_t* map);
+
+/*
+    Forget all recorded accesses and remove every buffer that is not persistent. Used between two
+    iterations in persistent mode.
+*/
+
+void reset_hash_map(hash_map_t* map);
+
+#endif // HASH_MAP_H
@@ -280,6 +280,33 @@ static void edit_params(u32 argc, char** argv) {
 #endif /* ^__APPLE__ */
     "_I(); } while (0)";
 
+  /* Testcases in shared memory, instead of stdin or a file. Both carry the
+     signature, so that afl-fuzz knows the harness asks for them. */
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_TESTCASE_BUF="
+    "({ static volatile char *_B __attribute__((used)); "
+    " _B = (char*)\"" SHM_FUZZ_SIG "\"; "
+#ifdef __APPLE__
+    "__attribute__((visibility(\"default\"))) "
+    "unsigned char *_F(void) __asm__(\"___afl_testcase_buf\"); "
+#else
+    "__attribute__((visibility(\"default\"))) "
+    "unsigned char *_F(void) __asm__(\"__afl_testcase_buf\"); "
+#endif /* ^__APPLE__ */
+    "_F(); })";
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_TESTCASE_LEN="
+    "({ static volatile char *_B __attribute__((used)); "
+    " _B = (char*)\"" SHM_FUZZ_SIG "\"; "
+#ifdef __APPLE__
+    "__attribute__((visibility(\"default\"))) "
+    "unsigned int _N(void) __asm__(\"___afl_testcase_len\"); "
+#else
+    "__attribute__((visibility(\"default\"))) "
+    "unsigned int _N(void) __asm__(\"__afl_testcase_len\"); "
+#endif /* ^__APPLE__ */
+    "_N(); })";
+
   if (x_set) {
     cc_params[cc_par_cnt++] = "-x";
     cc_params[cc_par_cnt++] = "none";
@@ -380,16 +407,23 @@ int main(int argc, char** argv) {
 
   edit_params(argc, argv);
 
+  /* AFL_NO_BUFFER_MONITOR gives a plain afl-clang-fast build, mostly to measure what the
+     BufferMonitor costs (see benchmarks/README.benchmarks). */
+
+  if (!getenv("AFL_NO_BUFFER_MONITOR")) {
+
     // Use BufferMonitor.so pass
-  cc_params[cc_par_cnt++] = "-Xclang";
-  cc_params[cc_par_cnt++] = "-load";
-  cc_params[cc_par_cnt++] = "-Xclang";
-  cc_params[cc_par_cnt++] = alloc_printf("%s/BufferMonitor.so", obj_path);
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = "-load";
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = alloc_printf("%s/BufferMonitor.so", obj_path);
 
-  // Needed by BufferMonitor.so pass
-  cc_params[cc_par_cnt++] = alloc_printf("%s/BufferMonitorLib.o", obj_path);
+    // Needed by BufferMonitor.so pass
+    cc_params[cc_par_cnt++] = alloc_printf("%s/BufferMonitorLib.o", obj_path);
 
-  cc_params[cc_par_cnt++] = alloc_printf("%s/HashMap.o", obj_path);
+    cc_params[cc_par_cnt++] = alloc_printf("%s/HashMap.o", obj_path);
+
+  }
 
   print_afl_clang_info();
 
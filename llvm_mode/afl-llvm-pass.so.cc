@@ -38,12 +38,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <vector>
+
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 using namespace llvm;
 
@@ -111,21 +116,167 @@ bool AFLCoverage::runOnModule(Module &M) {
       M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc",
       0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
 
-  /* Instrument all the things! */
+  /* In sparse trace mode, the index of every map entry that goes from zero to
+     non-zero is also appended to the list at __afl_touched_ptr, so that
+     afl-fuzz only has to look at those (see TOUCHED_LIST_SIZE in config.h).
+     Counters skip zero when they wrap, so every entry is listed once. The
+     signature tells afl-fuzz that the list is there. */
+
+  bool sparse = getenv("AFL_SPARSE_TRACE") != NULL;
+  GlobalVariable *AFLTouchedPtr = NULL;
+
+  if (sparse) {
+
+    AFLTouchedPtr =
+        new GlobalVariable(M, PointerType::get(Int32Ty, 0), false,
+                           GlobalValue::ExternalLinkage, 0, "__afl_touched_ptr");
+
+    Constant *SigStr = ConstantDataArray::getString(C, SPARSE_SIG);
+    GlobalVariable *Sig =
+        new GlobalVariable(M, SigStr->getType(), true,
+                           GlobalValue::PrivateLinkage, SigStr, "__afl_sparse_sig");
+
+    appendToUsed(M, Sig);
+
+  }
+
+  /* In dense map mode, every instrumented block gets the next entry of the
+     map instead of a random one, so the map is only as large as the program
+     (see DENSE_MAP_SECTION in config.h). Critical edges are split first:
+     then every edge has a block of its own, or shares the count of a block
+     it is the only way in or out of, and __afl_prev_loc isn't needed. */
+
+  bool dense = getenv("AFL_DENSE_MAP") != NULL;
+
+  if (dense && sparse)
+    FATAL("AFL_DENSE_MAP and AFL_SPARSE_TRACE are mutually exclusive");
+
+  if (dense) {
+
+    for (auto &F : M) {
+
+      std::vector<Instruction *> Terms;
+
+      for (auto &BB : F)
+        if (BB.getTerminator()) Terms.push_back(BB.getTerminator());
+
+      for (Instruction *TI : Terms) {
+
+        if (isa<IndirectBrInst>(TI) || isa<CallBrInst>(TI)) continue;
+
+        for (unsigned i = 0; i < TI->getNumSuccessors(); i++)
+          SplitCriticalEdge(TI, i);
+
+      }
+
+    }
+
+  }
+
+  /* Instrument all the things! Sparse mode adds blocks, and dense mode has to
+     know how many entries it needs, so take the list of blocks first. */
 
   int inst_blocks = 0;
 
+  std::vector<BasicBlock *> Blocks;
+
   for (auto &F : M)
-    for (auto &BB : F) {
+    for (auto &BB : F)
+      if (AFL_R(100) < inst_ratio) Blocks.push_back(&BB);
+
+  /* The entries of this module are the bytes of __afl_dense_ids, counted
+     from the start of the section; entry 0 belongs to the runtime. The
+     difference is only known after linking, so it is computed on the fly. */
+
+  IntegerType *Int64Ty = IntegerType::getInt64Ty(C);
+  Constant *DenseBase = NULL;
+
+  if (dense && !Blocks.empty()) {
+
+    ArrayType *IdsTy = ArrayType::get(Int8Ty, Blocks.size());
+
+    GlobalVariable *DenseIds =
+        new GlobalVariable(M, IdsTy, false, GlobalValue::PrivateLinkage,
+                           Constant::getNullValue(IdsTy), "__afl_dense_ids");
 
-      BasicBlock::iterator IP = BB.getFirstInsertionPt();
-      IRBuilder<> IRB(&(*IP));
+    DenseIds->setSection(DENSE_MAP_SECTION);
+    DenseIds->setAlignment(MaybeAlign(1));
+    appendToUsed(M, DenseIds);
 
-      if (AFL_R(100) >= inst_ratio) continue;
+    GlobalVariable *DenseStart =
+        new GlobalVariable(M, Int8Ty, false, GlobalValue::ExternalLinkage, 0,
+                           "__start_" DENSE_MAP_SECTION);
+    DenseStart->setVisibility(GlobalValue::HiddenVisibility);
+
+    DenseBase = ConstantExpr::getAdd(
+        ConstantExpr::getSub(ConstantExpr::getPtrToInt(DenseIds, Int64Ty),
+                             ConstantExpr::getPtrToInt(DenseStart, Int64Ty)),
+        ConstantInt::get(Int64Ty, 1));
+
+  }
+
+  /* Other modules leave a marker, so that the runtime and afl-fuzz can tell
+     if they end up in a dense binary. */
+
+  if (!dense && !Blocks.empty()) {
+
+    GlobalVariable *ClassicMarker =
+        new GlobalVariable(M, Int8Ty, false, GlobalValue::PrivateLinkage,
+                           ConstantInt::get(Int8Ty, 0), "__afl_classic_marker");
+
+    ClassicMarker->setSection(CLASSIC_MAP_SECTION);
+    appendToUsed(M, ClassicMarker);
+
+  }
 
-      /* Make up cur_loc */
+  /* A dense map larger than MAP_SIZE has to be set up before the first
+     instrumented constructor runs, and those can run before the runtime's
+     own. The module with main() has .preinit_array do it; shared libraries
+     can't have one. */
 
-      unsigned int cur_loc = AFL_R(MAP_SIZE);
+  Function *Main = M.getFunction("main");
+
+  if (dense && Main && !Main->isDeclaration() &&
+      Triple(M.getTargetTriple()).isOSBinFormatELF()) {
+
+    FunctionType *InitTy = FunctionType::get(Type::getVoidTy(C), false);
+    Constant *Init = cast<Constant>(
+        M.getOrInsertFunction("__afl_init_map_size", InitTy).getCallee());
+
+    GlobalVariable *Preinit =
+        new GlobalVariable(M, Init->getType(), true, GlobalValue::PrivateLinkage,
+                           Init, "__afl_preinit_map_size");
+
+    Preinit->setSection(".preinit_array");
+    appendToUsed(M, Preinit);
+
+  }
+
+  for (BasicBlock *BB : Blocks) {
+
+    BasicBlock::iterator IP = BB->getFirstInsertionPt();
+
+    /* Sparse mode splits the block; the static allocas must stay in the
+       entry block. */
+
+    if (sparse && BB == &BB->getParent()->getEntryBlock())
+      while (isa<AllocaInst>(*IP)) IP++;
+
+    IRBuilder<> IRB(&(*IP));
+
+    /* Make up cur_loc, or take the next dense entry */
+
+    unsigned int cur_loc = 0;
+    Value *MapIdx;
+
+    if (dense) {
+
+      MapIdx = ConstantExpr::getAdd(DenseBase,
+                                    ConstantInt::get(Int64Ty, inst_blocks));
+
+    } else {
+
+      cur_loc = AFL_R(MAP_SIZE);
 
       ConstantInt *CurLoc = ConstantInt::get(Int32Ty, cur_loc);
 
@@ -135,49 +286,96 @@ bool AFLCoverage::runOnModule(Module &M) {
       PrevLoc->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
       Value *PrevLocCasted = IRB.CreateZExt(PrevLoc, IRB.getInt32Ty());
 
-      /* Load SHM pointer */
+      MapIdx = IRB.CreateXor(PrevLocCasted, CurLoc);
+
+    }
+
+    /* Load SHM pointer */
+
+    LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtr);
+    MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+    
+    Value *MapPtrIdx = IRB.CreateGEP(MapPtr, MapIdx);
+    Instruction* GepInstruction = dyn_cast<Instruction>(MapPtrIdx);
+    // Getelementptr instruction should not be instrumented by the BufferMonitor pass 
+    GepInstruction->setMetadata(M.getMDKindID("gepinstruction"), MDNode::get(C, None)); 
+
+    /* Update bitmap */
+
+    LoadInst *Counter = IRB.CreateLoad(MapPtrIdx);
+    Counter->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+    Value *Incr = IRB.CreateAdd(Counter, ConstantInt::get(Int8Ty, 1));
+    Instruction* IncrInstruction = dyn_cast<Instruction>(Incr);
+    IncrInstruction->setMetadata(M.getMDKindID("nomonitorbuffer"), MDNode::get(C, None));
+
+    Value *IsNew = NULL;
 
-      LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtr);
-      MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-      
-      Value *MapPtrIdx =
-          IRB.CreateGEP(MapPtr, IRB.CreateXor(PrevLocCasted, CurLoc));
-      Instruction* GepInstruction = dyn_cast<Instruction>(MapPtrIdx);
-      // Getelementptr instruction should not be instrumented by the BufferMonitor pass 
-      GepInstruction->setMetadata(M.getMDKindID("gepinstruction"), MDNode::get(C, None)); 
+    if (sparse) {
 
-      /* Update bitmap */
+      IsNew = IRB.CreateICmpEQ(Counter, ConstantInt::get(Int8Ty, 0));
+      Incr = IRB.CreateAdd(Incr, IRB.CreateZExt(
+          IRB.CreateICmpEQ(Incr, ConstantInt::get(Int8Ty, 0)), Int8Ty));
 
-      LoadInst *Counter = IRB.CreateLoad(MapPtrIdx);
-      Counter->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-      Value *Incr = IRB.CreateAdd(Counter, ConstantInt::get(Int8Ty, 1));
-      Instruction* IncrInstruction = dyn_cast<Instruction>(Incr);
-      IncrInstruction->setMetadata(M.getMDKindID("nomonitorbuffer"), MDNode::get(C, None));
+    }
+
+    StoreInst *FirstStore = IRB.CreateStore(Incr, MapPtrIdx);
 
-      IRB.CreateStore(Incr, MapPtrIdx);
+    StoreInst* StoreIncr = IRB.CreateStore(Incr, MapPtrIdx);
+    StoreIncr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
 
-      StoreInst* StoreIncr = IRB.CreateStore(Incr, MapPtrIdx);
-      StoreIncr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+    /* Set prev_loc to cur_loc >> 1 */
 
-      /* Set prev_loc to cur_loc >> 1 */
+    if (!dense) {
 
       StoreInst *Store =
           IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> 1), AFLPrevLoc);
       Store->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
 
-      inst_blocks++;
+    }
+
+    /* Sparse mode: list the entry before setting it, so that a run killed
+       in between can't leave an entry behind that isn't listed. */
+
+    if (sparse) {
+
+      Instruction *Then = SplitBlockAndInsertIfThen(IsNew, FirstStore, false);
+      IRBuilder<> ThenIRB(Then);
+
+      LoadInst *List = ThenIRB.CreateLoad(PointerType::get(Int32Ty, 0), AFLTouchedPtr);
+      List->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+      /* Take the slot atomically, so that threads don't lose entries. */
+
+      AtomicRMWInst *Count = ThenIRB.CreateAtomicRMW(
+          AtomicRMWInst::Add, List, ConstantInt::get(Int32Ty, 1),
+          AtomicOrdering::Monotonic);
+      Count->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+      Value *Slot = ThenIRB.CreateGEP(Int32Ty, List, ThenIRB.CreateAdd(
+          ThenIRB.CreateAnd(Count, ConstantInt::get(Int32Ty, MAP_SIZE - 1)),
+          ConstantInt::get(Int32Ty, 1)));
+      dyn_cast<Instruction>(Slot)->setMetadata(M.getMDKindID("gepinstruction"),
+                                               MDNode::get(C, None));
+
+      StoreInst *StoreIdx = ThenIRB.CreateStore(MapIdx, Slot);
+      StoreIdx->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
 
     }
 
+    inst_blocks++;
+
+  }
+
   /* Say something nice. */
 
   if (!be_quiet) {
 
     if (!inst_blocks) WARNF("No instrumentation targets found.");
-    else OKF("Instrumented %u locations (%s mode, ratio %u%%).",
+    else OKF("Instrumented %u locations (%s mode, ratio %u%%%s).",
              inst_blocks, getenv("AFL_HARDEN") ? "hardened" :
              ((getenv("AFL_USE_ASAN") || getenv("AFL_USE_MSAN")) ?
-              "ASAN/MSAN" : "non-hardened"), inst_ratio);
+              "ASAN/MSAN" : "non-hardened"), inst_ratio,
+             sparse ? ", sparse trace" : (dense ? ", dense map" : ""));
 
   }
 
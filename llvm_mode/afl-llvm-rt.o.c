@@ -60,14 +60,105 @@
 u8  __afl_area_initial[MAP_SIZE];
 u8* __afl_area_ptr = __afl_area_initial;
 
+
+/* Binaries built with AFL_DENSE_MAP number their map entries by the bytes of
+   DENSE_MAP_SECTION (see ../config.h), and may need a larger map than
+   MAP_SIZE. In that case, __afl_area_dummy replaces __afl_area_initial.
+   Modules built without it leave a byte in CLASSIC_MAP_SECTION. */
+
+extern u8 __start_afl_dense_map[] __attribute__((weak, visibility("hidden")));
+extern u8 __stop_afl_dense_map[] __attribute__((weak, visibility("hidden")));
+extern u8 __start_afl_classic_map[] __attribute__((weak, visibility("hidden")));
+
+static u32 __afl_map_size = MAP_SIZE;
+static u8* __afl_area_dummy = __afl_area_initial;
+
 __thread u32 __afl_prev_loc;
 
 
+/* Map entries touched so far, for sparse trace mode (see TOUCHED_LIST_SIZE in
+   ../config.h). The instrumentation appends to whatever this points to; it
+   only points into the SHM if afl-fuzz asks for the list. */
+
+u32  __afl_touched_initial[MAP_SIZE + 1];
+u32* __afl_touched_ptr = __afl_touched_initial;
+
+
+/* Testcase SHM for harnesses that use __AFL_FUZZ_TESTCASE_BUF and
+   __AFL_FUZZ_TESTCASE_LEN (see SHM_FUZZ_SIZE in ../config.h). Without
+   afl-fuzz, the testcase is read from stdin into a buffer of the same
+   layout. */
+
+static u8* __afl_fuzz_shm;
+static u8* __afl_fuzz_stdin;
+
+
 /* Running in persistent mode? */
 
 static u8 is_persistent;
 
 
+/* Hooks of the BufferMonitor runtime (BufferMonitorLib.c). They are weak, so
+   that binaries linked without it keep working. */
+
+void __buffer_monitor_snapshot(void) __attribute__((weak));
+void __buffer_monitor_iteration_end(void) __attribute__((weak));
+
+
+/* Set the first map entry, and list it the way the instrumentation would. */
+
+static void __afl_set_first(void) {
+
+  u32 cnt = __afl_touched_ptr[0];
+
+  if (!__afl_area_ptr[0]) {
+    __afl_touched_ptr[1 + (cnt & (MAP_SIZE - 1))] = 0;
+    __afl_touched_ptr[0] = cnt + 1;
+  }
+
+  __afl_area_ptr[0] = 1;
+
+}
+
+
+/* Size the map for dense binaries. This has to happen before any of the
+   instrumented code runs, constructors included, so the instrumentation
+   calls it from .preinit_array in the module with main(). __afl_auto_init()
+   is too late for those, but catches binaries where that module isn't
+   instrumented. */
+
+void __afl_init_map_size(void) {
+
+  static u8 done;
+  u32 size;
+
+  if (done) return;
+  done = 1;
+
+  if (!__start_afl_dense_map) return;
+
+  /* Their entries would collide with the dense ones. */
+
+  if (__start_afl_classic_map) {
+    fprintf(stderr, "[-] ERROR: This binary mixes modules built with and "
+            "without AFL_DENSE_MAP.\n");
+    _exit(1);
+  }
+
+  size = __stop_afl_dense_map - __start_afl_dense_map + 1;
+  if (size <= MAP_SIZE) return;
+
+  __afl_area_dummy = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (__afl_area_dummy == MAP_FAILED) _exit(1);
+
+  __afl_area_ptr = __afl_area_dummy;
+  __afl_map_size = size;
+
+}
+
+
 /* SHM setup. */
 
 static void __afl_map_shm(void) {
@@ -88,10 +179,37 @@ static void __afl_map_shm(void) {
 
     if (__afl_area_ptr == (void *)-1) _exit(1);
 
+    /* Tools that don't know about dense maps hand out MAP_SIZE. */
+
+    if (__afl_map_size > MAP_SIZE) {
+
+      struct shmid_ds ds;
+
+      if (shmctl(shm_id, IPC_STAT, &ds) || ds.shm_segsz < __afl_map_size) {
+        fprintf(stderr, "[-] ERROR: The SHM region is too small for the %u byte "
+                "coverage map of this binary.\n", __afl_map_size);
+        _exit(1);
+      }
+
+    }
+
+    if (getenv(SPARSE_ENV_VAR))
+      __afl_touched_ptr = (u32*)(__afl_area_ptr + MAP_SIZE);
+
     /* Write something into the bitmap so that even with low AFL_INST_RATIO,
        our parent doesn't give up on us. */
 
-    __afl_area_ptr[0] = 1;
+    __afl_set_first();
+
+  }
+
+  id_str = getenv(SHM_FUZZ_ENV_VAR);
+
+  if (id_str) {
+
+    __afl_fuzz_shm = shmat(atoi(id_str), NULL, 0);
+
+    if (__afl_fuzz_shm == (void *)-1) _exit(1);
 
   }
 
@@ -195,9 +313,14 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
     if (is_persistent) {
 
-      memset(__afl_area_ptr, 0, MAP_SIZE);
-      __afl_area_ptr[0] = 1;
+      memset(__afl_area_ptr, 0, __afl_map_size);
+      __afl_touched_ptr[0] = 0;
+      __afl_set_first();
       __afl_prev_loc = 0;
+
+      /* Same for the buffer accesses, but keep the buffers themselves. */
+
+      if (__buffer_monitor_snapshot) __buffer_monitor_snapshot();
     }
 
     cycle_cnt  = max_cnt;
@@ -210,9 +333,11 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
     if (--cycle_cnt) {
 
+      if (__buffer_monitor_iteration_end) __buffer_monitor_iteration_end();
+
       raise(SIGSTOP);
 
-      __afl_area_ptr[0] = 1;
+      __afl_set_first();
       __afl_prev_loc = 0;
 
       return 1;
@@ -223,7 +348,8 @@ int __afl_persistent_loop(unsigned int max_cnt) {
          follows the loop is not traced. We do that by pivoting back to the
          dummy output region. */
 
-      __afl_area_ptr = __afl_area_initial;
+      __afl_area_ptr = __afl_area_dummy;
+      __afl_touched_ptr = __afl_touched_initial;
 
     }
 
@@ -244,6 +370,13 @@ void __afl_manual_init(void) {
   if (!init_done) {
 
     __afl_map_shm();
+
+    /* In deferred mode, BufferMonitor is already up and running. Every
+       child should start out with the buffers known so far, but without
+       the accesses made before this point. */
+
+    if (__buffer_monitor_snapshot) __buffer_monitor_snapshot();
+
     __afl_start_forkserver();
     init_done = 1;
 
@@ -252,10 +385,55 @@ void __afl_manual_init(void) {
 }
 
 
+/* The testcase for __AFL_FUZZ_TESTCASE_BUF, as explained in README.llvm.
+   The pointer stays the same for the whole run. */
+
+u8* __afl_testcase_buf(void) {
+
+  if (__afl_fuzz_shm) return __afl_fuzz_shm + 4;
+
+  if (!__afl_fuzz_stdin) {
+
+    __afl_fuzz_stdin = mmap(NULL, SHM_FUZZ_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (__afl_fuzz_stdin == MAP_FAILED) abort();
+
+  }
+
+  return __afl_fuzz_stdin + 4;
+
+}
+
+
+/* The length for __AFL_FUZZ_TESTCASE_LEN. Without afl-fuzz, this is where
+   the next testcase is read from stdin, so call it once per iteration. */
+
+u32 __afl_testcase_len(void) {
+
+  u8* buf;
+  u32 len = 0;
+  s32 res;
+
+  if (__afl_fuzz_shm) return *(u32*)__afl_fuzz_shm;
+
+  buf = __afl_testcase_buf();
+
+  while (len < MAX_FILE && (res = read(0, buf + len, MAX_FILE - len)) > 0)
+    len += res;
+
+  *(u32*)(buf - 4) = len;
+  return len;
+
+}
+
+
 /* P1oper initialization routine. */
 
 __attribute__((constructor(CONST_PRIO))) void __afl_auto_init(void) {
 
+  __afl_init_map_size();
+
   is_persistent = !!getenv(PERSIST_ENV_VAR);
 
   if (getenv(DEFER_ENV_VAR)) return;
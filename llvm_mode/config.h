@@ -7,8 +7,40 @@
 // Size of shared memory region for buffer data created by BufferMonitor pass
 #define SHARED_MEM_SIZE 30000 // 30 KB
 
+// Size of the header at the start of the shared memory, one cache line (see BufferShm.h)
+#define BUFFER_SHM_HEADER_SIZE 64
+
 // Size of one buffer data chunk
-#define CHUNK_SIZE (sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint64_t))
+#define CHUNK_SIZE (sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint64_t))
 
 // How many buffer data chunks fit in shared memory location
-#define BUFFER_DATA_CHUNK_COUNT (SHARED_MEM_SIZE / CHUNK_SIZE)
\ No newline at end of file
+#define BUFFER_DATA_CHUNK_COUNT ((SHARED_MEM_SIZE - BUFFER_SHM_HEADER_SIZE) / CHUNK_SIZE)
+
+// Size of the closeness map at the end of the shared memory, gep IDs are taken modulo this (see BufferShm.h)
+#define BUFFER_DIST_MAP_SIZE (1 << 14)
+
+// Maximum number of getelementptr IDs afl-fuzz keeps distances for, records with higher IDs are dropped
+#define BUFFER_DIST_MAX_GEPS (1 << 22)
+
+// Environment variable used by afl-fuzz to pass the ID of the buffer data shared memory to the target
+#define BUFFER_SHM_ENV_VAR "__AFL_BUFFER_SHM_ID"
+
+// If set in the environment of the target, the first access past the end of a buffer aborts it (see BufferShm.h)
+#define BUFFER_FAIL_FAST_ENV_VAR "AFL_BUFFER_FAIL_FAST"
+
+// Number of calls without a new maximum after which a gep is ignored for the rest of an execution
+#define BUFFER_THROTTLE_ENV_VAR "AFL_BUFFER_THROTTLE"
+
+// File the runtime appends its counters to at exit, used by benchmarks/exec_bench
+#define BUFFER_STATS_ENV_VAR "AFL_BUFFER_STATS"
+
+// Files with the functions and source files the pass should (not) instrument, read at compile time
+#define BUFFER_ALLOWLIST_ENV_VAR "AFL_BUFFER_ALLOWLIST"
+#define BUFFER_DENYLIST_ENV_VAR "AFL_BUFFER_DENYLIST"
+
+/*
+   Publish every new maximum of a (buffer, gep) pair in the shared memory as soon as it happens,
+   instead of dumping the whole hash map in the destructor. Runs that crash, time out or call _exit()
+   then still report their buffer accesses. Comment out to get the destructor dump back.
+*/
+#define STREAM_BUFFER_DATA
@@ -0,0 +1,73 @@
+/*
+   american fuzzy lop - a dense map test program
+   ---------------------------------------------
+
+   Built with AFL_DENSE_MAP=1 by 'make test_build'. It has more blocks than
+   MAP_SIZE, so the runtime has to replace __afl_area_initial with a larger
+   map, and has to do so before the first instrumented constructor runs.
+   The constructor below runs before the runtime's own, like the ones the
+   BufferMonitor pass adds to every module, and checks that.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../config.h"
+
+/* The instrumentation declares some of these itself, under the same names
+   and with different types, so go through asm labels. */
+
+extern unsigned char  area_initial[] __asm__("__afl_area_initial");
+extern unsigned char* area_ptr __asm__("__afl_area_ptr");
+
+extern unsigned char dense_start[] __asm__("__start_" DENSE_MAP_SECTION);
+extern unsigned char dense_stop[] __asm__("__stop_" DENSE_MAP_SECTION);
+
+static volatile unsigned char hits[256];
+static unsigned char in[64];
+
+/* 4096 branches per function, 8 functions: about three map entries each,
+   once the critical edges are split. */
+
+#define B1(_n)    if (in[(_n) & 63] == ((_n) & 255)) hits[(_n) & 255]++;
+#define B4(_n)    B1(_n) B1((_n) + 1) B1((_n) + 2) B1((_n) + 3)
+#define B16(_n)   B4(_n) B4((_n) + 4) B4((_n) + 8) B4((_n) + 12)
+#define B256(_n)  B16(_n) B16((_n) + 16) B16((_n) + 32) B16((_n) + 48) \
+                  B16((_n) + 64) B16((_n) + 80) B16((_n) + 96) B16((_n) + 112) \
+                  B16((_n) + 128) B16((_n) + 144) B16((_n) + 160) B16((_n) + 176) \
+                  B16((_n) + 192) B16((_n) + 208) B16((_n) + 224) B16((_n) + 240)
+#define B4096(_n) B256(_n) B256((_n) + 256) B256((_n) + 512) B256((_n) + 768) \
+                  B256((_n) + 1024) B256((_n) + 1280) B256((_n) + 1536) B256((_n) + 1792) \
+                  B256((_n) + 2048) B256((_n) + 2304) B256((_n) + 2560) B256((_n) + 2816) \
+                  B256((_n) + 3072) B256((_n) + 3328) B256((_n) + 3584) B256((_n) + 3840)
+
+#define FUNC(_i) static void __attribute__((noinline)) f##_i(void) { B4096((_i) * 4096) }
+
+FUNC(0) FUNC(1) FUNC(2) FUNC(3) FUNC(4) FUNC(5) FUNC(6) FUNC(7)
+
+#pragma clang diagnostic ignored "-Wprio-ctor-dtor"
+
+__attribute__((constructor(0))) static void early_ctor(void) {
+
+  if (area_ptr == area_initial) {
+    fprintf(stderr, "[-] The map was not set up before the constructors.\n");
+    _exit(1);
+  }
+
+}
+
+int main(int argc, char** argv) {
+
+  if (dense_stop - dense_start < MAP_SIZE) {
+    fprintf(stderr, "[-] The dense map is not larger than MAP_SIZE.\n");
+    exit(1);
+  }
+
+  if (read(0, in, sizeof(in)) < 0) exit(1);
+
+  f0(); f1(); f2(); f3(); f4(); f5(); f6(); f7();
+
+  exit(0);
+
+}
@@ -3,4 +3,3 @@
 set -x
 echo core | sudo tee /proc/sys/kernel/core_pattern
 echo performance | sudo tee /sys/devices/system/cpu/cpu*/cpufreq/scaling_governor
-rm /var/tmp/ID.log